@@ -10,17 +10,78 @@ cmake_minimum_required(VERSION 3.16)
 project(RailConnectQt VERSION 1.0 LANGUAGES CXX)
 set(CMAKE_CXX_STANDARD 17)
 set(CMAKE_CXX_STANDARD_REQUIRED ON)
-find_package(Qt6 COMPONENTS Widgets Core Gui REQUIRED)
+find_package(Qt6 COMPONENTS Widgets Core Gui Concurrent Network REQUIRED)
+option(RAILCONNECT_METRICS "Record latency histograms and counters of booking operations" ON)
+option(RAILCONNECT_TRACING "Keep recent trace spans per thread for Chrome trace export" ON)
+option(RAILCONNECT_BENCH "Also build RailConnectBench, timing hot paths on synthetic data" OFF)
 
-add_executable(RailConnect
-    main.cpp
+# everything but the entry point, shared by the app and the benchmarks
+set(RAILCONNECT_SOURCES
     mainwindow.h
     mainwindow.cpp
     models.h
     models.cpp
+    jsonexport.h
+    jsonexport.cpp
+    timetable.h
+    timetable.cpp
+    planner.h
+    planner.cpp
+    inventory.h
+    inventory.cpp
+    runs.h
+    runs.cpp
+    waitlist.h
+    waitlist.cpp
+    timerwheel.h
+    timerwheel.cpp
+    requestcache.h
+    requestcache.cpp
+    fares.h
+    fares.cpp
+    farescript.h
+    farescript.cpp
+    demand.h
+    demand.cpp
+    coaches.h
+    allocator.h
+    allocator.cpp
+    metrics.h
+    metrics.cpp
+    trace.h
+    trace.cpp
+    metricsserver.h
+    metricsserver.cpp
+    importer.h
+    importer.cpp
+    chart.h
+    chart.cpp
+    analytics.h
+    analytics.cpp
+    totals.h
+    totals.cpp
+    dashboard.h
+    dashboard.cpp
+    browser.h
+    browser.cpp
 )
 
-target_link_libraries(RailConnect PRIVATE Qt6::Widgets Qt6::Core Qt6::Gui)
+add_executable(RailConnect main.cpp ${RAILCONNECT_SOURCES})
+set(RAILCONNECT_TARGETS RailConnect)
+if(RAILCONNECT_BENCH)
+    add_executable(RailConnectBench bench.cpp ${RAILCONNECT_SOURCES})
+    list(APPEND RAILCONNECT_TARGETS RailConnectBench)
+endif()
+
+foreach(target IN LISTS RAILCONNECT_TARGETS)
+    target_link_libraries(${target} PRIVATE Qt6::Widgets Qt6::Core Qt6::Gui Qt6::Concurrent Qt6::Network)
+    if(RAILCONNECT_METRICS)
+        target_compile_definitions(${target} PRIVATE RAILCONNECT_METRICS)
+    endif()
+    if(RAILCONNECT_TRACING)
+        target_compile_definitions(${target} PRIVATE RAILCONNECT_TRACING)
+    endif()
+endforeach()
 
 // -----------------------------
 // FILE: models.h
@@ -36,6 +97,43 @@ target_link_libraries(RailConnect PRIVATE Qt6::Widgets Qt6::Core Qt6::Gui)
 #include <QFile>
 #include <QQueue>
 #include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QDate>
+#include <QDateTime>
+#include <QStringList>
+#include <functional>
+#include "timetable.h"
+#include "planner.h"
+#include "inventory.h"
+#include "runs.h"
+#include "waitlist.h"
+#include "timerwheel.h"
+#include "requestcache.h"
+#include "fares.h"
+#include "demand.h"
+#include "coaches.h"
+#include "allocator.h"
+#include "chart.h"
+#include "totals.h"
+
+// A block of identical coaches, e.g. 10 sleeper coaches of 72 berths.
+struct CoachGroup {
+    SeatClass seatClass = SeatClass::Sleeper;
+    int coaches = 1;
+    int seatsPerCoach = 0;
+
+    static CoachGroup standard(SeatClass c, int coaches) { return CoachGroup{c, coaches, coachTable(c).seats}; }
+    QJsonObject toJson() const;
+    static CoachGroup fromJson(const QJsonObject &obj); // seats default to the standard layout
+};
+
+// Where a seat of a run is: coach and place are 1-based, coach 0 = no such seat
+struct SeatPlace {
+    SeatClass seatClass;
+    int coach;
+    int seat;
+};
 
 // Train structure
 struct Train {
@@ -44,266 +142,6505 @@ struct Train {
     QString source;
     QString destination;
     int totalSeats;
-    int bookedSeats;
+    int bookedSeats; // load of one dated run; filled in search results, not persisted
     double baseFare;
+    QVector<Stop> stops; // ordered calls incl. source and destination; may be empty
+    int racSeats = 0;    // RAC places per class of a run
+    QVector<CoachGroup> coaches; // empty: all totalSeats are Sleeper; else totalSeats is their sum
+
+    // seats per SeatClass (kClassCount entries); a run numbers them class after class
+    QVector<int> classSeats() const;
+    SeatPlace place(int seatNo) const;
+    QString seatLabel(int seatNo) const; // e.g. "S1/12 LB"
+
+    QJsonObject toJson() const;
+    static Train fromJson(const QJsonObject &obj);
+};
+
+// Passenger
+struct Passenger {
+    QString name;
+    int age;
+    QString gender;
+    QString pnr;
+    QString trainId;
+    int seatNo;
+    double fare;
+    int fromStop = 0;  // boarding/alighting positions on the train's route,
+    int toStop = -1;   // -1 = the final stop
+    QDate journeyDate; // date of the run; invalid = today
+    SeatClass seatClass = SeatClass::Sleeper;
+    int berthPref = -1; // a Berth, -1 = no preference
+    Quota quota = Quota::General;
+    BookingStatus status = BookingStatus::Confirmed;
+    int waitSeq = -1;  // arrival order within its RAC/waitlist queue
+
+    QJsonObject toJson() const;
+    void appendJson(QByteArray &out) const; // streaming form of toJson()
+    static Passenger fromJson(const QJsonObject &obj);
+};
+
+// Seats held for a group during checkout. They count as taken until the
+// hold is confirmed, released or expires.
+struct SeatHold {
+    QVector<Passenger> group; // seatNo assigned; priced and given a PNR on confirm
+    qint64 expiresAt;         // seconds since epoch
+};
+
+// trains.json as read for a hot reload; built on any thread
+struct TrainFile {
+    bool ok = false;    // false: missing, unreadable or not a JSON array
+    QByteArray digest;  // SHA-1 of the file's bytes
+    QVector<Train> trains;
+};
+
+// What a hot reload changed
+struct TrainDiff {
+    int added = 0;
+    int updated = 0;
+    int removed = 0;
+    // bookings of updated/removed trains
+    int reseated = 0;      // moved to another seat of their run
+    int requeued = 0;      // no seat left: moved to RAC or the waitlist
+    int cancelled = 0;     // confirmed or queued, on a train, station or class that is gone
+    int holdsReleased = 0; // a member could not be seated on the new route
+    bool isEmpty() const { return added + updated + removed == 0; }
+};
+
+// Outcome of bookTicket
+enum class BookResult {
+    Failed,      // unknown train or class, or no open run on that date
+    Booked,      // a new ticket, confirmed or queued
+    Repeated,    // requestKey seen before: the first call's ticket is returned
+    Cancelled,   // requestKey seen before, but its ticket has been cancelled since
+    KeyConflict, // requestKey seen before for another train, date, class or passenger
+};
+
+// Seats and price of one class of a search hit
+struct ClassOffer {
+    SeatClass seatClass;
+    int available; // free seats of the class over the journey
+    double fare;   // adult General quote
+};
+
+// A search hit: the train plus where the passenger boards and alights
+struct TrainMatch {
+    Train train;
+    int fromStop;  // index into the train's route
+    int toStop;
+    int departure; // minutes, -1 if not timetabled
+    int arrival;
+    int available; // free seats over every hop between fromStop and toStop
+    double fare;   // quote of the first class in classes
+    QVector<ClassOffer> classes; // every class the train has, in SeatClass order
+};
+
+// BookingDatabase holds trains and bookings using data structures
+class BookingDatabase {
+public:
+    BookingDatabase();
+
+    // train operations
+    void addTrain(const Train &t);
+    // bulk form: indexes are rebuilt once for the batch and the result saved;
+    // trains with an empty or already known ID are skipped. Returns trains added.
+    int addTrains(const QVector<Train> &batch);
+    // any boarding/alighting pair along a route; departAfter/departBefore are
+    // minutes after midnight at the boarding stop, -1 leaves that side open
+    QVector<TrainMatch> searchTrains(const QString &src, const QString &dst, const QDate &date,
+                                     int departAfter = -1, int departBefore = -1) const;
+    QVector<TrainMatch> allTrains(const QDate &date) const; // every train over its whole route
+    Train* findTrain(const QString &trainId);
+    int stopIndex(const QString &trainId, const QString &station) const; // -1 if not on route
+    // itineraries with changes of train, one per transfer count (see JourneyPlanner)
+    QVector<Journey> planJourneys(const QString &src, const QString &dst,
+                                  int departAfter, int maxTransfers = 2) const;
+
+    // booking operations
+    // confirms, or queues as RAC/waitlisted when full; *booked gets the stored record.
+    // A repeated requestKey returns the ticket of the first call instead of booking
+    // again, provided it asks for the same thing; empty = no dedupe.
+    BookResult bookTicket(const QString &trainId, const Passenger &p, Passenger *booked = nullptr,
+                          const QString &requestKey = QString());
+    bool cancelTicket(const QString &pnr);
+    // bulk forms: free every seat in one pass, promote once per run, save once
+    int cancelMany(const QStringList &pnrs);
+    // train (or one dated run of it) called off: drops its bookings, waitlist
+    // and holds; the runs stay closed to bookings and holds until they depart
+    int cancelTrain(const QString &trainId, const QDate &date = QDate());
+    Passenger* findPassenger(const QString &pnr);
+
+    // two-phase checkout: seats are held for ttlSeconds (all or none of the
+    // group), then confirmed into tickets or released
+    quint64 holdSeats(const QString &trainId, const QVector<Passenger> &group, int ttlSeconds = 600);
+    // PNRs; empty if unknown or expired. A repeated requestKey for the same
+    // hold returns the PNRs of the first call; one used for another hold, none.
+    QStringList confirmHold(quint64 holdId, const QString &requestKey = QString());
+    bool releaseHold(quint64 holdId);
+    void expireHolds();                      // fires due hold timers; cheap to call often
+
+    int waitlistPosition(const QString &pnr) const { return waitlist.position(pnr); } // RAC/WL number
+    int bookedSeats(const QString &trainId, const QDate &date) const; // peak load of that run
+
+    // advance-booking window; runs before today are archived and dropped
+    int bookingWindow() const { return runs.windowDays(); }
+    void setBookingWindow(int days) {
+        runs.setWindowDays(days);
+        totals.setWindowDays(runs.windowDays());
+        changed(QString(), QDate());
+    }
+    void rollWindow();
+
+    // recompiles fareRulesFile when it changed on disk; true if the script was
+    // replaced or removed, with *error set when it did not compile
+    bool reloadFareRules(QString *error = nullptr);
+
+    // persistence
+    bool loadFromFiles();
+    bool saveToFiles() const;
+
+    // hot reload: readTrainFile parses off the GUI thread, applyTrainFile
+    // diffs by trainId and keeps bookings, re-seating only changed trains.
+    // Our own saves are recognised by digest and ignored.
+    QString trainsPath() const { return trainsFile; }
+    QString archivePath() const { return archiveFile; }
+    static TrainFile readTrainFile(const QString &path);
+    TrainDiff applyTrainFile(const TrainFile &file);
+
+    // Prometheus text format: run occupancy, waitlist depth, booking counters,
+    // persistence lag and operation latency, all read from state that is kept
+    // up to date as bookings change
+    QByteArray metricsText() const;
+
+    // told of every change to a run's seats or queues as (trainId, date), and
+    // with (empty, invalid) when trains or the booking window change wholesale
+    using ChangeListener = std::function<void(const QString &trainId, const QDate &date)>;
+    void setChangeListener(ChangeListener f) { changeListener = std::move(f); }
+
+    QVector<Train> trains;
+    QVector<Passenger> passengers; // simple vector for booked passengers
+    WaitlistEngine<Passenger> waitlist; // RAC and waitlisted tickets, per run and quota
+    Timetable timetable;           // stop times of all trains, rebuilt on load
+    JourneyPlanner planner;        // connection array derived from timetable
+    RunCalendar runs;              // per (trainId, date): seat occupancy per hop
+    FareEngine fares;              // fare rules compiled per route, rebuilt with the timetable
+    DemandPricing pricing;         // turns each run's booking pace into its surge
+    SeatAllocator seating;         // coach layout per train, for preference-aware seating
+    ManifestIndex manifests;       // trainId -> rows of passengers, kept with pnrIndex
+    LiveTotals totals;             // dashboard figures, updated per ticket
+
+private:
+    TrainRun *trainRun(int trainIndex, const QDate &date);
+    bool resolveStops(int trainIndex, Passenger &p) const;
+    FareQuery fareQuery(int trainIndex, int fromStop, int toStop, const QDate &date) const;
+    void priceMatches(QVector<TrainMatch> &res, const QVector<int> &trainIndex, const QDate &date) const;
+    void recordDemand(const QString &trainId, const QDate &date, int delta);
+    void refreshDemand();
+    int rebuildInventory(); // returns bookings moved off a seat they could not keep
+    static SeatRequest seatRequest(const Passenger &p);
+    bool confirmSeat(int trainIndex, TrainRun *run, Passenger &p);
+    void commitSeat(int trainIndex, TrainRun *run, Passenger &p);
+    // false if unknown; *moved set when freed seats promoted or re-queued tickets
+    bool dropHold(quint64 holdId, bool *moved = nullptr);
+    bool fillFreedPlaces(int trainIndex, const QDate &date); // true if any ticket moved
+    static QString newPnr();
+    static QString requestFingerprint(const QString &trainId, const Passenger &p); // for RequestCache
+    using RunRef = QPair<QString, qint64>; // (trainId, julian day)
+    bool dropTicket(const QString &pnr, QSet<RunRef> &freed);
+    void removePassengerAt(int i, bool refunded); // refunded: a cancellation, not a move to the queues
+    void changed(const QString &trainId, const QDate &date) const {
+        if (changeListener) changeListener(trainId, date);
+    }
+    void rebuildPnrIndex();
+
+    QHash<QString, int> pnrIndex; // pnr -> index into passengers
+    QHash<quint64, SeatHold> holds;
+    QSet<RunRef> cancelledRuns;   // called off by cancelTrain, saved with the bookings
+    TimerWheel holdTimers;        // expiry of holds; released holds are skipped when they fire
+    quint64 nextHoldId = 1;
+    RequestCache requests;        // idempotency key -> PNRs of recent bookings, saved with them
+    ChangeListener changeListener;
+
+    QString trainsFile = "trains.json";
+    QString bookingsFile = "bookings.json";
+    QString archiveFile = "bookings-archive.jsonl"; // one past booking per line
+    QString fareRulesFile = "fares.rules";           // FareScript source, optional
+    QDateTime fareRulesStamp;                        // mtime of the loaded script
+    mutable QByteArray trainsDigest; // of trains.json as last read or written
+    mutable qint64 unsavedSince = 0; // ms since epoch of the oldest change not on disk, 0 = none
+    mutable qint64 lastSaved = 0;    // ms since epoch of the last successful save
+};
+
+#endif // MODELS_H
+
+// -----------------------------
+// FILE: models.cpp
+// -----------------------------
+
+#include "models.h"
+#include "jsonexport.h"
+#include <QJsonDocument>
+#include <QDateTime>
+#include <QUuid>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QCryptographicHash>
+#include <algorithm>
+#include "metrics.h"
+#include "trace.h"
+
+QJsonObject CoachGroup::toJson() const {
+    QJsonObject obj;
+    obj["class"] = classCode(seatClass);
+    obj["coaches"] = coaches;
+    obj["seats"] = seatsPerCoach;
+    return obj;
+}
+
+CoachGroup CoachGroup::fromJson(const QJsonObject &obj) {
+    CoachGroup g;
+    g.seatClass = classFromCode(obj["class"].toString());
+    g.coaches = qMax(0, obj["coaches"].toInt(1));
+    g.seatsPerCoach = qMax(0, obj["seats"].toInt(coachTable(g.seatClass).seats));
+    return g;
+}
+
+QVector<int> Train::classSeats() const {
+    QVector<int> seats(kClassCount, 0);
+    if (coaches.isEmpty()) seats[int(SeatClass::Sleeper)] = totalSeats;
+    for (const CoachGroup &g: coaches) seats[int(g.seatClass)] += g.coaches * g.seatsPerCoach;
+    return seats;
+}
+
+SeatPlace Train::place(int seatNo) const {
+    // a run numbers seats class after class, and coaches of a class in list order
+    const QVector<int> seats = classSeats();
+    int n = seatNo;
+    for (int c = 0; c < kClassCount && n > 0; ++c) {
+        if (n > seats[c]) { n -= seats[c]; continue; }
+        if (coaches.isEmpty()) {
+            const int per = coachTable(SeatClass(c)).seats;
+            return SeatPlace{SeatClass(c), (n - 1) / per + 1, (n - 1) % per + 1};
+        }
+        int before = 0; // coaches of this class in earlier groups
+        for (const CoachGroup &g: coaches) {
+            if (int(g.seatClass) != c || g.seatsPerCoach == 0) continue;
+            if (n <= g.coaches * g.seatsPerCoach)
+                return SeatPlace{SeatClass(c), before + (n - 1) / g.seatsPerCoach + 1, (n - 1) % g.seatsPerCoach + 1};
+            n -= g.coaches * g.seatsPerCoach;
+            before += g.coaches;
+        }
+    }
+    return SeatPlace{SeatClass::Sleeper, 0, 0};
+}
+
+QString Train::seatLabel(int seatNo) const {
+    const SeatPlace at = place(seatNo);
+    if (at.coach == 0) return QString::number(seatNo);
+    return QString("%1%2/%3 %4").arg(QChar(coachTable(at.seatClass).prefix)).arg(at.coach)
+        .arg(at.seat).arg(berthCode(berthOf(at.seatClass, at.seat)));
+}
+
+QJsonObject Train::toJson() const {
+    QJsonObject obj;
+    obj["trainId"] = trainId;
+    obj["name"] = name;
+    obj["source"] = source;
+    obj["destination"] = destination;
+    obj["totalSeats"] = totalSeats;
+    obj["baseFare"] = baseFare;
+    obj["racSeats"] = racSeats;
+    if (!stops.isEmpty()) {
+        QJsonArray sarr;
+        for (const Stop &s: stops) sarr.append(s.toJson());
+        obj["stops"] = sarr;
+    }
+    if (!coaches.isEmpty()) {
+        QJsonArray carr;
+        for (const CoachGroup &g: coaches) carr.append(g.toJson());
+        obj["coaches"] = carr;
+    }
+    return obj;
+}
+
+Train Train::fromJson(const QJsonObject &obj) {
+    Train t;
+    t.trainId = obj["trainId"].toString();
+    t.name = obj["name"].toString();
+    t.source = obj["source"].toString();
+    t.destination = obj["destination"].toString();
+    t.totalSeats = obj["totalSeats"].toInt();
+    t.bookedSeats = 0; // derived from bookings per run
+    t.baseFare = obj["baseFare"].toDouble();
+    t.racSeats = obj["racSeats"].toInt(0);
+    for (const QJsonValue &v: obj["stops"].toArray()) t.stops.append(Stop::fromJson(v.toObject()));
+    for (const QJsonValue &v: obj["coaches"].toArray()) t.coaches.append(CoachGroup::fromJson(v.toObject()));
+    if (!t.coaches.isEmpty()) {
+        t.totalSeats = 0;
+        for (int n: t.classSeats()) t.totalSeats += n;
+    }
+    return t;
+}
+
+QJsonObject Passenger::toJson() const {
+    QJsonObject obj;
+    obj["name"] = name;
+    obj["age"] = age;
+    obj["gender"] = gender;
+    obj["pnr"] = pnr;
+    obj["trainId"] = trainId;
+    obj["seatNo"] = seatNo;
+    obj["fare"] = fare;
+    obj["fromStop"] = fromStop;
+    obj["toStop"] = toStop;
+    obj["journeyDate"] = journeyDate.toString(Qt::ISODate);
+    obj["class"] = classCode(seatClass);
+    if (berthPref >= 0) obj["pref"] = berthCode(Berth(berthPref));
+    obj["quota"] = quotaCode(quota);
+    obj["status"] = statusCode(status);
+    obj["seq"] = waitSeq;
+    return obj;
+}
+
+void Passenger::appendJson(QByteArray &out) const {
+    // same keys as toJson(), written straight into the chunk buffer
+    out += "{\"name\":"; JsonExport::appendString(out, name);
+    out += ",\"age\":"; JsonExport::appendNumber(out, age);
+    out += ",\"gender\":"; JsonExport::appendString(out, gender);
+    out += ",\"pnr\":"; JsonExport::appendString(out, pnr);
+    out += ",\"trainId\":"; JsonExport::appendString(out, trainId);
+    out += ",\"seatNo\":"; JsonExport::appendNumber(out, seatNo);
+    out += ",\"fare\":"; JsonExport::appendNumber(out, fare);
+    out += ",\"fromStop\":"; JsonExport::appendNumber(out, fromStop);
+    out += ",\"toStop\":"; JsonExport::appendNumber(out, toStop);
+    out += ",\"journeyDate\":"; JsonExport::appendString(out, journeyDate.toString(Qt::ISODate));
+    out += ",\"class\":"; JsonExport::appendString(out, classCode(seatClass));
+    if (berthPref >= 0) { out += ",\"pref\":"; JsonExport::appendString(out, berthCode(Berth(berthPref))); }
+    out += ",\"quota\":"; JsonExport::appendString(out, quotaCode(quota));
+    out += ",\"status\":"; JsonExport::appendString(out, statusCode(status));
+    out += ",\"seq\":"; JsonExport::appendNumber(out, waitSeq);
+    out += '}';
+}
+
+Passenger Passenger::fromJson(const QJsonObject &obj) {
+    Passenger p;
+    p.name = obj["name"].toString();
+    p.age = obj["age"].toInt();
+    p.gender = obj["gender"].toString();
+    p.pnr = obj["pnr"].toString();
+    p.trainId = obj["trainId"].toString();
+    p.seatNo = obj["seatNo"].toInt();
+    p.fare = obj["fare"].toDouble();
+    p.fromStop = obj["fromStop"].toInt(0);
+    p.toStop = obj["toStop"].toInt(-1);
+    p.journeyDate = QDate::fromString(obj["journeyDate"].toString(), Qt::ISODate);
+    p.seatClass = classFromCode(obj["class"].toString());
+    p.berthPref = berthFromCode(obj["pref"].toString());
+    p.quota = quotaFromCode(obj["quota"].toString());
+    p.status = statusFromCode(obj["status"].toString());
+    p.waitSeq = obj["seq"].toInt(-1);
+    return p;
+}
+
+BookingDatabase::BookingDatabase() : holdTimers(QDateTime::currentSecsSinceEpoch()) {
+    // attempt load on construction
+    loadFromFiles();
+}
+
+void BookingDatabase::addTrain(const Train &t) {
+    RC_TIMED(AddTrain);
+    RC_TRACE("addTrain");
+    trains.append(t);
+    timetable.appendTrain(t);
+    planner.appendTrain(timetable);
+    fares.appendTrain(t);
+    pricing.appendTrain(timetable);
+    seating.appendTrain(t);
+    totals.appendTrain(t);
+    changed(QString(), QDate());
+}
+
+int BookingDatabase::addTrains(const QVector<Train> &batch) {
+    RC_TIMED(AddTrains);
+    RC_TRACE("addTrains");
+    QSet<QString> known;
+    known.reserve(trains.size() + batch.size());
+    for (const Train &t: std::as_const(trains)) known.insert(t.trainId);
+    trains.reserve(trains.size() + batch.size());
+    int added = 0;
+    for (const Train &t: batch) {
+        if (t.trainId.isEmpty() || known.contains(t.trainId)) continue;
+        known.insert(t.trainId);
+        trains.append(t);
+        ++added;
+    }
+    if (added == 0) return 0;
+    timetable.rebuild(trains);
+    planner.build(timetable);
+    fares.build(trains);
+    pricing.build(timetable);
+    seating.build(trains);
+    totals.build(trains, passengers, runs.windowDays());
+    refreshDemand();
+    changed(QString(), QDate());
+    saveToFiles();
+    return added;
+}
+
+QVector<TrainMatch> BookingDatabase::searchTrains(const QString &src, const QString &dst, const QDate &date,
+                                                  int departAfter, int departBefore) const {
+    RC_TIMED(SearchTrains);
+    RC_TRACE("searchTrains");
+    QVector<TrainMatch> res;
+    const int from = timetable.stationId(src);
+    const int to = timetable.stationId(dst);
+    if (from < 0 || to < 0) return res;
+    QVector<int> index;
+    for (const Timetable::Match &m: timetable.match(from, to, departAfter, departBefore)) {
+        const StopTime *route = timetable.stops(m.train);
+        res.append(TrainMatch{trains[m.train], m.fromStop, m.toStop,
+                              route[m.fromStop].departure, route[m.toStop].arrival, trains[m.train].totalSeats, 0.0, {}});
+        index.append(m.train);
+    }
+    priceMatches(res, index, date);
+    return res;
+}
+
+QVector<TrainMatch> BookingDatabase::allTrains(const QDate &date) const {
+    RC_TIMED(AllTrains);
+    RC_TRACE("allTrains");
+    QVector<TrainMatch> res;
+    QVector<int> index;
+    for (int i = 0; i < trains.size(); ++i) {
+        const StopTime *route = timetable.stops(i);
+        const int last = timetable.stopCount(i) - 1;
+        res.append(TrainMatch{trains[i], 0, last, route[0].departure, route[last].arrival, trains[i].totalSeats, 0.0, {}});
+        index.append(i);
+    }
+    priceMatches(res, index, date);
+    return res;
+}
+
+void BookingDatabase::priceMatches(QVector<TrainMatch> &res, const QVector<int> &trainIndex, const QDate &date) const {
+    RC_TRACE("priceMatches");
+    // one pass for availability of every class, then every (row, class) priced in one batch
+    QVector<FareQuery> quotes;
+    int free[kClassCount];
+    for (int i = 0; i < res.size(); ++i) {
+        TrainMatch &r = res[i];
+        const QVector<int> seats = r.train.classSeats();
+        const TrainRun *run = runs.find(r.train.trainId, date);
+        if (run) {
+            // load on the requested part of the route, not the whole train
+            r.train.bookedSeats = run->seats.maxOccupancy(r.fromStop, r.toStop);
+            r.available = r.train.totalSeats - r.train.bookedSeats;
+            if (run->seats.classCount() == kClassCount) run->seats.availability(r.fromStop, r.toStop, free);
+            else run = nullptr;
+        }
+        const FareQuery q = fareQuery(trainIndex[i], r.fromStop, r.toStop, date);
+        for (int c = 0; c < kClassCount; ++c) {
+            if (seats[c] == 0) continue;
+            r.classes.append(ClassOffer{SeatClass(c), run ? free[c] : seats[c], 0.0});
+            quotes.append(q);
+            quotes.last().seatClass = SeatClass(c);
+        }
+    }
+    QVector<double> fare(quotes.size());
+    fares.quote(quotes.constData(), quotes.size(), fare.data());
+    int k = 0;
+    for (TrainMatch &r: res) {
+        for (ClassOffer &o: r.classes) o.fare = fare[k++];
+        if (!r.classes.isEmpty()) r.fare = r.classes.first().fare;
+    }
+}
+
+FareQuery BookingDatabase::fareQuery(int trainIndex, int fromStop, int toStop, const QDate &date) const {
+    // the run's peak once a seat on fromStop..toStop is taken, as commitSeat will see it
+    FareQuery q{trainIndex, fromStop, toStop, 1};
+    if (const TrainRun *run = runs.find(trains[trainIndex].trainId, date)) {
+        q.load = qMax(run->seats.peak(), run->seats.maxOccupancy(fromStop, toStop) + 1);
+        q.surge = DemandPricing::multiplier(run->demand.bucket.load(std::memory_order_relaxed));
+    }
+    return q;
+}
+
+Train* BookingDatabase::findTrain(const QString &trainId) {
+    RC_TRACE("findTrain");
+    for (int i = 0; i < trains.size(); ++i) {
+        if (trains[i].trainId == trainId) return &trains[i];
+    }
+    return nullptr;
+}
+
+int BookingDatabase::stopIndex(const QString &trainId, const QString &station) const {
+    const int sid = timetable.stationId(station);
+    for (int i = 0; i < trains.size(); ++i) {
+        if (trains[i].trainId != trainId) continue;
+        const StopTime *route = timetable.stops(i);
+        for (int j = 0; j < timetable.stopCount(i); ++j) {
+            if (route[j].station == sid) return j;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+TrainRun *BookingDatabase::trainRun(int trainIndex, const QDate &date) {
+    const Train &t = trains[trainIndex];
+    if (cancelledRuns.contains(RunRef(t.trainId, date.toJulianDay()))) return nullptr;
+    return runs.obtain(t.trainId, date, t.classSeats(), timetable.stopCount(trainIndex));
+}
+
+int BookingDatabase::bookedSeats(const QString &trainId, const QDate &date) const {
+    const TrainRun *run = runs.find(trainId, date);
+    return run ? run->seats.peak() : 0;
+}
+
+bool BookingDatabase::resolveStops(int trainIndex, Passenger &p) const {
+    const int n = timetable.stopCount(trainIndex);
+    if (p.toStop < 0) p.toStop = n - 1;
+    return p.fromStop >= 0 && p.fromStop < p.toStop && p.toStop < n;
+}
+
+int BookingDatabase::rebuildInventory() {
+    RC_TRACE("rebuildInventory");
+    runs.clear();
+    QHash<QString, int> index;
+    for (int i = 0; i < trains.size(); ++i) index.insert(trains[i].trainId, i);
+    QVector<int> clashes; // seat already taken on a hop, or no longer on the train
+    for (int i = 0; i < passengers.size(); ++i) {
+        Passenger &p = passengers[i];
+        const int ti = index.value(p.trainId, -1);
+        if (ti < 0 || !resolveStops(ti, p)) continue;
+        TrainRun *run = trainRun(ti, p.journeyDate);
+        if (run && !run->seats.occupy(p.seatNo, p.fromStop, p.toStop)) clashes.append(i);
+    }
+    RC_COUNT(SeatConflicts, clashes.size());
+    // the later booking gives way: another seat if one is free, else the
+    // run's queues. Back to front, as removePassengerAt moves the last one down.
+    for (int k = clashes.size() - 1; k >= 0; --k) {
+        Passenger &p = passengers[clashes[k]];
+        const int ti = index.value(p.trainId);
+        TrainRun *run = trainRun(ti, p.journeyDate);
+        const SeatRequest req = seatRequest(p);
+        int seat = 0;
+        if (seating.allocate(ti, run->seats, &req, 1, &seat)) {
+            p.seatNo = seat;
+            continue;
+        }
+        Passenger w = p;
+        removePassengerAt(clashes[k], false);
+        const bool rac = waitlist.depth(w.trainId, w.journeyDate, int(w.seatClass), BookingStatus::RAC) < trains[ti].racSeats;
+        w.status = rac ? BookingStatus::RAC : BookingStatus::Waitlisted;
+        w.seatNo = 0;
+        w.fare = 0.0;
+        w.waitSeq = -1;
+        waitlist.add(w);
+    }
+    refreshDemand();
+    return clashes.size();
+}
+
+void BookingDatabase::refreshDemand() {
+    // booking pace is not persisted; this prices runs by load and date alone until they see events
+    QHash<QString, int> index;
+    for (int i = 0; i < trains.size(); ++i) index.insert(trains[i].trainId, i);
+    const qint64 now = QDateTime::currentSecsSinceEpoch();
+    runs.forEach([&](TrainRun &run) {
+        const int ti = index.value(run.trainId, -1);
+        if (ti >= 0) pricing.refresh(run, ti, now);
+    });
+}
+
+void BookingDatabase::recordDemand(const QString &trainId, const QDate &date, int delta) {
+    TrainRun *run = runs.find(trainId, date);
+    Train *t = findTrain(trainId);
+    if (run && t) pricing.record(*run, int(t - trains.data()), delta, QDateTime::currentSecsSinceEpoch());
+}
+
+void BookingDatabase::rollWindow() {
+    RC_TIMED(RollWindow);
+    RC_TRACE("rollWindow");
+    const QDate today = QDate::currentDate();
+    if (runs.firstDay() == today) return;
+    // move bookings for departed runs out of memory, appending them to the
+    // archive; a booking leaves memory only once its line has been written
+    QFile af(archiveFile);
+    if (!af.open(QIODevice::WriteOnly | QIODevice::Append)) return; // retried on the next call
+    bool writable = true;
+    QByteArray line;
+    auto archived = [&](const Passenger &p) {
+        if (p.journeyDate >= today || !writable) return false;
+        line.resize(0);
+        p.appendJson(line);
+        line += '\n';
+        writable = af.write(line) == line.size();
+        return writable;
+    };
+    const int before = passengers.size();
+    passengers.erase(std::remove_if(passengers.begin(), passengers.end(), [&](const Passenger &p) {
+        if (!archived(p)) return false;
+        totals.remove(p, false); // travelled, not refunded
+        return true;
+    }), passengers.end());
+    int moved = before - passengers.size();
+    if (moved > 0) rebuildPnrIndex();
+    moved += waitlist.extract(archived, [](const Passenger &) {});
+    af.close();
+    // bookings.json must lose them too, or a restart would archive them again
+    if (moved > 0) saveToFiles();
+    // after a failed write the rest stays in memory and the window where it
+    // is, so the next call archives what is left
+    if (writable) {
+        runs.roll(today);
+        for (auto it = cancelledRuns.begin(); it != cancelledRuns.end();) {
+            if (it->second < today.toJulianDay()) it = cancelledRuns.erase(it);
+            else ++it;
+        }
+        // one day closer to departure for every run
+        pricing.expireBefore(today);
+        refreshDemand();
+    }
+    changed(QString(), QDate());
+}
+
+bool BookingDatabase::reloadFareRules(QString *error) {
+    RC_TIMED(ReloadFareRules);
+    RC_TRACE("reloadFareRules");
+    const QFileInfo info(fareRulesFile);
+    const QDateTime stamp = info.exists() ? info.lastModified() : QDateTime();
+    if (stamp == fareRulesStamp) return false;
+    fareRulesStamp = stamp;
+    QString source;
+    QFile f(fareRulesFile);
+    if (f.open(QIODevice::ReadOnly)) source = QString::fromUtf8(f.readAll());
+    // a file that does not compile leaves the previous script in place
+    return fares.setScript(source, error);
+}
+
+QVector<Journey> BookingDatabase::planJourneys(const QString &src, const QString &dst,
+                                               int departAfter, int maxTransfers) const {
+    RC_TIMED(PlanJourneys);
+    RC_TRACE("planJourneys");
+    return planner.plan(timetable.stationId(src), timetable.stationId(dst),
+                        qMax(0, departAfter), maxTransfers);
+}
+
+QString BookingDatabase::newPnr() {
+    RC_TRACE("newPnr");
+    return QUuid::createUuid().toString(QUuid::WithoutBraces).left(8).toUpper();
+}
+
+SeatRequest BookingDatabase::seatRequest(const Passenger &p) {
+    return SeatRequest{p.fromStop, p.toStop, p.seatClass, p.berthPref, p.age >= 60};
+}
+
+bool BookingDatabase::confirmSeat(int trainIndex, TrainRun *run, Passenger &p) {
+    RC_TRACE("confirmSeat");
+    const SeatRequest req = seatRequest(p);
+    int seat = 0;
+    if (!seating.allocate(trainIndex, run->seats, &req, 1, &seat)) return false;
+    // seat free on every hop of the journey
+    p.seatNo = seat;
+    commitSeat(trainIndex, run, p);
+    return true;
+}
+
+void BookingDatabase::commitSeat(int trainIndex, TrainRun *run, Passenger &p) {
+    RC_TRACE("commitSeat");
+    // p.seatNo is already marked taken in run
+    p.status = BookingStatus::Confirmed;
+    p.waitSeq = -1;
+    // priced on the run's load with this seat taken
+    FareQuery q{trainIndex, p.fromStop, p.toStop, run->seats.peak()};
+    q.surge = DemandPricing::multiplier(run->demand.bucket.load(std::memory_order_relaxed));
+    q.seatClass = p.seatClass;
+    q.quota = p.quota;
+    q.age = p.age;
+    p.fare = fares.quote(q);
+    if (p.pnr.isEmpty()) p.pnr = newPnr(); // promoted tickets keep their PNR
+    pnrIndex.insert(p.pnr, passengers.size());
+    manifests.add(passengers.size(), p.trainId);
+    passengers.append(p);
+    totals.add(p);
+    changed(p.trainId, p.journeyDate);
+}
+
+quint64 BookingDatabase::holdSeats(const QString &trainId, const QVector<Passenger> &group, int ttlSeconds) {
+    RC_TIMED(HoldSeats);
+    RC_TRACE("holdSeats");
+    expireHolds();
+    Train *t = findTrain(trainId);
+    if (!t || group.isEmpty()) return 0;
+    const int ti = int(t - trains.data());
+    rollWindow();
+    QVector<Passenger> members;
+    for (Passenger p: group) {
+        p.trainId = trainId;
+        if (!p.journeyDate.isValid()) p.journeyDate = QDate::currentDate();
+        if (!resolveStops(ti, p) || !trainRun(ti, p.journeyDate)) return 0;
+        members.append(p);
+    }
+    SeatHold hold;
+    hold.expiresAt = QDateTime::currentSecsSinceEpoch() + qMax(1, ttlSeconds);
+    // members listed together on the same run are seated together
+    QVector<SeatRequest> req;
+    QVector<int> seat;
+    for (int i = 0; i < members.size();) {
+        int j = i;
+        req.clear();
+        for (; j < members.size() && members[j].journeyDate == members[i].journeyDate; ++j) req.append(seatRequest(members[j]));
+        seat.resize(req.size());
+        if (!seating.allocate(ti, trainRun(ti, members[i].journeyDate)->seats, req.constData(), req.size(), seat.data())) {
+            // all or nothing: give back what this group already took
+            for (const Passenger &h: std::as_const(hold.group)) {
+                if (TrainRun *r = runs.find(h.trainId, h.journeyDate)) r->seats.release(h.seatNo, h.fromStop, h.toStop);
+            }
+            return 0;
+        }
+        for (int k = i; k < j; ++k) {
+            members[k].seatNo = seat[k - i];
+            hold.group.append(members[k]);
+        }
+        i = j;
+    }
+    const quint64 id = nextHoldId++;
+    holds.insert(id, hold);
+    holdTimers.schedule(id, hold.expiresAt);
+    for (const Passenger &h: std::as_const(hold.group)) changed(h.trainId, h.journeyDate);
+    RC_COUNT(HoldsPlaced, 1);
+    return id;
+}
+
+QStringList BookingDatabase::confirmHold(quint64 holdId, const QString &requestKey) {
+    RC_TIMED(ConfirmHold);
+    RC_TRACE("confirmHold");
+    const QString request = QString("hold %1").arg(holdId);
+    if (!requestKey.isEmpty()) {
+        // a retry: the hold is gone, answer with what the first call confirmed
+        if (const RequestCache::Entry *e = requests.find(requestKey, QDateTime::currentSecsSinceEpoch()))
+            return e->request == request ? e->pnrs : QStringList();
+    }
+    expireHolds();
+    QStringList pnrs;
+    auto it = holds.find(holdId);
+    if (it == holds.end()) return pnrs;
+    const SeatHold hold = it.value();
+    holds.erase(it);
+    for (Passenger p: hold.group) {
+        Train *t = findTrain(p.trainId);
+        TrainRun *run = runs.find(p.trainId, p.journeyDate);
+        if (!t || !run) continue; // run cancelled or departed meanwhile
+        p.pnr.clear();
+        commitSeat(int(t - trains.data()), run, p);
+        pricing.record(*run, int(t - trains.data()), 1, QDateTime::currentSecsSinceEpoch());
+        RC_COUNT(Confirmed, 1);
+        pnrs << p.pnr;
+    }
+    if (!requestKey.isEmpty() && !pnrs.isEmpty())
+        requests.remember(requestKey, request, pnrs, QDateTime::currentSecsSinceEpoch());
+    saveToFiles();
+    return pnrs;
+}
+
+bool BookingDatabase::dropHold(quint64 holdId, bool *moved) {
+    auto it = holds.find(holdId);
+    if (it == holds.end()) return false;
+    const SeatHold hold = it.value();
+    holds.erase(it);
+    QSet<RunRef> freed;
+    for (const Passenger &h: hold.group) {
+        if (TrainRun *run = runs.find(h.trainId, h.journeyDate)) run->seats.release(h.seatNo, h.fromStop, h.toStop);
+        freed.insert(RunRef(h.trainId, h.journeyDate.toJulianDay()));
+        changed(h.trainId, h.journeyDate);
+    }
+    // a released group may unblock waitlisted tickets on any run it held seats on
+    bool any = false;
+    for (const RunRef &r: std::as_const(freed)) {
+        if (Train *t = findTrain(r.first)) any |= fillFreedPlaces(int(t - trains.data()), QDate::fromJulianDay(r.second));
+    }
+    if (moved) *moved = any;
+    return true;
+}
+
+bool BookingDatabase::releaseHold(quint64 holdId) {
+    RC_TIMED(ReleaseHold);
+    RC_TRACE("releaseHold");
+    expireHolds();
+    bool moved = false;
+    if (!dropHold(holdId, &moved)) return false;
+    if (moved) saveToFiles();
+    return true;
+}
+
+void BookingDatabase::expireHolds() {
+    RC_TIMED(ExpireHolds);
+    RC_TRACE("expireHolds");
+    QVector<quint64> due;
+    holdTimers.advance(QDateTime::currentSecsSinceEpoch(), [&](quint64 id) {
+        if (holds.contains(id)) due.append(id); // confirmed/released holds are gone already
+    });
+    if (due.isEmpty()) return;
+    RC_COUNT(HoldsExpired, due.size());
+    bool moved = false;
+    for (quint64 id: std::as_const(due)) {
+        bool m = false;
+        dropHold(id, &m);
+        moved |= m;
+    }
+    if (moved) saveToFiles();
+}
+
+bool BookingDatabase::fillFreedPlaces(int trainIndex, const QDate &date) {
+    RC_TRACE("fillFreedPlaces");
+    const QString trainId = trains[trainIndex].trainId;
+    TrainRun *run = runs.find(trainId, date);
+    if (!run) return false;
+    bool moved = false;
+    const QVector<int> seats = trains[trainIndex].classSeats();
+    auto fits = [run](const Passenger &w) { return run->seats.findFree(w.fromStop, w.toStop, int(w.seatClass)) > 0; };
+    auto any = [](const Passenger &) { return true; };
+    Passenger w;
+    // each class has its own queues and only its own seats to give
+    for (int c = 0; c < kClassCount; ++c) {
+        if (seats[c] == 0) continue;
+        // freed seats go to the RAC queue first, then to the waitlist heads
+        while (waitlist.takeNext(trainId, date, c, BookingStatus::RAC, fits, &w) ||
+               waitlist.takeNext(trainId, date, c, BookingStatus::Waitlisted, fits, &w)) {
+            confirmSeat(trainIndex, run, w);
+            RC_COUNT(Promoted, 1);
+            moved = true;
+        }
+        // RAC places vacated above are refilled from the waitlist
+        while (waitlist.depth(trainId, date, c, BookingStatus::RAC) < trains[trainIndex].racSeats &&
+               waitlist.takeNext(trainId, date, c, BookingStatus::Waitlisted, any, &w)) {
+            w.status = BookingStatus::RAC;
+            w.waitSeq = -1;
+            waitlist.add(w);
+            changed(trainId, date);
+            moved = true;
+        }
+    }
+    return moved;
+}
+
+QString BookingDatabase::requestFingerprint(const QString &trainId, const Passenger &p) {
+    // as asked, before defaults are filled in, so a retry reproduces it exactly
+    return QStringList{trainId, p.journeyDate.toString(Qt::ISODate), classCode(p.seatClass), quotaCode(p.quota),
+                       QString::number(p.fromStop), QString::number(p.toStop), QString::number(p.berthPref),
+                       p.name, QString::number(p.age), p.gender}.join('|');
+}
+
+BookResult BookingDatabase::bookTicket(const QString &trainId, const Passenger &p, Passenger *booked,
+                                       const QString &requestKey) {
+    RC_TIMED(BookTicket);
+    RC_TRACE("bookTicket");
+    const QString request = requestKey.isEmpty() ? QString() : requestFingerprint(trainId, p);
+    if (!requestKey.isEmpty()) {
+        if (const RequestCache::Entry *e = requests.find(requestKey, QDateTime::currentSecsSinceEpoch())) {
+            // entries saved before fingerprints were kept have none and match any retry
+            if (!e->request.isEmpty() && e->request != request) return BookResult::KeyConflict;
+            // a retry: answer with the ticket the first attempt produced
+            const QString pnr = e->pnrs.value(0);
+            const Passenger *prev = findPassenger(pnr);
+            if (!prev) prev = waitlist.find(pnr);
+            if (!prev) return BookResult::Cancelled;
+            if (booked) *booked = *prev;
+            return BookResult::Repeated;
+        }
+    }
+    Train *t = findTrain(trainId);
+    if (!t) return BookResult::Failed;
+    const int ti = int(t - trains.data());
+    Passenger np = p;
+    if (t->classSeats()[int(np.seatClass)] == 0) return BookResult::Failed; // no such class on this train
+    if (!resolveStops(ti, np)) return BookResult::Failed;
+    rollWindow();
+    if (!np.journeyDate.isValid()) np.journeyDate = QDate::currentDate();
+    TrainRun *run = trainRun(ti, np.journeyDate);
+    if (!run) return BookResult::Failed; // outside the booking window or called off
+    np.pnr.clear();
+    if (confirmSeat(ti, run, np)) {
+        RC_COUNT(Confirmed, 1);
+    } else {
+        // full: RAC while places last, then the quota's waitlist
+        bool rac = waitlist.depth(trainId, np.journeyDate, int(np.seatClass), BookingStatus::RAC) < t->racSeats;
+        np.status = rac ? BookingStatus::RAC : BookingStatus::Waitlisted;
+        np.seatNo = 0;
+        np.fare = 0.0; // priced on confirmation
+        np.waitSeq = -1;
+        np.pnr = newPnr();
+        waitlist.add(np);
+        changed(trainId, np.journeyDate);
+        RC_COUNT(Queued, 1);
+    }
+    if (booked) *booked = np;
+    // waitlisted tickets are demand too
+    pricing.record(*run, ti, 1, QDateTime::currentSecsSinceEpoch());
+    if (!requestKey.isEmpty()) requests.remember(requestKey, request, {np.pnr}, QDateTime::currentSecsSinceEpoch());
+    saveToFiles();
+    return BookResult::Booked;
+}
+
+bool BookingDatabase::cancelTicket(const QString &pnr) {
+    return cancelMany(QStringList{pnr}) > 0;
+}
+
+void BookingDatabase::removePassengerAt(int i, bool refunded) {
+    // order of passengers is not significant: fill the hole with the last one
+    pnrIndex.remove(passengers[i].pnr);
+    manifests.remove(i, passengers[i].trainId);
+    totals.remove(passengers[i], refunded);
+    const int last = passengers.size() - 1;
+    if (i != last) {
+        passengers[i] = std::move(passengers[last]);
+        pnrIndex.insert(passengers[i].pnr, i);
+        manifests.move(last, i, passengers[i].trainId);
+    }
+    passengers.removeLast();
+}
+
+void BookingDatabase::rebuildPnrIndex() {
+    pnrIndex.clear();
+    pnrIndex.reserve(passengers.size());
+    manifests.clear();
+    for (int i = 0; i < passengers.size(); ++i) {
+        pnrIndex.insert(passengers[i].pnr, i);
+        manifests.add(i, passengers[i].trainId);
+    }
+}
+
+bool BookingDatabase::dropTicket(const QString &pnr, QSet<RunRef> &freed) {
+    const int i = pnrIndex.value(pnr, -1);
+    if (i >= 0) {
+        const Passenger &p = passengers[i];
+        // free seat
+        if (TrainRun *run = runs.find(p.trainId, p.journeyDate))
+            run->seats.release(p.seatNo, p.fromStop, p.toStop);
+        freed.insert(RunRef(p.trainId, p.journeyDate.toJulianDay()));
+        recordDemand(p.trainId, p.journeyDate, -1);
+        changed(p.trainId, p.journeyDate);
+        removePassengerAt(i, true);
+        RC_COUNT(Cancelled, 1);
+        return true;
+    }
+    // not confirmed: an RAC or waitlisted ticket
+    Passenger w;
+    if (!waitlist.remove(pnr, &w)) return false;
+    if (w.status == BookingStatus::RAC) freed.insert(RunRef(w.trainId, w.journeyDate.toJulianDay()));
+    recordDemand(w.trainId, w.journeyDate, -1);
+    changed(w.trainId, w.journeyDate);
+    RC_COUNT(Cancelled, 1);
+    return true;
+}
+
+int BookingDatabase::cancelMany(const QStringList &pnrs) {
+    RC_TIMED(CancelMany);
+    RC_TRACE("cancelMany");
+    QSet<RunRef> freed;
+    int cancelled = 0;
+    for (const QString &pnr: pnrs) {
+        if (dropTicket(pnr, freed)) ++cancelled;
+    }
+    if (cancelled == 0) return 0;
+    // hand the freed places on according to the waitlist policy, once per run
+    for (const RunRef &r: std::as_const(freed)) {
+        if (Train *t = findTrain(r.first)) fillFreedPlaces(int(t - trains.data()), QDate::fromJulianDay(r.second));
+    }
+    saveToFiles();
+    return cancelled;
+}
+
+int BookingDatabase::cancelTrain(const QString &trainId, const QDate &date) {
+    RC_TIMED(CancelTrain);
+    RC_TRACE("cancelTrain");
+    rollWindow();
+    auto affected = [&](const Passenger &p) {
+        return p.trainId == trainId && (!date.isValid() || p.journeyDate == date);
+    };
+    // remembered, or the next booking would open the run afresh; a whole
+    // train is called off for every date of the current window
+    const QDate from = date.isValid() ? date : runs.firstDay();
+    const QDate to = date.isValid() ? date : runs.lastDay();
+    for (QDate d = from; d.isValid() && d <= to; d = d.addDays(1))
+        cancelledRuns.insert(RunRef(trainId, d.toJulianDay()));
+    // nothing is promoted: the seats themselves are gone
+    const int before = passengers.size();
+    passengers.erase(std::remove_if(passengers.begin(), passengers.end(), [&](const Passenger &p) {
+        if (!affected(p)) return false;
+        totals.remove(p, true);
+        return true;
+    }), passengers.end());
+    int cancelled = before - passengers.size();
+    if (cancelled > 0) rebuildPnrIndex();
+    cancelled += waitlist.extract(affected, [](const Passenger &) {});
+    runs.drop(trainId, date);
+    // a hold is all or nothing: one member on a cancelled run releases the
+    // group, giving back its seats on the runs that still go
+    QVector<quint64> released;
+    for (auto it = holds.cbegin(); it != holds.cend(); ++it) {
+        const QVector<Passenger> &group = it.value().group;
+        if (std::any_of(group.cbegin(), group.cend(), affected)) released.append(it.key());
+    }
+    for (quint64 id: std::as_const(released)) dropHold(id);
+    changed(trainId, date);
+    saveToFiles();
+    return cancelled;
+}
+
+Passenger* BookingDatabase::findPassenger(const QString &pnr) {
+    const int i = pnrIndex.value(pnr, -1);
+    return i < 0 ? nullptr : &passengers[i];
+}
+
+bool BookingDatabase::loadFromFiles() {
+    RC_TIMED(LoadFromFiles);
+    RC_TRACE("loadFromFiles");
+    // trains
+    const TrainFile file = readTrainFile(trainsFile);
+    if (file.ok) {
+        trains = file.trains;
+        trainsDigest = file.digest;
+    } else if (!QFileInfo::exists(trainsFile)) {
+        // create sample trains if file missing
+        trains.clear();
+        Train t1{"123A","Express One","Mumbai","Pune",100,0,200.0};
+        Train t2{"456B","Coastal Mail","Chennai","Bangalore",80,0,350.0};
+        Train t3{"789C","InterCity","Delhi","Agra",120,0,150.0};
+        t1.stops = {{"Mumbai",-1,360,0},{"Lonavala",460,462,96},{"Pune",555,-1,192}};
+        t2.stops = {{"Chennai",-1,1320,0},{"Katpadi",1435,1440,129},{"Bangalore",1770,-1,359}};
+        t3.stops = {{"Delhi",-1,420,0},{"Mathura",525,527,141},{"Agra",590,-1,195}};
+        t1.coaches = {CoachGroup::standard(SeatClass::Sleeper, 1), CoachGroup::standard(SeatClass::ThirdAC, 1)};
+        t2.coaches = {CoachGroup::standard(SeatClass::Sleeper, 1), CoachGroup::standard(SeatClass::ThirdAC, 1),
+                      CoachGroup::standard(SeatClass::SecondAC, 1)};
+        t3.coaches = {CoachGroup::standard(SeatClass::ChairCar, 2)};
+        for (Train *t: {&t1, &t2, &t3}) {
+            t->totalSeats = 0;
+            for (int n: t->classSeats()) t->totalSeats += n;
+        }
+        trains.append(t1); trains.append(t2); trains.append(t3);
+        saveToFiles();
+    }
+    timetable.rebuild(trains);
+    planner.build(timetable);
+    fares.build(trains);
+    pricing.build(timetable);
+    seating.build(trains);
+    reloadFareRules();
+
+    // bookings
+    QFile bf(bookingsFile);
+    if (bf.open(QIODevice::ReadOnly)) {
+        QByteArray data = bf.readAll();
+        QJsonDocument d = QJsonDocument::fromJson(data);
+        if (d.isObject()) {
+            QJsonObject obj = d.object();
+            passengers.clear();
+            waitlist.clear();
+            QJsonArray parr = obj["passengers"].toArray();
+            for (const QJsonValue &v: parr) passengers.append(Passenger::fromJson(v.toObject()));
+            QJsonArray warr = obj["waiting"].toArray();
+            for (const QJsonValue &v: warr) {
+                Passenger w = Passenger::fromJson(v.toObject());
+                // older files: plain FIFO entries without PNR, status or date
+                if (w.status == BookingStatus::Confirmed) w.status = BookingStatus::Waitlisted;
+                if (w.pnr.isEmpty()) w.pnr = newPnr();
+                if (!w.journeyDate.isValid()) w.journeyDate = QDate::currentDate();
+                if (Train *t = findTrain(w.trainId)) resolveStops(int(t - trains.data()), w);
+                waitlist.add(w);
+            }
+            requests.clear();
+            const qint64 now = QDateTime::currentSecsSinceEpoch();
+            for (const QJsonValue &v: obj["requests"].toArray())
+                requests.restore(RequestCache::Entry::fromJson(v.toObject()), now);
+            cancelledRuns.clear();
+            for (const QJsonValue &v: obj["cancelledRuns"].toArray()) {
+                const QJsonObject c = v.toObject();
+                const QDate d = QDate::fromString(c["date"].toString(), Qt::ISODate);
+                if (d.isValid()) cancelledRuns.insert(RunRef(c["trainId"].toString(), d.toJulianDay()));
+            }
+        }
+        bf.close();
+    }
+    // bookings written before runs were dated belong to today's run
+    for (Passenger &p: passengers) if (!p.journeyDate.isValid()) p.journeyDate = QDate::currentDate();
+    rebuildPnrIndex();
+    totals.build(trains, passengers, runs.windowDays());
+    rollWindow();
+    if (rebuildInventory() > 0) saveToFiles();
+    return true;
+}
+
+bool BookingDatabase::saveToFiles() const {
+    RC_TIMED(SaveToFiles);
+    RC_TRACE("saveToFiles");
+    // every call follows a change; the lag runs until a save succeeds
+    if (unsavedSince == 0) unsavedSince = QDateTime::currentMSecsSinceEpoch();
+    // trains
+    QByteArray trainJson;
+    {
+        RC_TRACE("trains toJson");
+        QJsonArray tarr;
+        for (const Train &t: trains) tarr.append(t.toJson());
+        trainJson = QJsonDocument(tarr).toJson();
+    }
+    QSaveFile tf(trainsFile);
+    if (!tf.open(QIODevice::WriteOnly)) {
+        RC_COUNT(SaveFailures, 1);
+        return false;
+    }
+    {
+        RC_TRACE("trains write");
+        // remembered first: the file watcher must see the rename as ours
+        const QByteArray previousDigest = trainsDigest;
+        trainsDigest = QCryptographicHash::hash(trainJson, QCryptographicHash::Sha1);
+        if (tf.write(trainJson) < 0 || !tf.commit()) {
+            trainsDigest = previousDigest;
+            RC_COUNT(SaveFailures, 1);
+            return false;
+        }
+    }
+
+    // bookings: streamed chunk by chunk, no QJsonDocument for the whole file
+    QSaveFile bf(bookingsFile);
+    if (!bf.open(QIODevice::WriteOnly)) {
+        RC_COUNT(SaveFailures, 1);
+        return false;
+    }
+    QJsonArray closed;
+    for (const RunRef &r: cancelledRuns)
+        closed.append(QJsonObject{{"trainId", r.first}, {"date", QDate::fromJulianDay(r.second).toString(Qt::ISODate)}});
+    bool ok;
+    {
+        RC_TRACE("bookings write");
+        ok = bf.write("{\"passengers\":") >= 0
+             && JsonExport::writeArray(bf, passengers)
+             && bf.write(",\"waiting\":") >= 0
+             && JsonExport::writeArray(bf, waitlist.entries())
+             && bf.write(",\"requests\":") >= 0
+             && JsonExport::writeArray(bf, requests.entries())
+             && bf.write(",\"cancelledRuns\":") >= 0
+             && bf.write(QJsonDocument(closed).toJson(QJsonDocument::Compact)) >= 0
+             && bf.write("}\n") >= 0;
+    }
+    if (ok) {
+        RC_TRACE("bookings commit");
+        ok = bf.commit();
+    } else {
+        bf.cancelWriting();
+    }
+    if (ok) {
+        lastSaved = QDateTime::currentMSecsSinceEpoch();
+        unsavedSince = 0;
+    } else {
+        RC_COUNT(SaveFailures, 1);
+    }
+    return ok;
+}
+
+TrainFile BookingDatabase::readTrainFile(const QString &path) {
+    RC_TRACE("readTrainFile");
+    TrainFile file;
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) return file;
+    const QByteArray data = f.readAll();
+    const QJsonDocument d = QJsonDocument::fromJson(data);
+    if (!d.isArray()) return file; // also a file caught half written
+    file.digest = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+    for (const QJsonValue &v: d.array()) file.trains.append(Train::fromJson(v.toObject()));
+    file.ok = true;
+    return file;
+}
+
+// station names along t's route, as counted by fromStop/toStop
+static QStringList callsOf(const Train &t) {
+    if (t.stops.isEmpty()) return QStringList{t.source, t.destination};
+    QStringList calls;
+    for (const Stop &s: t.stops) calls << s.station;
+    return calls;
+}
+
+TrainDiff BookingDatabase::applyTrainFile(const TrainFile &file) {
+    RC_TRACE("applyTrainFile");
+    TrainDiff diff;
+    if (!file.ok || file.digest == trainsDigest) return diff;
+    trainsDigest = file.digest;
+    QHash<QString, int> incoming; // trainId -> first index in file.trains
+    for (int i = file.trains.size() - 1; i >= 0; --i) incoming.insert(file.trains[i].trainId, i);
+
+    // existing trains keep their order, new ones follow in file order
+    QVector<Train> next;
+    next.reserve(file.trains.size());
+    QSet<QString> changedIds; // updated or removed: their runs are rebuilt
+    for (const Train &t: std::as_const(trains)) {
+        const int i = incoming.value(t.trainId, -1);
+        if (i < 0) {
+            ++diff.removed;
+            changedIds.insert(t.trainId);
+            continue;
+        }
+        incoming.remove(t.trainId);
+        if (file.trains[i].toJson() == t.toJson()) {
+            next.append(t);
+        } else {
+            ++diff.updated;
+            changedIds.insert(t.trainId);
+            next.append(file.trains[i]);
+        }
+    }
+    for (int i = 0; i < file.trains.size(); ++i) {
+        if (incoming.value(file.trains[i].trainId, -1) != i) continue;
+        next.append(file.trains[i]);
+        ++diff.added;
+    }
+    if (diff.isEmpty()) return diff;
+
+    // one rebuild for the whole file; additions alone would still cost a
+    // full index extension per train through addTrain
+    const QVector<Train> previous = trains;
+    trains = next;
+    timetable.rebuild(trains);
+    planner.build(timetable);
+    fares.build(trains);
+    pricing.build(timetable);
+    seating.build(trains);
+    totals.build(trains, passengers, runs.windowDays());
+    if (changedIds.isEmpty()) {
+        refreshDemand();
+        changed(QString(), QDate());
+        return diff;
+    }
+
+    QHash<QString, int> index;
+    for (int i = 0; i < trains.size(); ++i) index.insert(trains[i].trainId, i);
+    // stop positions were counted on the old route: carry them over by
+    // station name. False when the train, either station or the class is gone.
+    QHash<QString, QPair<QStringList, QStringList>> routes; // trainId -> (old, new) calls
+    for (const Train &t: previous) {
+        if (changedIds.contains(t.trainId)) routes.insert(t.trainId, qMakePair(callsOf(t), QStringList()));
+    }
+    for (const Train &t: std::as_const(trains)) {
+        if (routes.contains(t.trainId)) routes[t.trainId].second = callsOf(t);
+    }
+    auto remap = [&](Passenger &p) {
+        const int ti = index.value(p.trainId, -1);
+        if (ti < 0 || trains[ti].classSeats()[int(p.seatClass)] == 0) return false;
+        const QStringList &was = routes[p.trainId].first;
+        const QStringList &now = routes[p.trainId].second;
+        const int toStop = p.toStop < 0 ? int(was.size()) - 1 : p.toStop;
+        if (p.fromStop < 0 || p.fromStop >= toStop || toStop >= was.size()) return false;
+        const int from = now.indexOf(was[p.fromStop]);
+        const int to = from < 0 ? -1 : now.indexOf(was[toStop], from + 1);
+        if (to < 0) return false;
+        p.fromStop = from;
+        p.toStop = to;
+        return true;
+    };
+    auto reseat = [&](Passenger &p, TrainRun *run) {
+        const SeatRequest req = seatRequest(p);
+        return seating.allocate(index.value(p.trainId), run->seats, &req, 1, &p.seatNo);
+    };
+
+    // changed trains start from empty runs; tickets keep their seat where it
+    // is still free, then the rest are seated around them
+    for (const QString &id: std::as_const(changedIds)) runs.drop(id);
+    QSet<RunRef> touched;
+    QVector<int> cancelAt, displaced, queueAt; // indexes into passengers
+    for (int i = 0; i < passengers.size(); ++i) {
+        Passenger &p = passengers[i];
+        if (!changedIds.contains(p.trainId)) continue;
+        touched.insert(RunRef(p.trainId, p.journeyDate.toJulianDay()));
+        TrainRun *run = remap(p) ? trainRun(index.value(p.trainId), p.journeyDate) : nullptr;
+        if (!run) cancelAt.append(i);
+        else if (!run->seats.occupy(p.seatNo, p.fromStop, p.toStop)) displaced.append(i);
+    }
+    for (int i: std::as_const(displaced)) {
+        Passenger &p = passengers[i];
+        if (reseat(p, runs.find(p.trainId, p.journeyDate))) ++diff.reseated;
+        else queueAt.append(i);
+    }
+
+    // a hold is all or nothing: one member left without a seat releases the group
+    for (auto it = holds.begin(); it != holds.end();) {
+        QVector<Passenger> &group = it.value().group;
+        if (!changedIds.contains(group.first().trainId)) { ++it; continue; }
+        int seated = 0;
+        for (; seated < group.size(); ++seated) {
+            Passenger &h = group[seated];
+            TrainRun *run = remap(h) ? trainRun(index.value(h.trainId), h.journeyDate) : nullptr;
+            if (!run || (!run->seats.occupy(h.seatNo, h.fromStop, h.toStop) && !reseat(h, run))) break;
+        }
+        if (seated == group.size()) { ++it; continue; }
+        for (int k = 0; k < seated; ++k) {
+            const Passenger &h = group[k];
+            runs.find(h.trainId, h.journeyDate)->seats.release(h.seatNo, h.fromStop, h.toStop);
+        }
+        it = holds.erase(it); // its timer finds nothing when it fires
+        ++diff.holdsReleased;
+    }
+
+    // queued tickets keep their place in line on the new route
+    QVector<Passenger> waiting;
+    waitlist.extract([&](const Passenger &w) { return changedIds.contains(w.trainId); },
+                     [&](const Passenger &w) { waiting.append(w); });
+    for (Passenger &w: waiting) {
+        touched.insert(RunRef(w.trainId, w.journeyDate.toJulianDay()));
+        if (remap(w) && runs.contains(w.journeyDate)) {
+            waitlist.add(w);
+        } else {
+            ++diff.cancelled;
+            RC_COUNT(Cancelled, 1);
+        }
+    }
+
+    // tickets without a seat go to the back of the queues, those whose
+    // journey is gone are cancelled; back to front, as removePassengerAt
+    // moves the last one down
+    QVector<QPair<int, bool>> leaving; // (index, queue)
+    for (int i: std::as_const(cancelAt)) leaving.append(qMakePair(i, false));
+    for (int i: std::as_const(queueAt)) leaving.append(qMakePair(i, true));
+    std::sort(leaving.begin(), leaving.end(), [](const QPair<int, bool> &a, const QPair<int, bool> &b) {
+        return a.first > b.first;
+    });
+    for (const QPair<int, bool> &l: std::as_const(leaving)) {
+        Passenger p = passengers[l.first];
+        removePassengerAt(l.first, !l.second); // a requeued ticket was not refunded
+        if (!l.second) {
+            ++diff.cancelled;
+            RC_COUNT(Cancelled, 1);
+            continue;
+        }
+        const Train &t = trains[index.value(p.trainId)];
+        const bool rac = waitlist.depth(p.trainId, p.journeyDate, int(p.seatClass), BookingStatus::RAC) < t.racSeats;
+        p.status = rac ? BookingStatus::RAC : BookingStatus::Waitlisted;
+        p.seatNo = 0;
+        p.fare = 0.0; // priced on confirmation
+        p.waitSeq = -1;
+        waitlist.add(p);
+        ++diff.requeued;
+    }
+
+    // a longer train frees places for the queues of its runs
+    for (const RunRef &r: std::as_const(touched)) {
+        const int ti = index.value(r.first, -1);
+        if (ti >= 0) fillFreedPlaces(ti, QDate::fromJulianDay(r.second));
+    }
+    refreshDemand();
+    changed(QString(), QDate());
+    if (!touched.isEmpty()) saveToFiles();
+    return diff;
+}
+
+static QByteArray labelValue(const QString &v) {
+    QByteArray out = v.toUtf8();
+    out.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return out;
+}
+
+QByteArray BookingDatabase::metricsText() const {
+    QByteArray out;
+    auto family = [&out](const char *name, const char *type, const char *help) {
+        out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+        out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+    };
+    auto sample = [&out](const char *name, const QByteArray &labels, double value) {
+        out += name;
+        if (!labels.isEmpty()) out += '{' + labels + '}';
+        out += ' ' + QByteArray::number(value, 'g', 12) + '\n';
+    };
+    auto runLabels = [](const QString &trainId, const QDate &date) {
+        return "train=\"" + labelValue(trainId) + "\",date=\"" + date.toString(Qt::ISODate).toUtf8() + '"';
+    };
+
+    // runs exist only for dates with bookings; their counter trees hold the load
+    family("railconnect_run_booked_seats", "gauge", "Peak seats taken over the route of a dated run.");
+    runs.forEach([&](const TrainRun &run) {
+        sample("railconnect_run_booked_seats", runLabels(run.trainId, run.date), run.seats.peak());
+    });
+    family("railconnect_run_seats", "gauge", "Seats on a dated run.");
+    runs.forEach([&](const TrainRun &run) {
+        sample("railconnect_run_seats", runLabels(run.trainId, run.date), run.seats.seats());
+    });
+    family("railconnect_waitlist_depth", "gauge", "Tickets waiting for a place, per run, class and status.");
+    waitlist.forEachRun([&](const QString &trainId, const QDate &date, int seatClass, int rac, int waiting) {
+        const QByteArray labels = runLabels(trainId, date) + ",class=\"" + classCode(SeatClass(seatClass)).toUtf8() + '"';
+        sample("railconnect_waitlist_depth", labels + ",status=\"RAC\"", rac);
+        sample("railconnect_waitlist_depth", labels + ",status=\"WL\"", waiting);
+    });
+
+    // materialized totals: read as they stand, nothing is walked
+    family("railconnect_tickets", "gauge", "Confirmed tickets held.");
+    sample("railconnect_tickets", QByteArray(), double(totals.tickets()));
+    family("railconnect_revenue", "gauge", "Fares of the confirmed tickets held.");
+    sample("railconnect_revenue", QByteArray(), totals.revenue());
+    family("railconnect_sales_today", "gauge", "Tickets confirmed today, net of refunds.");
+    sample("railconnect_sales_today", QByteArray(), double(totals.soldToday()));
+    family("railconnect_takings_today", "gauge", "Fares of today's sales, net of refunds.");
+    sample("railconnect_takings_today", QByteArray(), totals.takingsToday());
+    family("railconnect_route_tickets", "gauge", "Confirmed tickets per route (a train's end points).");
+    const QVector<LiveTotals::RouteTotal> routeTotals = totals.routes();
+    for (const LiveTotals::RouteTotal &r: routeTotals)
+        sample("railconnect_route_tickets", "from=\"" + labelValue(r.from) + "\",to=\"" + labelValue(r.to) + '"', double(r.tickets));
+    family("railconnect_route_revenue", "gauge", "Fares of the confirmed tickets per route.");
+    for (const LiveTotals::RouteTotal &r: routeTotals)
+        sample("railconnect_route_revenue", "from=\"" + labelValue(r.from) + "\",to=\"" + labelValue(r.to) + '"', r.revenue);
+    family("railconnect_train_load", "gauge", "Tickets per seat over the booking window, ten fullest trains.");
+    for (const LiveTotals::TrainLoad &t: totals.fullest(10))
+        sample("railconnect_train_load", "train=\"" + labelValue(t.trainId) + '"', t.load);
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    family("railconnect_persistence_lag_seconds", "gauge", "Age of the oldest change not yet saved, 0 when all is on disk.");
+    sample("railconnect_persistence_lag_seconds", QByteArray(), unsavedSince ? (now - unsavedSince) / 1000.0 : 0.0);
+    family("railconnect_last_save_timestamp_seconds", "gauge", "Time of the last successful save.");
+    sample("railconnect_last_save_timestamp_seconds", QByteArray(), lastSaved / 1000.0);
+
+    // counters and latency come from the per-thread recorders (zero when compiled out)
+    const Metrics::Snapshot snap = Metrics::snapshot();
+    family("railconnect_events_total", "counter", "Booking events by kind; rate(confirmed) is the booking rate.");
+    for (int c = 0; c < Metrics::kCounterCount; ++c)
+        sample("railconnect_events_total", QByteArray("kind=\"") + Metrics::counterName(Metrics::Counter(c)) + '"', snap.counters[c]);
+    family("railconnect_operation_duration_seconds", "summary", "Latency of BookingDatabase operations.");
+    for (int op = 0; op < Metrics::kOpCount; ++op) {
+        const Metrics::Histogram &h = snap.ops[op];
+        const QByteArray labels = QByteArray("op=\"") + Metrics::opName(Metrics::Op(op)) + '"';
+        for (double q: {0.5, 0.9, 0.99, 0.999}) {
+            sample("railconnect_operation_duration_seconds", labels + ",quantile=\"" + QByteArray::number(q) + '"',
+                   h.percentile(q) / 1e9);
+        }
+        sample("railconnect_operation_duration_seconds_sum", labels, h.sum / 1e9);
+        sample("railconnect_operation_duration_seconds_count", labels, double(h.count));
+    }
+    return out;
+}
+
+// -----------------------------
+// FILE: timetable.h
+// -----------------------------
+
+#ifndef TIMETABLE_H
+#define TIMETABLE_H
+
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QJsonObject>
+
+struct Train;
+
+// A call at a station as stored with the train definition. Times are minutes
+// after midnight of the day the train starts (>= 1440 is the next day),
+// -1 when not timetabled (no arrival at the origin, no departure at the end).
+struct Stop {
+    QString station;
+    int arrival = -1;
+    int departure = -1;
+    int km = -1; // distance from the train's origin, -1 if not given
+
+    QJsonObject toJson() const;
+    static Stop fromJson(const QJsonObject &obj);
+};
+
+// Compact form of a Stop used by the timetable index.
+struct StopTime {
+    int station; // interned station id
+    int arrival;
+    int departure;
+};
+
+// Timetable keeps the stops of every train in one flat array (each train's
+// route is a contiguous slice, in trains order) plus a per-station list of
+// the (train, stop) calls made there.
+class Timetable {
+public:
+    struct Match {
+        int train;    // index into BookingDatabase::trains
+        int fromStop; // position within the train's route
+        int toStop;
+    };
+
+    void rebuild(const QVector<Train> &trains);
+    void appendTrain(const Train &t);
+
+    int stationId(const QString &name) const; // -1 if no train calls there
+    QString stationName(int id) const { return stationNames.value(id); }
+    int stationCount() const { return stationNames.size(); }
+    int trainCount() const { return routeBegin.size() - 1; }
+
+    const StopTime *stops(int train) const { return stopTimes.constData() + routeBegin[train]; }
+    int stopCount(int train) const { return routeBegin[train + 1] - routeBegin[train]; }
+
+    // trains calling at from and later at to, departing from within the window
+    QVector<Match> match(int from, int to, int departAfter, int departBefore) const;
+
+    static int parseTime(const QString &hhmm); // "hh:mm" -> minutes, -1 if empty/invalid
+    static QString formatTime(int minutes);    // "" for -1, "+1" suffix past midnight
+
+private:
+    struct Call {
+        int train;
+        int stop;
+    };
+
+    int intern(const QString &name);
+
+    QHash<QString, int> stationIds; // keyed by lower-case name
+    QVector<QString> stationNames;
+    QVector<StopTime> stopTimes;
+    QVector<int> routeBegin{0};      // trainCount() + 1 offsets into stopTimes
+    QVector<QVector<Call>> callsAt;  // per station id
+};
+
+#endif // TIMETABLE_H
+
+// -----------------------------
+// FILE: timetable.cpp
+// -----------------------------
+
+#include "timetable.h"
+#include "models.h"
+
+QJsonObject Stop::toJson() const {
+    QJsonObject obj;
+    obj["station"] = station;
+    if (arrival >= 0) obj["arrival"] = Timetable::formatTime(arrival);
+    if (departure >= 0) obj["departure"] = Timetable::formatTime(departure);
+    if (km >= 0) obj["km"] = km;
+    return obj;
+}
+
+Stop Stop::fromJson(const QJsonObject &obj) {
+    Stop s;
+    s.station = obj["station"].toString();
+    s.arrival = Timetable::parseTime(obj["arrival"].toString());
+    s.departure = Timetable::parseTime(obj["departure"].toString());
+    s.km = obj["km"].toInt(-1);
+    return s;
+}
+
+int Timetable::parseTime(const QString &hhmm) {
+    // "hh:mm" with an optional "+d" day offset, e.g. "05:30+1"
+    const QString t = hhmm.trimmed();
+    if (t.isEmpty()) return -1;
+    int days = 0;
+    QString clock = t;
+    const int plus = t.indexOf('+');
+    if (plus >= 0) {
+        bool ok = false;
+        days = t.mid(plus + 1).toInt(&ok);
+        if (!ok || days < 0) return -1;
+        clock = t.left(plus);
+    }
+    const int colon = clock.indexOf(':');
+    if (colon < 0) return -1;
+    bool okH = false, okM = false;
+    const int h = clock.left(colon).toInt(&okH);
+    const int m = clock.mid(colon + 1).toInt(&okM);
+    if (!okH || !okM || h < 0 || h > 23 || m < 0 || m > 59) return -1;
+    return days * 1440 + h * 60 + m;
+}
+
+QString Timetable::formatTime(int minutes) {
+    if (minutes < 0) return QString();
+    QString s = QString("%1:%2").arg((minutes % 1440) / 60, 2, 10, QChar('0'))
+                                .arg(minutes % 60, 2, 10, QChar('0'));
+    if (minutes >= 1440) s += QString("+%1").arg(minutes / 1440);
+    return s;
+}
+
+int Timetable::intern(const QString &name) {
+    const QString key = name.trimmed().toLower();
+    auto it = stationIds.constFind(key);
+    if (it != stationIds.constEnd()) return it.value();
+    const int id = stationNames.size();
+    stationIds.insert(key, id);
+    stationNames.append(name.trimmed());
+    callsAt.append(QVector<Call>());
+    return id;
+}
+
+int Timetable::stationId(const QString &name) const {
+    return stationIds.value(name.trimmed().toLower(), -1);
+}
+
+void Timetable::rebuild(const QVector<Train> &trains) {
+    stationIds.clear();
+    stationNames.clear();
+    callsAt.clear();
+    stopTimes.clear();
+    routeBegin = {0};
+    for (const Train &t: trains) appendTrain(t);
+}
+
+void Timetable::appendTrain(const Train &t) {
+    const int train = trainCount();
+    if (t.stops.isEmpty()) {
+        // legacy definition: just the two endpoints, untimed
+        stopTimes.append({intern(t.source), -1, -1});
+        stopTimes.append({intern(t.destination), -1, -1});
+    } else {
+        for (const Stop &s: t.stops) stopTimes.append({intern(s.station), s.arrival, s.departure});
+    }
+    routeBegin.append(stopTimes.size());
+    for (int i = routeBegin[train]; i < stopTimes.size(); ++i)
+        callsAt[stopTimes[i].station].append({train, i - routeBegin[train]});
+}
+
+QVector<Timetable::Match> Timetable::match(int from, int to, int departAfter, int departBefore) const {
+    QVector<Match> res;
+    if (from < 0 || to < 0 || from >= callsAt.size() || to >= callsAt.size()) return res;
+    const bool windowed = departAfter >= 0 || departBefore >= 0;
+    for (const Call &c: callsAt[from]) {
+        const StopTime *route = stops(c.train);
+        const int dep = route[c.stop].departure;
+        if (windowed) {
+            // untimed calls only match an open window
+            if (dep < 0) continue;
+            const int clock = dep % 1440;
+            if (departAfter >= 0 && clock < departAfter) continue;
+            if (departBefore >= 0 && clock > departBefore) continue;
+        }
+        const int n = stopCount(c.train);
+        for (int j = c.stop + 1; j < n; ++j) {
+            if (route[j].station == to) {
+                res.append({c.train, c.stop, j});
+                break;
+            }
+        }
+    }
+    return res;
+}
+
+// -----------------------------
+// FILE: planner.h
+// -----------------------------
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <QVector>
+
+class Timetable;
+
+// One hop of a train between consecutive stops.
+struct Connection {
+    int from;      // station ids
+    int to;
+    int departure; // minutes, day offset already applied
+    int arrival;
+    int trip;      // train index * kDays + day
+    int stop;      // index of the departing stop within the train's route
+};
+
+struct JourneyLeg {
+    int train;     // index into BookingDatabase::trains
+    int fromStop;
+    int toStop;
+    int departure;
+    int arrival;
+};
+
+struct Journey {
+    QVector<JourneyLeg> legs;
+    int arrival() const { return legs.isEmpty() ? -1 : legs.last().arrival; }
+    int transfers() const { return qMax(0, int(legs.size()) - 1); }
+};
+
+// Connection Scan Algorithm over all timetabled hops, sorted by departure.
+// Trains run daily, so the array covers kDays consecutive days of service.
+class JourneyPlanner {
+public:
+    static constexpr int kDays = 2;
+
+    void build(const Timetable &tt);
+    // adds the hops of tt's last train, merged into the sorted array in one
+    // linear pass instead of re-sorting every connection
+    void appendTrain(const Timetable &tt);
+
+    // Pareto-optimal journeys over (arrival, transfers): for every transfer
+    // count up to maxTransfers, the earliest arrival that beats every journey
+    // with fewer changes. minTransfer is the connection time between trains.
+    QVector<Journey> plan(int from, int to, int departAfter,
+                          int maxTransfers = 2, int minTransfer = 5) const;
+
+    int connectionCount() const { return connections.size(); }
+
+private:
+    QVector<Connection> connections;
+    int stationCount = 0;
+    int tripCount = 0;
+    int trainCount = 0;
+};
+
+#endif // PLANNER_H
+
+// -----------------------------
+// FILE: planner.cpp
+// -----------------------------
+
+#include "planner.h"
+#include "timetable.h"
+#include <algorithm>
+#include <climits>
+
+static bool departsBefore(const Connection &a, const Connection &b) {
+    return a.departure < b.departure;
+}
+
+// Trips are numbered per train, so a train appended later leaves every
+// existing trip id as it was.
+static void appendHops(const Timetable &tt, int t, QVector<Connection> &out) {
+    const StopTime *route = tt.stops(t);
+    const int n = tt.stopCount(t);
+    for (int day = 0; day < JourneyPlanner::kDays; ++day) {
+        for (int i = 0; i + 1 < n; ++i) {
+            // hops without both times cannot be scheduled
+            if (route[i].departure < 0 || route[i + 1].arrival < 0) continue;
+            out.append({route[i].station, route[i + 1].station,
+                        route[i].departure + day * 1440, route[i + 1].arrival + day * 1440,
+                        t * JourneyPlanner::kDays + day, i});
+        }
+    }
+}
+
+void JourneyPlanner::build(const Timetable &tt) {
+    connections.clear();
+    stationCount = tt.stationCount();
+    trainCount = tt.trainCount();
+    tripCount = trainCount * kDays;
+    for (int t = 0; t < trainCount; ++t) appendHops(tt, t, connections);
+    std::stable_sort(connections.begin(), connections.end(), departsBefore);
+}
+
+void JourneyPlanner::appendTrain(const Timetable &tt) {
+    stationCount = tt.stationCount();
+    trainCount = tt.trainCount();
+    tripCount = trainCount * kDays;
+    const int old = connections.size();
+    appendHops(tt, trainCount - 1, connections);
+    std::stable_sort(connections.begin() + old, connections.end(), departsBefore);
+    std::inplace_merge(connections.begin(), connections.begin() + old, connections.end(), departsBefore);
+}
+
+QVector<Journey> JourneyPlanner::plan(int from, int to, int departAfter,
+                                      int maxTransfers, int minTransfer) const {
+    QVector<Journey> res;
+    if (from < 0 || to < 0 || from == to || from >= stationCount || to >= stationCount) return res;
+    const int levels = qMax(0, maxTransfers) + 1;
+
+    // arrival[k * S + s]: earliest arrival at s using at most k + 1 trains.
+    // via[] remembers the leg that achieved it and the level it was found on.
+    struct Via {
+        int enter = -1; // connection where the train was boarded, -1 = origin
+        int exit = -1;  // connection that arrived
+        int level = -1;
+    };
+    const int S = stationCount;
+    QVector<int> arrival(levels * S, INT_MAX);
+    QVector<Via> via(levels * S);
+    QVector<int> boarded(levels * tripCount, -1); // connection index the trip was entered at
+    const int startAt = departAfter - minTransfer; // origin needs no change time
+    for (int k = 0; k < levels; ++k) arrival[k * S + from] = startAt;
+
+    auto first = std::lower_bound(connections.cbegin(), connections.cend(), departAfter,
+                                  [](const Connection &c, int t) { return c.departure < t; });
+    for (auto it = first; it != connections.cend(); ++it) {
+        const Connection &c = *it;
+        // nothing departing after the best arrival can improve it
+        if (c.departure >= arrival[(levels - 1) * S + to]) break;
+        const int ci = int(it - connections.cbegin());
+        for (int k = 0; k < levels; ++k) {
+            int &enter = boarded[k * tripCount + c.trip];
+            if (enter < 0) {
+                const int ready = k == 0 ? (c.from == from ? startAt : INT_MAX)
+                                         : arrival[(k - 1) * S + c.from];
+                if (ready == INT_MAX || ready + minTransfer > c.departure) continue;
+                enter = ci;
+            }
+            if (c.arrival < arrival[k * S + c.to]) {
+                const Via v{enter, ci, k};
+                // a journey with fewer trains is also valid for every higher level
+                for (int j = k; j < levels && c.arrival < arrival[j * S + c.to]; ++j) {
+                    arrival[j * S + c.to] = c.arrival;
+                    via[j * S + c.to] = v;
+                }
+            }
+        }
+    }
+
+    int best = INT_MAX;
+    for (int k = 0; k < levels; ++k) {
+        const int arr = arrival[k * S + to];
+        if (arr >= best || via[k * S + to].level != k) continue;
+        best = arr;
+        Journey j;
+        int station = to;
+        int level = k;
+        while (level >= 0) {
+            const Via &v = via[level * S + station];
+            if (v.enter < 0) break;
+            const Connection &in = connections[v.enter];
+            const Connection &out = connections[v.exit];
+            j.legs.prepend({in.trip / kDays, in.stop, out.stop + 1, in.departure, out.arrival});
+            station = in.from;
+            level = v.level - 1;
+        }
+        res.append(j);
+    }
+    return res;
+}
+
+// -----------------------------
+// FILE: inventory.h
+// -----------------------------
+
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include <QVector>
+#include <QtGlobal>
+
+// SeatInventory tracks which seats are taken on which hops of a route
+// (hop h runs from stop h to stop h + 1), so a seat vacated at an
+// intermediate stop can be sold again for the rest of the journey.
+//
+// Occupancy is one seat bitmap per hop, and a max segment tree over hops
+// counts occupied seats, answering "max occupancy between stop i and j"
+// in O(log n) and updating in O(log n) per booking or cancellation.
+//
+// Seats are split into classes numbered one after another, so a class is a
+// contiguous range of every hop bitmap. Each class with seats has its own
+// counter tree next to the whole-train tree in the same arrays (a train with
+// a single class just uses the whole-train tree). cls -1 means every seat.
+class SeatInventory {
+public:
+    SeatInventory() = default;
+    SeatInventory(int seats, int stops) { reset(seats, stops); }
+    void reset(int seats, int stops) { reset(QVector<int>{seats}, stops); }
+    // classSeats[c] seats in class c; empty inventory, reusing allocated storage
+    void reset(const QVector<int> &classSeats, int stops);
+
+    int seats() const { return seatCount; }
+    int hops() const { return hopCount; }
+    int classCount() const { return classBegin.size() - 1; }
+    int capacity(int cls) const {
+        return cls < 0 ? seatCount : classBegin[cls + 1] - classBegin[cls];
+    }
+    int classOf(int seat) const; // -1 if no such seat
+
+    int maxOccupancy(int fromStop, int toStop, int cls = -1) const; // over hops [fromStop, toStop)
+    int available(int fromStop, int toStop, int cls = -1) const {
+        return capacity(cls) - maxOccupancy(fromStop, toStop, cls);
+    }
+    // free places of every class at once; free must hold classCount() ints
+    void availability(int fromStop, int toStop, int *free) const;
+    int peak() const { return hopCount > 0 ? treeMax[1] : 0; }
+
+    bool isFree(int seat, int fromStop, int toStop) const;
+    int findFree(int fromStop, int toStop, int cls = -1) const; // lowest free seat (1-based), 0 if none
+    // bit i set if seat firstSeat + i exists and is free over the journey
+    quint64 freeBits(int firstSeat, int fromStop, int toStop) const;
+    int allocate(int fromStop, int toStop, int cls = -1);       // takes findFree()'s seat
+    bool occupy(int seat, int fromStop, int toStop);            // a specific seat, false if taken
+    void release(int seat, int fromStop, int toStop);
+
+private:
+    bool validRange(int fromStop, int toStop) const {
+        return fromStop >= 0 && fromStop < toStop && toStop <= hopCount;
+    }
+    int treeBase(int cls) const { return cls < 0 ? 0 : classTree[cls] * treeSize; }
+    void mark(int seat, int fromStop, int toStop, bool taken);
+    void add(int base, int node, int lo, int hi, int a, int b, int delta);
+    int query(int base, int node, int lo, int hi, int a, int b) const;
+
+    int seatCount = 0;
+    int hopCount = 0;
+    int words = 0;           // 64-bit words per hop bitmap
+    int treeSize = 0;        // nodes per tree
+    QVector<int> classBegin; // classCount() + 1 offsets; class c is seats (begin[c], begin[c + 1]]
+    QVector<int> classTree;  // per class: its tree, 0 = the whole-train tree
+    QVector<quint64> taken;  // hop-major: taken[hop * words + seat / 64]
+    QVector<int> treeMax;    // per tree: max over the node's hops, including treeAdd of the node
+    QVector<int> treeAdd;    // per tree: pending +/- applied to the whole node range
+};
+
+#endif // INVENTORY_H
+
+// -----------------------------
+// FILE: inventory.cpp
+// -----------------------------
+
+#include "inventory.h"
+#include <QtAlgorithms>
+#include <limits>
+
+void SeatInventory::reset(const QVector<int> &classSeats, int stops) {
+    classBegin.resize(classSeats.size() + 1);
+    classTree.resize(classSeats.size());
+    classBegin[0] = 0;
+    int withSeats = 0;
+    for (int c = 0; c < classSeats.size(); ++c) {
+        classBegin[c + 1] = classBegin[c] + qMax(0, classSeats[c]);
+        if (classSeats[c] > 0) ++withSeats;
+    }
+    // a class sharing the train with others gets its own tree
+    int trees = 1;
+    for (int c = 0; c < classSeats.size(); ++c) classTree[c] = classSeats[c] > 0 && withSeats > 1 ? trees++ : 0;
+    seatCount = classBegin.last();
+    hopCount = qMax(0, stops - 1);
+    words = (seatCount + 63) / 64;
+    treeSize = 4 * qMax(1, hopCount);
+    taken.fill(0, hopCount * words);
+    treeMax.fill(0, trees * treeSize);
+    treeAdd.fill(0, trees * treeSize);
+}
+
+int SeatInventory::classOf(int seat) const {
+    for (int c = 0; c < classCount(); ++c) {
+        if (seat > classBegin[c] && seat <= classBegin[c + 1]) return c;
+    }
+    return -1;
+}
+
+void SeatInventory::add(int base, int node, int lo, int hi, int a, int b, int delta) {
+    if (b <= lo || hi <= a) return;
+    if (a <= lo && hi <= b) {
+        treeMax[base + node] += delta;
+        treeAdd[base + node] += delta;
+        return;
+    }
+    const int mid = (lo + hi) / 2;
+    add(base, 2 * node, lo, mid, a, b, delta);
+    add(base, 2 * node + 1, mid, hi, a, b, delta);
+    treeMax[base + node] = qMax(treeMax[base + 2 * node], treeMax[base + 2 * node + 1]) + treeAdd[base + node];
+}
+
+int SeatInventory::query(int base, int node, int lo, int hi, int a, int b) const {
+    // not 0: a node can hold a negative count when a release lands below the
+    // node that took the matching +1, and a 0 would mask it in the max
+    if (b <= lo || hi <= a) return std::numeric_limits<int>::min() / 2;
+    if (a <= lo && hi <= b) return treeMax[base + node];
+    const int mid = (lo + hi) / 2;
+    return qMax(query(base, 2 * node, lo, mid, a, b), query(base, 2 * node + 1, mid, hi, a, b)) + treeAdd[base + node];
+}
+
+int SeatInventory::maxOccupancy(int fromStop, int toStop, int cls) const {
+    if (!validRange(fromStop, toStop) || cls >= classCount() || capacity(cls) == 0) return 0;
+    return query(treeBase(cls), 1, 0, hopCount, fromStop, toStop);
+}
+
+void SeatInventory::availability(int fromStop, int toStop, int *free) const {
+    for (int c = 0; c < classCount(); ++c) free[c] = available(fromStop, toStop, c);
+}
+
+bool SeatInventory::isFree(int seat, int fromStop, int toStop) const {
+    if (seat < 1 || seat > seatCount || !validRange(fromStop, toStop)) return false;
+    const int w = (seat - 1) / 64;
+    const quint64 bit = quint64(1) << ((seat - 1) % 64);
+    for (int h = fromStop; h < toStop; ++h) {
+        if (taken[h * words + w] & bit) return false;
+    }
+    return true;
+}
+
+void SeatInventory::mark(int seat, int fromStop, int toStop, bool set) {
+    const int w = (seat - 1) / 64;
+    const quint64 bit = quint64(1) << ((seat - 1) % 64);
+    for (int h = fromStop; h < toStop; ++h) {
+        if (set) taken[h * words + w] |= bit;
+        else taken[h * words + w] &= ~bit;
+    }
+    add(0, 1, 0, hopCount, fromStop, toStop, set ? 1 : -1);
+    const int cls = classOf(seat);
+    if (classTree[cls] != 0) add(treeBase(cls), 1, 0, hopCount, fromStop, toStop, set ? 1 : -1);
+}
+
+int SeatInventory::findFree(int fromStop, int toStop, int cls) const {
+    if (!validRange(fromStop, toStop) || cls >= classCount()) return 0;
+    if (maxOccupancy(fromStop, toStop, cls) >= capacity(cls)) return 0;
+    // bits [first, last) of the bitmap: the whole train or one class's range
+    const int first = cls < 0 ? 0 : classBegin[cls];
+    const int last = cls < 0 ? seatCount : classBegin[cls + 1];
+    for (int w = first / 64; w * 64 < last; ++w) {
+        quint64 busy = 0;
+        for (int h = fromStop; h < toStop; ++h) busy |= taken[h * words + w];
+        quint64 free = ~busy;
+        if (first > w * 64) free &= ~quint64(0) << (first - w * 64);
+        const int tail = last - w * 64;
+        if (tail < 64) free &= (quint64(1) << tail) - 1;
+        if (free) return w * 64 + int(qCountTrailingZeroBits(free)) + 1;
+    }
+    return 0;
+}
+
+quint64 SeatInventory::freeBits(int firstSeat, int fromStop, int toStop) const {
+    if (firstSeat < 1 || firstSeat > seatCount || !validRange(fromStop, toStop)) return 0;
+    const int bit = firstSeat - 1;
+    const int w = bit / 64;
+    const int shift = bit % 64;
+    quint64 low = 0, high = 0;
+    for (int h = fromStop; h < toStop; ++h) {
+        low |= taken[h * words + w];
+        if (shift && w + 1 < words) high |= taken[h * words + w + 1];
+    }
+    quint64 free = ~(shift ? (low >> shift) | (high << (64 - shift)) : low);
+    const int left = seatCount - bit;
+    if (left < 64) free &= (quint64(1) << left) - 1;
+    return free;
+}
+
+int SeatInventory::allocate(int fromStop, int toStop, int cls) {
+    const int seat = findFree(fromStop, toStop, cls);
+    if (seat > 0) mark(seat, fromStop, toStop, true);
+    return seat;
+}
+
+bool SeatInventory::occupy(int seat, int fromStop, int toStop) {
+    if (!isFree(seat, fromStop, toStop)) return false;
+    mark(seat, fromStop, toStop, true);
+    return true;
+}
+
+void SeatInventory::release(int seat, int fromStop, int toStop) {
+    if (seat < 1 || seat > seatCount || !validRange(fromStop, toStop)) return;
+    // only hops actually held by this seat are freed, so a double release is harmless
+    const int w = (seat - 1) / 64;
+    const quint64 bit = quint64(1) << ((seat - 1) % 64);
+    for (int h = fromStop; h < toStop; ++h) {
+        if (!(taken[h * words + w] & bit)) return;
+    }
+    mark(seat, fromStop, toStop, false);
+}
+
+// -----------------------------
+// FILE: runs.h
+// -----------------------------
+
+#ifndef RUNS_H
+#define RUNS_H
+
+#include <QString>
+#include <QDate>
+#include <QHash>
+#include <QPair>
+#include <QVector>
+#include "inventory.h"
+#include "demand.h"
+
+// One dated departure of a train with its own seat inventory.
+struct TrainRun {
+    QString trainId;
+    QDate date;
+    SeatInventory seats;
+    RunDemand demand; // booking pace and current price bucket
+};
+
+// RunCalendar owns the runs inside the advance-booking window
+// [firstDay, firstDay + windowDays). Runs are created on first use from a
+// pool of released ones and returned to it when their date leaves the
+// window, so memory follows the window rather than booking history.
+class RunCalendar {
+public:
+    explicit RunCalendar(int windowDays = 120);
+    ~RunCalendar();
+    RunCalendar(const RunCalendar &) = delete;
+    RunCalendar &operator=(const RunCalendar &) = delete;
+
+    int windowDays() const { return days; }
+    void setWindowDays(int d) { days = qMax(1, d); }
+    QDate firstDay() const { return first; }
+    QDate lastDay() const { return first.addDays(days - 1); }
+    bool contains(const QDate &date) const {
+        return first.isValid() && date >= first && date <= lastDay();
+    }
+
+    TrainRun *find(const QString &trainId, const QDate &date) const;
+    // existing run or a fresh one with classSeats[c] seats of class c;
+    // nullptr when date is outside the window
+    TrainRun *obtain(const QString &trainId, const QDate &date, const QVector<int> &classSeats, int stops);
+
+    void roll(const QDate &today); // release runs dated before today
+    void drop(const QString &trainId, const QDate &date = QDate()); // invalid date: every run
+    void clear();
+    int size() const { return live.size(); }
+
+    template <typename F>
+    void forEach(F f) const {
+        for (TrainRun *run: live) f(*run);
+    }
+
+private:
+    using Key = QPair<QString, qint64>; // (trainId, julian day)
+    void release(TrainRun *run);
+
+    QHash<Key, TrainRun *> live;
+    QVector<TrainRun *> pool; // released runs, storage kept for reuse
+    QDate first;
+    int days;
+};
+
+#endif // RUNS_H
+
+// -----------------------------
+// FILE: runs.cpp
+// -----------------------------
+
+#include "runs.h"
+#include <utility>
+
+// the window opens on the first roll(); until then no date is bookable
+RunCalendar::RunCalendar(int windowDays)
+    : days(qMax(1, windowDays)) {}
+
+RunCalendar::~RunCalendar() {
+    qDeleteAll(live);
+    qDeleteAll(pool);
+}
+
+TrainRun *RunCalendar::find(const QString &trainId, const QDate &date) const {
+    return live.value(Key(trainId, date.toJulianDay()), nullptr);
+}
+
+TrainRun *RunCalendar::obtain(const QString &trainId, const QDate &date, const QVector<int> &classSeats, int stops) {
+    if (!contains(date)) return nullptr;
+    const Key key(trainId, date.toJulianDay());
+    auto it = live.constFind(key);
+    if (it != live.constEnd()) return it.value();
+    TrainRun *run = pool.isEmpty() ? new TrainRun : pool.takeLast();
+    run->trainId = trainId;
+    run->date = date;
+    run->seats.reset(classSeats, stops);
+    run->demand.reset();
+    live.insert(key, run);
+    return run;
+}
+
+void RunCalendar::release(TrainRun *run) {
+    // cap the pool at the live population so a shrinking network frees memory
+    if (pool.size() < qMax(16, int(live.size()))) pool.append(run);
+    else delete run;
+}
+
+void RunCalendar::roll(const QDate &today) {
+    for (auto it = live.begin(); it != live.end();) {
+        if (it.value()->date < today) {
+            release(it.value());
+            it = live.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    first = today;
+}
+
+void RunCalendar::drop(const QString &trainId, const QDate &date) {
+    if (date.isValid()) {
+        if (TrainRun *run = live.take(Key(trainId, date.toJulianDay()))) release(run);
+        return;
+    }
+    for (auto it = live.begin(); it != live.end();) {
+        if (it.value()->trainId == trainId) {
+            release(it.value());
+            it = live.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void RunCalendar::clear() {
+    for (TrainRun *run: std::as_const(live)) release(run);
+    live.clear();
+}
+
+// -----------------------------
+// FILE: waitlist.h
+// -----------------------------
+
+#ifndef WAITLIST_H
+#define WAITLIST_H
+
+#include <QString>
+#include <QDate>
+#include <QHash>
+#include <QPair>
+#include <QVector>
+#include <utility>
+
+// Reservation quotas; each has its own waitlist queue.
+enum class Quota : quint8 { General, Tatkal, Ladies, Senior };
+constexpr int kQuotaCount = 4;
+QString quotaCode(Quota q);               // "GN", "TQ", "LD", "SS"
+Quota quotaFromCode(const QString &code); // General for unknown codes
+
+// Confirmed tickets hold a seat. RAC (reservation against cancellation)
+// tickets are next in line for one; waitlisted tickets wait for RAC.
+enum class BookingStatus : quint8 { Confirmed, RAC, Waitlisted };
+QString statusCode(BookingStatus s);      // "CNF", "RAC", "WL"
+BookingStatus statusFromCode(const QString &code);
+
+// Fenwick tree counting live sequence numbers; grows by doubling.
+class Fenwick {
+public:
+    void add(int seq, int delta);
+    int prefix(int seq) const; // live entries with sequence <= seq
+private:
+    QVector<int> tree; // 1-based, tree.size() - 1 is a power of two
+};
+
+// WaitlistEngine holds the RAC and waitlisted tickets. Every (train, date,
+// class) run has one min-heap per quota plus one for RAC, ordered by arrival,
+// and a Fenwick tree per queue over arrival numbers, so adding, cancelling,
+// promoting and "what is my WL number" are all O(log n).
+//
+// Entry must have pnr, trainId, journeyDate, seatClass, quota, status and waitSeq.
+template <typename Entry>
+class WaitlistEngine {
+public:
+    // quotas in the order their heads are offered a freed place
+    QVector<Quota> promotionOrder{Quota::Senior, Quota::Ladies, Quota::General, Quota::Tatkal};
+
+    const QVector<Entry> &entries() const { return items; } // unordered
+    int size() const { return items.size(); }
+
+    const Entry *find(const QString &pnr) const {
+        const int id = byPnr.value(pnr, -1);
+        return id < 0 ? nullptr : &items[id];
+    }
+
+    // Queues e by its status (RAC or Waitlisted) and quota. A waitSeq >= 0
+    // is kept, which restores a saved list in its original order.
+    // Returns the RAC/WL number.
+    int add(Entry e) {
+        Queue &q = queueFor(e);
+        if (e.waitSeq < 0) e.waitSeq = q.nextSeq;
+        q.nextSeq = qMax(q.nextSeq, e.waitSeq + 1);
+        const int id = items.size();
+        items.append(e);
+        heapPos.append(q.heap.size());
+        q.heap.append(id);
+        siftUp(q, heapPos[id]);
+        q.live.add(e.waitSeq, 1);
+        byPnr.insert(e.pnr, id);
+        return q.live.prefix(e.waitSeq);
+    }
+
+    bool remove(const QString &pnr, Entry *removed = nullptr) {
+        const int id = byPnr.value(pnr, -1);
+        if (id < 0) return false;
+        if (removed) *removed = items[id];
+        erase(id);
+        return true;
+    }
+
+    int position(const QString &pnr) const {
+        const int id = byPnr.value(pnr, -1);
+        if (id < 0) return 0;
+        const Entry &e = items[id];
+        auto it = runs.constFind(key(e));
+        return it->q[queueIndex(e)].live.prefix(e.waitSeq);
+    }
+
+    // RAC count, or waitlisted count over all quotas, for one class of a run
+    int depth(const QString &trainId, const QDate &date, int seatClass, BookingStatus status) const {
+        auto it = runs.constFind(runKey(trainId, date, seatClass));
+        if (it == runs.constEnd()) return 0;
+        if (status == BookingStatus::RAC) return it->q[kQuotaCount].heap.size();
+        int n = 0;
+        for (int i = 0; i < kQuotaCount; ++i) n += it->q[i].heap.size();
+        return n;
+    }
+
+    // Promotion policy: offers a freed place to the RAC head (from == RAC) or
+    // to the quota heads in promotionOrder (from == Waitlisted). The first
+    // head that fits(entry) is removed into *out. Only heads are examined, so
+    // this is O(log n) per freed place.
+    template <typename Fits>
+    bool takeNext(const QString &trainId, const QDate &date, int seatClass, BookingStatus from, Fits fits, Entry *out) {
+        auto it = runs.constFind(runKey(trainId, date, seatClass));
+        if (it == runs.constEnd()) return false;
+        int candidates[kQuotaCount + 1];
+        int n = 0;
+        if (from == BookingStatus::RAC) {
+            if (!it->q[kQuotaCount].heap.isEmpty()) candidates[n++] = it->q[kQuotaCount].heap.first();
+        } else {
+            for (Quota quota: promotionOrder) {
+                const Queue &q = it->q[int(quota)];
+                if (!q.heap.isEmpty()) candidates[n++] = q.heap.first();
+            }
+        }
+        for (int i = 0; i < n; ++i) {
+            if (!fits(std::as_const(items[candidates[i]]))) continue;
+            *out = items[candidates[i]];
+            erase(candidates[i]);
+            return true;
+        }
+        return false;
+    }
+
+    // Removes every entry matching pred, handing each to sink first, and
+    // rebuilds the queues from the rest in one pass. Returns the count.
+    template <typename Pred, typename Sink>
+    int extract(Pred pred, Sink sink) {
+        QVector<Entry> keep;
+        for (const Entry &e: std::as_const(items)) {
+            if (pred(e)) sink(e);
+            else keep.append(e);
+        }
+        const int removed = items.size() - keep.size();
+        if (removed == 0) return 0;
+        clear();
+        for (const Entry &e: std::as_const(keep)) add(e);
+        return removed;
+    }
+
+    // f(trainId, date, seatClass, rac, waitlisted) for every run with tickets
+    // waiting; the queues know their sizes, so this is O(runs), not O(entries)
+    template <typename F>
+    void forEachRun(F f) const {
+        for (auto it = runs.constBegin(); it != runs.constEnd(); ++it) {
+            int waiting = 0;
+            for (int i = 0; i < kQuotaCount; ++i) waiting += it->q[i].heap.size();
+            f(it.key().first, QDate::fromJulianDay(it.key().second.first), it.key().second.second,
+              int(it->q[kQuotaCount].heap.size()), waiting);
+        }
+    }
+
+    template <typename Sink>
+    void expireBefore(const QDate &day, Sink sink) {
+        extract([&day](const Entry &e) { return e.journeyDate < day; }, sink);
+    }
+
+    void clear() {
+        items.clear();
+        heapPos.clear();
+        byPnr.clear();
+        runs.clear();
+    }
+
+private:
+    using RunKey = QPair<QString, QPair<qint64, int>>; // (trainId, (julian day, class))
+    struct Queue {
+        QVector<int> heap; // entry ids, min-heap on waitSeq
+        Fenwick live;
+        int nextSeq = 0;
+    };
+    struct RunQueues {
+        Queue q[kQuotaCount + 1]; // per quota, then RAC
+    };
+
+    static RunKey runKey(const QString &trainId, const QDate &date, int seatClass) {
+        return RunKey(trainId, qMakePair(date.toJulianDay(), seatClass));
+    }
+    static RunKey key(const Entry &e) { return runKey(e.trainId, e.journeyDate, int(e.seatClass)); }
+    static int queueIndex(const Entry &e) {
+        return e.status == BookingStatus::RAC ? kQuotaCount : int(e.quota);
+    }
+    Queue &queueFor(const Entry &e) { return runs[key(e)].q[queueIndex(e)]; }
+
+    bool before(int a, int b) const { return items[a].waitSeq < items[b].waitSeq; }
+    void place(Queue &q, int pos, int id) { q.heap[pos] = id; heapPos[id] = pos; }
+
+    void siftUp(Queue &q, int pos) {
+        const int id = q.heap[pos];
+        while (pos > 0) {
+            const int parent = (pos - 1) / 2;
+            if (!before(id, q.heap[parent])) break;
+            place(q, pos, q.heap[parent]);
+            pos = parent;
+        }
+        place(q, pos, id);
+    }
+
+    void siftDown(Queue &q, int pos) {
+        const int id = q.heap[pos];
+        const int n = q.heap.size();
+        for (;;) {
+            int child = 2 * pos + 1;
+            if (child >= n) break;
+            if (child + 1 < n && before(q.heap[child + 1], q.heap[child])) ++child;
+            if (!before(q.heap[child], id)) break;
+            place(q, pos, q.heap[child]);
+            pos = child;
+        }
+        place(q, pos, id);
+    }
+
+    void erase(int id) {
+        const RunKey runKey = key(items[id]);
+        {
+            Queue &q = queueFor(items[id]);
+            q.live.add(items[id].waitSeq, -1);
+            const int pos = heapPos[id];
+            const int last = q.heap.size() - 1;
+            if (pos != last) {
+                place(q, pos, q.heap[last]);
+                q.heap.removeLast();
+                siftDown(q, pos);
+                siftUp(q, pos);
+            } else {
+                q.heap.removeLast();
+            }
+        }
+        byPnr.remove(items[id].pnr);
+        // keep entries dense: move the last one into the hole
+        const int tail = items.size() - 1;
+        if (id != tail) {
+            items[id] = std::move(items[tail]);
+            heapPos[id] = heapPos[tail];
+            queueFor(items[id]).heap[heapPos[id]] = id;
+            byPnr.insert(items[id].pnr, id);
+        }
+        items.removeLast();
+        heapPos.removeLast();
+        // forget runs with nothing left waiting
+        auto it = runs.find(runKey);
+        for (const Queue &q: it->q) {
+            if (!q.heap.isEmpty()) return;
+        }
+        runs.erase(it);
+    }
+
+    QVector<Entry> items;
+    QVector<int> heapPos;        // per entry: index in its queue's heap
+    QHash<QString, int> byPnr;   // pnr -> entry id
+    QHash<RunKey, RunQueues> runs;
+};
+
+#endif // WAITLIST_H
+
+// -----------------------------
+// FILE: waitlist.cpp
+// -----------------------------
+
+#include "waitlist.h"
+
+QString quotaCode(Quota q) {
+    switch (q) {
+    case Quota::Tatkal: return "TQ";
+    case Quota::Ladies: return "LD";
+    case Quota::Senior: return "SS";
+    case Quota::General: break;
+    }
+    return "GN";
+}
+
+Quota quotaFromCode(const QString &code) {
+    if (code == "TQ") return Quota::Tatkal;
+    if (code == "LD") return Quota::Ladies;
+    if (code == "SS") return Quota::Senior;
+    return Quota::General;
+}
+
+QString statusCode(BookingStatus s) {
+    switch (s) {
+    case BookingStatus::RAC: return "RAC";
+    case BookingStatus::Waitlisted: return "WL";
+    case BookingStatus::Confirmed: break;
+    }
+    return "CNF";
+}
+
+BookingStatus statusFromCode(const QString &code) {
+    if (code == "RAC") return BookingStatus::RAC;
+    if (code == "WL") return BookingStatus::Waitlisted;
+    return BookingStatus::Confirmed;
+}
+
+void Fenwick::add(int seq, int delta) {
+    int n = tree.size() - 1;
+    while (seq + 1 > n) {
+        // doubling only needs the old total at the new root; every other new
+        // node covers a range inside the (empty) new half
+        const int total = n > 0 ? prefix(n - 1) : 0;
+        const int grown = n > 0 ? 2 * n : 16;
+        tree.resize(grown + 1);
+        tree[grown] = total;
+        n = grown;
+    }
+    for (int i = seq + 1; i <= n; i += i & -i) tree[i] += delta;
+}
+
+int Fenwick::prefix(int seq) const {
+    int sum = 0;
+    for (int i = qMin(seq + 1, int(tree.size()) - 1); i > 0; i -= i & -i) sum += tree[i];
+    return sum;
+}
+
+// -----------------------------
+// FILE: timerwheel.h
+// -----------------------------
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QVector>
+#include <QtGlobal>
+
+// Hierarchical timing wheel with one-second ticks: four levels of 64 slots
+// cover about 194 days. Scheduling is O(1), and a timer is moved at most once
+// per level on its way down, so expiring it is O(1) too; advancing never
+// sweeps the outstanding timers. Cancellation is left to the owner, who
+// ignores ids it no longer knows when they fire.
+class TimerWheel {
+public:
+    explicit TimerWheel(qint64 now = 0) : current(now) {}
+
+    qint64 now() const { return current; }
+    int size() const { return count; }
+
+    void schedule(quint64 id, qint64 when);
+
+    // moves time forward to now, calling expired(id) for every due timer
+    template <typename F>
+    void advance(qint64 now, F expired) {
+        if (count == 0) {
+            if (now > current) current = now;
+            return;
+        }
+        while (current < now) {
+            ++current;
+            // refill from the coarsest level whose slot boundary is reached
+            for (int level = kLevels - 1; level > 0; --level) {
+                if ((current & ((qint64(1) << (kBits * level)) - 1)) == 0)
+                    cascade(level, int((current >> (kBits * level)) & kMask));
+            }
+            QVector<Timer> &slot = wheel[0][int(current & kMask)];
+            if (slot.isEmpty()) continue;
+            QVector<Timer> due;
+            due.swap(slot);
+            count -= due.size();
+            for (const Timer &t: std::as_const(due)) expired(t.id);
+            if (count == 0 && current < now) current = now;
+        }
+    }
+
+private:
+    static constexpr int kBits = 6;
+    static constexpr int kSlots = 1 << kBits;
+    static constexpr qint64 kMask = kSlots - 1;
+    static constexpr int kLevels = 4;
+
+    struct Timer {
+        quint64 id;
+        qint64 when;
+    };
+
+    void insert(const Timer &t);
+    void cascade(int level, int slot);
+
+    QVector<Timer> wheel[kLevels][kSlots];
+    qint64 current;
+    int count = 0;
+};
+
+#endif // TIMERWHEEL_H
+
+// -----------------------------
+// FILE: timerwheel.cpp
+// -----------------------------
+
+#include "timerwheel.h"
+
+void TimerWheel::schedule(quint64 id, qint64 when) {
+    // already due: fire on the next tick
+    insert({id, qMax(when, current + 1)});
+    ++count;
+}
+
+void TimerWheel::insert(const Timer &t) {
+    const qint64 delta = t.when - current;
+    for (int level = 0; level < kLevels; ++level) {
+        if (delta < (qint64(1) << (kBits * (level + 1))) || level == kLevels - 1) {
+            // past the last level's reach the timer is parked and re-filed on cascade
+            const qint64 when = qMin(t.when, current + (qint64(1) << (kBits * kLevels)) - 1);
+            wheel[level][int((when >> (kBits * level)) & kMask)].append(t);
+            return;
+        }
+    }
+}
+
+void TimerWheel::cascade(int level, int slot) {
+    QVector<Timer> moving;
+    moving.swap(wheel[level][slot]);
+    for (const Timer &t: std::as_const(moving)) insert(t);
+}
+
+// -----------------------------
+// FILE: requestcache.h
+// -----------------------------
+
+#ifndef REQUESTCACHE_H
+#define REQUESTCACHE_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QJsonObject>
+#include <QHash>
+#include <QQueue>
+#include <QVector>
+
+// Remembers which PNRs each idempotency key produced, and for which request,
+// so a retried booking gets the first result back instead of another seat
+// while a key reused for a different request is caught. Every key lives for
+// the same ttl, so insertion order is also expiry order: one FIFO serves
+// both for expiry and for evicting the oldest key once capacity is reached.
+class RequestCache {
+public:
+    struct Entry {
+        QString key;
+        QString request;  // fingerprint of what was asked; a retry must match it
+        QStringList pnrs; // tickets it produced
+        qint64 expiresAt; // seconds since epoch
+
+        void appendJson(QByteArray &out) const;
+        static Entry fromJson(const QJsonObject &obj);
+    };
+
+    explicit RequestCache(int capacity = 10000, int ttlSeconds = 24 * 3600)
+        : cap(capacity), ttl(ttlSeconds) {}
+
+    const Entry *find(const QString &key, qint64 now) const; // nullptr if unknown or expired
+    void remember(const QString &key, const QString &request, const QStringList &pnrs, qint64 now);
+    void restore(const Entry &e, qint64 now);             // saved entry; expired ones are dropped
+    QVector<Entry> entries() const;                        // live entries, oldest first
+    int size() const { return byKey.size(); }
+    void clear();
+
+private:
+    void add(const Entry &e, qint64 now);
+
+    QHash<QString, Entry> byKey;
+    QQueue<Entry> order; // oldest first; stale if byKey holds a newer entry for the key
+    int cap;
+    int ttl;
+};
+
+#endif // REQUESTCACHE_H
+
+// -----------------------------
+// FILE: requestcache.cpp
+// -----------------------------
+
+#include "requestcache.h"
+#include "jsonexport.h"
+#include <QJsonArray>
+
+void RequestCache::Entry::appendJson(QByteArray &out) const {
+    out += "{\"key\":"; JsonExport::appendString(out, key);
+    out += ",\"request\":"; JsonExport::appendString(out, request);
+    out += ",\"pnrs\":[";
+    for (int i = 0; i < pnrs.size(); ++i) {
+        if (i) out += ',';
+        JsonExport::appendString(out, pnrs[i]);
+    }
+    out += "],\"expires\":"; JsonExport::appendNumber(out, expiresAt);
+    out += '}';
+}
+
+RequestCache::Entry RequestCache::Entry::fromJson(const QJsonObject &obj) {
+    QStringList pnrs;
+    for (const QJsonValue &v: obj["pnrs"].toArray()) pnrs << v.toString();
+    // older files: one "pnr" and no fingerprint, so any retry of the key matches
+    if (obj.contains("pnr")) pnrs << obj["pnr"].toString();
+    return Entry{obj["key"].toString(), obj["request"].toString(), pnrs,
+                 qint64(obj["expires"].toDouble())};
+}
+
+const RequestCache::Entry *RequestCache::find(const QString &key, qint64 now) const {
+    auto it = byKey.constFind(key);
+    if (it == byKey.constEnd() || it->expiresAt <= now) return nullptr;
+    return &it.value();
+}
+
+void RequestCache::remember(const QString &key, const QString &request, const QStringList &pnrs, qint64 now) {
+    add(Entry{key, request, pnrs, now + ttl}, now);
+}
+
+void RequestCache::restore(const Entry &e, qint64 now) {
+    if (e.key.isEmpty() || e.expiresAt <= now) return;
+    add(e, now);
+}
+
+void RequestCache::add(const Entry &e, qint64 now) {
+    byKey.insert(e.key, e);
+    order.enqueue(e);
+    // pop expired entries, then the oldest while over capacity
+    while (!order.isEmpty() && (order.head().expiresAt <= now || byKey.size() > cap)) {
+        const Entry old = order.dequeue();
+        auto it = byKey.find(old.key);
+        if (it != byKey.end() && it->expiresAt == old.expiresAt) byKey.erase(it);
+    }
+}
+
+QVector<RequestCache::Entry> RequestCache::entries() const {
+    QVector<Entry> live;
+    live.reserve(byKey.size());
+    for (const Entry &e: order) {
+        auto it = byKey.constFind(e.key);
+        if (it != byKey.constEnd() && it->expiresAt == e.expiresAt) live.append(e);
+    }
+    return live;
+}
+
+void RequestCache::clear() {
+    byKey.clear();
+    order.clear();
+}
+
+// -----------------------------
+// FILE: farescript.h
+// -----------------------------
+
+#ifndef FARESCRIPT_H
+#define FARESCRIPT_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QHash>
+
+// Fare adjustments written as a small expression language, e.g.
+//
+//   # weekend surge on nearly full runs, never below 50
+//   surge = load >= 80 ? 1.15 : 1
+//   fare = max(fare * surge, 50)
+//
+// A script is a list of "name = expression" statements (newline or ';'
+// separated, '#' starts a comment), run in order. fare starts as the
+// engine's table quote and its final value is the price. Inputs: fare, km,
+// hops, age, load (percent of seats taken), class, quota and surge (the
+// demand multiplier already in fare), with constants
+// SL AC3 AC2 CC and GN TQ LD SS. Operators: + - * / < <= > >= == != && || !
+// ?: and min(a, b), max(a, b), round(a). Everything is a double; comparisons
+// give 1 or 0.
+//
+// compile() turns the text into bytecode for a stack machine once; run() is
+// a single switch loop over it with a fixed-size stack.
+class FareScript {
+public:
+    // slots of the inputs, in the order of their names above
+    enum Input { FareVar, KmVar, HopsVar, AgeVar, LoadVar, ClassVar, QuotaVar, SurgeVar, kInputCount };
+
+    bool compile(const QString &source, QString *error = nullptr);
+    bool isEmpty() const { return code.isEmpty(); }
+    int variableCount() const { return names.size(); } // inputs first, then assigned names
+
+    // vars holds variableCount() slots, the inputs filled in; returns the new fare
+    double run(double *vars) const;
+
+private:
+    enum class Op : quint8 {
+        Push, Load, Store, Neg, Not, Add, Sub, Mul, Div,
+        Lt, Le, Gt, Ge, Eq, Ne, And, Or, Min, Max, Round, JumpIfZero, Jump
+    };
+    static constexpr int kMaxStack = 64;
+
+    class Compiler; // farescript.cpp
+
+    QVector<qint32> code;
+    QVector<double> consts;
+    QStringList names; // slot -> variable name
+};
+
+#endif // FARESCRIPT_H
+
+// -----------------------------
+// FILE: farescript.cpp
+// -----------------------------
+
+#include "farescript.h"
+#include <QPair>
+#include <cmath>
+
+// recursive descent over the tokens, emitting code as it goes
+class FareScript::Compiler {
+public:
+    struct Token {
+        enum Kind { End, Newline, Number, Name, Symbol } kind;
+        QString text;
+        double value = 0.0;
+    };
+
+    static QVector<Token> tokenize(const QString &src, QString *error);
+
+    Compiler(const QVector<Token> &t, FareScript &out) : tokens(t), s(out) {}
+
+    bool statements(QString *error) {
+        while (peek().kind != Token::End) {
+            if (peek().kind == Token::Newline) { ++pos; continue; }
+            const Token name = tokens[pos++];
+            if (name.kind != Token::Name || !isSymbol("=")) return fail(error, "expected 'name = expression'");
+            ++pos;
+            if (!ternary()) return fail(error, failure);
+            int slot = s.names.indexOf(name.text);
+            if (slot < 0) { slot = s.names.size(); s.names.append(name.text); }
+            put(Op::Store, slot, -1);
+            if (peek().kind != Token::Newline && peek().kind != Token::End)
+                return fail(error, QString("unexpected '%1'").arg(peek().text));
+        }
+        return true;
+    }
+
+    int maxDepth = 0;
+
+private:
+    const Token &peek() const { return tokens[pos]; }
+    bool isSymbol(const char *sym) const { return peek().kind == Token::Symbol && peek().text == QLatin1String(sym); }
+    bool fail(QString *error, const QString &msg) {
+        if (error) *error = msg;
+        return false;
+    }
+    bool expect(const char *sym) {
+        if (!isSymbol(sym)) { failure = QString("expected '%1'").arg(sym); return false; }
+        ++pos;
+        return true;
+    }
+
+    // instruction: op in the low 8 bits, operand (constant, slot or jump target) above
+    void put(Op op, int arg, int stackEffect) {
+        s.code.append(qint32(op) | (arg << 8));
+        depth += stackEffect;
+        maxDepth = qMax(maxDepth, depth);
+    }
+    void patch(int at, int target) { s.code[at] = (s.code[at] & 0xff) | (target << 8); }
+
+    bool ternary() {
+        if (!binary(0)) return false;
+        if (!isSymbol("?")) return true;
+        ++pos;
+        const int skipThen = s.code.size();
+        put(Op::JumpIfZero, 0, -1);
+        if (!ternary() || !expect(":")) return false;
+        const int skipElse = s.code.size();
+        put(Op::Jump, 0, -1); // only one branch's value is ever on the stack
+        patch(skipThen, s.code.size());
+        if (!ternary()) return false;
+        patch(skipElse, s.code.size());
+        return true;
+    }
+
+    // precedence climbing: || < && < comparisons < + - < * /
+    bool binary(int level) {
+        static const QVector<QVector<QPair<QString, Op>>> levels{
+            {{"||", Op::Or}},
+            {{"&&", Op::And}},
+            {{"<", Op::Lt}, {"<=", Op::Le}, {">", Op::Gt}, {">=", Op::Ge}, {"==", Op::Eq}, {"!=", Op::Ne}},
+            {{"+", Op::Add}, {"-", Op::Sub}},
+            {{"*", Op::Mul}, {"/", Op::Div}},
+        };
+        if (level == levels.size()) return unary();
+        if (!binary(level + 1)) return false;
+        for (;;) {
+            const QPair<QString, Op> *op = nullptr;
+            for (const auto &o: levels[level]) {
+                if (peek().kind == Token::Symbol && peek().text == o.first) op = &o;
+            }
+            if (!op) return true;
+            ++pos;
+            if (!binary(level + 1)) return false;
+            put(op->second, 0, -1);
+        }
+    }
+
+    bool unary() {
+        if (isSymbol("-") || isSymbol("!")) {
+            const bool neg = peek().text == "-";
+            ++pos;
+            if (!unary()) return false;
+            put(neg ? Op::Neg : Op::Not, 0, 0);
+            return true;
+        }
+        return primary();
+    }
+
+    bool primary() {
+        const Token t = peek();
+        if (t.kind == Token::Number) {
+            ++pos;
+            pushConst(t.value);
+            return true;
+        }
+        if (isSymbol("(")) {
+            ++pos;
+            return ternary() && expect(")");
+        }
+        if (t.kind != Token::Name) {
+            failure = t.kind == Token::Symbol ? QString("unexpected '%1'").arg(t.text)
+                                              : QString("unexpected end of statement");
+            return false;
+        }
+        ++pos;
+        if (isSymbol("(")) return call(t.text);
+        static const QHash<QString, double> constants{
+            {"SL", 0}, {"AC3", 1}, {"AC2", 2}, {"CC", 3},
+            {"GN", 0}, {"TQ", 1}, {"LD", 2}, {"SS", 3},
+        };
+        auto c = constants.constFind(t.text);
+        if (c != constants.constEnd()) {
+            pushConst(c.value());
+            return true;
+        }
+        const int slot = s.names.indexOf(t.text);
+        if (slot < 0) { failure = QString("unknown name '%1'").arg(t.text); return false; }
+        put(Op::Load, slot, 1);
+        return true;
+    }
+
+    bool call(const QString &fn) {
+        const int args = fn == "round" ? 1 : (fn == "min" || fn == "max") ? 2 : 0;
+        if (args == 0) { failure = QString("unknown function '%1'").arg(fn); return false; }
+        ++pos; // '('
+        if (!ternary()) return false;
+        if (args == 2 && !(expect(",") && ternary())) return false;
+        if (!expect(")")) return false;
+        if (args == 1) put(Op::Round, 0, 0);
+        else put(fn == "min" ? Op::Min : Op::Max, 0, -1);
+        return true;
+    }
+
+    void pushConst(double v) {
+        int k = s.consts.indexOf(v);
+        if (k < 0) { k = s.consts.size(); s.consts.append(v); }
+        put(Op::Push, k, 1);
+    }
+
+    const QVector<Token> &tokens;
+    FareScript &s;
+    int pos = 0;
+    int depth = 0;
+    QString failure;
+};
+
+QVector<FareScript::Compiler::Token> FareScript::Compiler::tokenize(const QString &src, QString *error) {
+    QVector<Token> out;
+    int i = 0;
+    const int n = src.size();
+    while (i < n) {
+        const QChar c = src[i];
+        if (c == '#') {
+            while (i < n && src[i] != '\n') ++i;
+        } else if (c == '\n' || c == ';') {
+            out.append({Token::Newline, QString()});
+            ++i;
+        } else if (c.isSpace()) {
+            ++i;
+        } else if (c.isDigit() || c == '.') {
+            int j = i;
+            while (j < n && (src[j].isDigit() || src[j] == '.')) ++j;
+            bool ok = false;
+            const double v = src.mid(i, j - i).toDouble(&ok);
+            if (!ok) { *error = QString("bad number '%1'").arg(src.mid(i, j - i)); return {}; }
+            out.append({Token::Number, src.mid(i, j - i), v});
+            i = j;
+        } else if (c.isLetter() || c == '_') {
+            int j = i;
+            while (j < n && (src[j].isLetterOrNumber() || src[j] == '_')) ++j;
+            out.append({Token::Name, src.mid(i, j - i)});
+            i = j;
+        } else {
+            static const QStringList twoChar{"<=", ">=", "==", "!=", "&&", "||"};
+            const QString two = src.mid(i, 2);
+            if (twoChar.contains(two)) {
+                out.append({Token::Symbol, two});
+                i += 2;
+            } else if (QString("+-*/<>!?:(),=").contains(c)) {
+                out.append({Token::Symbol, QString(c)});
+                ++i;
+            } else {
+                *error = QString("unexpected '%1'").arg(c);
+                return {};
+            }
+        }
+    }
+    out.append({Token::End, QString()});
+    return out;
+}
+
+bool FareScript::compile(const QString &source, QString *error) {
+    QString err;
+    const QVector<Compiler::Token> tokens = Compiler::tokenize(source, &err);
+    FareScript next;
+    next.names = QStringList{"fare", "km", "hops", "age", "load", "class", "quota", "surge"};
+    Compiler c(tokens, next);
+    if (tokens.isEmpty() || !c.statements(&err)) {
+        if (error) *error = err;
+        return false;
+    }
+    if (c.maxDepth > kMaxStack) {
+        if (error) *error = "expression too deeply nested";
+        return false;
+    }
+    // only replace the running script once the new one compiled
+    *this = next;
+    return true;
+}
+
+double FareScript::run(double *vars) const {
+    double stack[kMaxStack];
+    int sp = 0;
+    const qint32 *begin = code.constData();
+    const qint32 *pc = begin;
+    const qint32 *end = begin + code.size();
+    const double *k = consts.constData();
+    while (pc < end) {
+        const qint32 in = *pc++;
+        const int arg = in >> 8;
+        switch (Op(in & 0xff)) {
+        case Op::Push: stack[sp++] = k[arg]; break;
+        case Op::Load: stack[sp++] = vars[arg]; break;
+        case Op::Store: vars[arg] = stack[--sp]; break;
+        case Op::Neg: stack[sp - 1] = -stack[sp - 1]; break;
+        case Op::Not: stack[sp - 1] = stack[sp - 1] == 0.0; break;
+        case Op::Add: --sp; stack[sp - 1] += stack[sp]; break;
+        case Op::Sub: --sp; stack[sp - 1] -= stack[sp]; break;
+        case Op::Mul: --sp; stack[sp - 1] *= stack[sp]; break;
+        case Op::Div: --sp; stack[sp - 1] = stack[sp] != 0.0 ? stack[sp - 1] / stack[sp] : 0.0; break;
+        case Op::Lt: --sp; stack[sp - 1] = stack[sp - 1] < stack[sp]; break;
+        case Op::Le: --sp; stack[sp - 1] = stack[sp - 1] <= stack[sp]; break;
+        case Op::Gt: --sp; stack[sp - 1] = stack[sp - 1] > stack[sp]; break;
+        case Op::Ge: --sp; stack[sp - 1] = stack[sp - 1] >= stack[sp]; break;
+        case Op::Eq: --sp; stack[sp - 1] = stack[sp - 1] == stack[sp]; break;
+        case Op::Ne: --sp; stack[sp - 1] = stack[sp - 1] != stack[sp]; break;
+        case Op::And: --sp; stack[sp - 1] = stack[sp - 1] != 0.0 && stack[sp] != 0.0; break;
+        case Op::Or: --sp; stack[sp - 1] = stack[sp - 1] != 0.0 || stack[sp] != 0.0; break;
+        case Op::Min: --sp; stack[sp - 1] = qMin(stack[sp - 1], stack[sp]); break;
+        case Op::Max: --sp; stack[sp - 1] = qMax(stack[sp - 1], stack[sp]); break;
+        case Op::Round: stack[sp - 1] = std::round(stack[sp - 1]); break;
+        case Op::JumpIfZero: if (stack[--sp] == 0.0) pc = begin + arg; break;
+        case Op::Jump: pc = begin + arg; break;
+        }
+    }
+    return vars[FareVar];
+}
+
+// -----------------------------
+// FILE: demand.h
+// -----------------------------
+
+#ifndef DEMAND_H
+#define DEMAND_H
+
+#include <QDate>
+#include <QHash>
+#include <QPair>
+#include <QVector>
+#include <atomic>
+
+struct TrainRun;
+class Timetable;
+
+// price levels, cheapest first; kNeutralBucket charges the plain fare
+constexpr int kDemandBuckets = 8;
+constexpr int kNeutralBucket = 2;
+
+// Booking pace as an exponentially decayed event count: every booking adds 1,
+// every cancellation takes 1, and the total decays with time constant kTau,
+// so score / kTau is the recent rate. An update is O(1) and keeps no history.
+struct Velocity {
+    static constexpr double kTau = 6 * 3600.0; // seconds
+
+    double score = 0.0;
+    qint64 stamp = 0; // seconds since epoch of the last event
+
+    void add(qint64 now, int delta);
+    double perHour(qint64 now) const;
+};
+
+// Demand state carried by each run. The bucket is written by the thread that
+// books and read without locking by anything that quotes.
+struct RunDemand {
+    Velocity pace;
+    std::atomic<int> bucket{kNeutralBucket};
+
+    void reset() {
+        pace = Velocity();
+        bucket.store(kNeutralBucket, std::memory_order_relaxed);
+    }
+};
+
+// DemandPricing turns a run's state into a price bucket: how full it would
+// be if the current booking pace held for up to three more days, scaled by
+// how much of its route's demand it draws compared with the other trains
+// between the same end points, and nudged by days to departure. A booking or
+// cancellation re-buckets only its own run; other runs on the route pick up
+// the route's new pace on their next event or on the daily refresh.
+class DemandPricing {
+public:
+    static double multiplier(int bucket);
+
+    void build(const Timetable &tt); // routes and departure times, per train
+    void appendTrain(const Timetable &tt); // the same for the next train of tt
+
+    // a booking (+1) or cancellation (-1) on run, which is train's run
+    void record(TrainRun &run, int train, int delta, qint64 now);
+    // re-buckets run from its current load, pace and time to departure
+    void refresh(TrainRun &run, int train, qint64 now);
+    void expireBefore(const QDate &day); // forgets route pace of past dates
+
+private:
+    using RouteDay = QPair<int, qint64>; // (route, julian day)
+
+    int bucketFor(const TrainRun &run, int train, qint64 now) const;
+
+    QVector<int> routeOf;     // per train: interned (origin, destination) pair
+    QVector<int> departs;     // per train: minutes after midnight at the origin
+    QVector<int> trainsOn;    // per route: trains serving it
+    QHash<QPair<int, int>, int> routeIds; // (origin, destination) station ids -> route
+    QHash<RouteDay, Velocity> routePace;
+};
+
+#endif // DEMAND_H
+
+// -----------------------------
+// FILE: demand.cpp
+// -----------------------------
+
+#include "demand.h"
+#include "runs.h"
+#include "timetable.h"
+#include <QDateTime>
+#include <cmath>
+
+void Velocity::add(qint64 now, int delta) {
+    if (now > stamp) score *= std::exp(-(now - stamp) / kTau);
+    stamp = qMax(stamp, now);
+    score = qMax(0.0, score + delta);
+}
+
+double Velocity::perHour(qint64 now) const {
+    const double decayed = now > stamp ? score * std::exp(-(now - stamp) / kTau) : score;
+    return decayed / kTau * 3600.0;
+}
+
+double DemandPricing::multiplier(int bucket) {
+    static constexpr double kMultiplier[kDemandBuckets] = {0.9, 0.95, 1.0, 1.1, 1.2, 1.35, 1.5, 1.7};
+    return kMultiplier[qBound(0, bucket, kDemandBuckets - 1)];
+}
+
+void DemandPricing::build(const Timetable &tt) {
+    routeIds.clear();
+    routeOf.clear();
+    departs.clear();
+    trainsOn.clear();
+    while (routeOf.size() < tt.trainCount()) appendTrain(tt);
+}
+
+void DemandPricing::appendTrain(const Timetable &tt) {
+    // trains are added in timetable order: this one is at index routeOf.size()
+    const int t = routeOf.size();
+    const StopTime *route = tt.stops(t);
+    const int n = tt.stopCount(t);
+    const QPair<int, int> ends(route[0].station, route[n - 1].station);
+    auto it = routeIds.constFind(ends);
+    int id;
+    if (it != routeIds.constEnd()) {
+        id = it.value();
+    } else {
+        id = trainsOn.size();
+        routeIds.insert(ends, id);
+        trainsOn.append(0);
+    }
+    ++trainsOn[id];
+    routeOf.append(id);
+    departs.append(qMax(0, route[0].departure));
+}
+
+int DemandPricing::bucketFor(const TrainRun &run, int train, qint64 now) const {
+    const int seats = run.seats.seats();
+    if (seats <= 0) return kNeutralBucket;
+    const qint64 departure = QDateTime(run.date, QTime(0, 0)).toSecsSinceEpoch() + departs[train] * 60;
+    const double hoursLeft = qMax(0.0, (departure - now) / 3600.0);
+    const double pace = run.demand.pace.perHour(now);
+    double projected = (run.seats.peak() + pace * qMin(hoursLeft, 72.0)) / seats;
+    const int route = routeOf[train];
+    if (trainsOn[route] > 1) {
+        // busier than its fair share of the route: demand is concentrating here
+        const double fair = routePace.value(RouteDay(route, run.date.toJulianDay())).perHour(now) / trainsOn[route];
+        if (fair > 0.0) projected *= qBound(0.5, pace / fair, 2.0);
+    }
+    int bucket = int(projected * 4); // half full is neutral, full is 4
+    if (hoursLeft < 48) ++bucket;
+    else if (hoursLeft > 30 * 24) --bucket;
+    return qBound(0, bucket, kDemandBuckets - 1);
+}
+
+void DemandPricing::record(TrainRun &run, int train, int delta, qint64 now) {
+    run.demand.pace.add(now, delta);
+    routePace[RouteDay(routeOf[train], run.date.toJulianDay())].add(now, delta);
+    refresh(run, train, now);
+}
+
+void DemandPricing::refresh(TrainRun &run, int train, qint64 now) {
+    run.demand.bucket.store(bucketFor(run, train, now), std::memory_order_relaxed);
+}
+
+void DemandPricing::expireBefore(const QDate &day) {
+    for (auto it = routePace.begin(); it != routePace.end();) {
+        if (it.key().second < day.toJulianDay()) it = routePace.erase(it);
+        else ++it;
+    }
+}
+
+// -----------------------------
+// FILE: fares.h
+// -----------------------------
+
+#ifndef FARES_H
+#define FARES_H
+
+#include <QString>
+#include <QVector>
+#include "waitlist.h"
+#include "farescript.h"
+
+struct Train;
+
+// Travel classes, cheapest first.
+enum class SeatClass : quint8 { Sleeper, ThirdAC, SecondAC, ChairCar };
+constexpr int kClassCount = 4;
+QString classCode(SeatClass c);               // "SL", "3A", "2A", "CC"
+SeatClass classFromCode(const QString &code); // Sleeper for unknown codes
+
+// One pricing rule: the fare is multiplied by factor when the query's key for
+// this kind lies in [low, high]. Keys are the enum value for class and quota,
+// years for age, km travelled for distance, and the run's load in percent of
+// its seats for demand. Rules of the same kind multiply.
+struct FareRule {
+    enum Kind : quint8 { ByClass, ByQuota, ByAge, ByDistance, ByDemand };
+    Kind kind;
+    int low;
+    int high;
+    double factor;
+};
+
+// One journey on one train for one kind of passenger.
+struct FareQuery {
+    int train;    // index into BookingDatabase::trains
+    int fromStop;
+    int toStop;
+    int load;     // seats taken on the run once this one is, for the demand rules
+    double surge = 1.0; // demand multiplier of the run, see DemandPricing
+    SeatClass seatClass = SeatClass::Sleeper;
+    Quota quota = Quota::General;
+    int age = 30;
+};
+
+// FareEngine compiles the rules into one factor table per kind, and every
+// route into cumulative distance per stop, so a quote is
+//   perUnit * (units to - units from) * class * quota * age * distance * demand * surge
+// with six table reads and no branching on rules. A route's units are km
+// when all of its stops carry them, otherwise hops (and distance rules then
+// see 0 km). baseFare stays the Sleeper/General/adult fare for the whole route.
+// An optional FareScript then adjusts each table quote.
+class FareEngine {
+public:
+    FareEngine() { setRules(defaultRules()); }
+
+    static QVector<FareRule> defaultRules();
+    const QVector<FareRule> &rules() const { return ruleList; }
+    void setRules(const QVector<FareRule> &rules); // recompiles the factor tables
+    // replaces the script if source compiles; an empty source removes it
+    bool setScript(const QString &source, QString *error = nullptr) { return script.compile(source, error); }
+
+    void build(const QVector<Train> &trains);
+    void appendTrain(const Train &t);
+
+    double quote(const FareQuery &q) const;
+    // out[i] = quote(queries[i]); one pass over flat tables for result lists
+    void quote(const FareQuery *queries, int n, double *out) const;
+
+private:
+    static constexpr int kMaxAge = 120;
+    static constexpr int kBandKm = 25;      // width of one distance band
+    static constexpr int kDistanceBands = 200;
+
+    struct Route {
+        int begin;        // offset into units
+        double perUnit;   // baseFare per unit of the route
+        double kmPerUnit; // 0 when the route has no km
+        int seats;
+    };
+
+    QVector<FareRule> ruleList;
+    FareScript script;
+    double classF[kClassCount];
+    double quotaF[kQuotaCount];
+    double ageF[kMaxAge + 1];
+    double distanceF[kDistanceBands];
+    double demandF[101];
+
+    QVector<Route> routes;  // per train
+    QVector<float> units;   // cumulative units per stop, routes back to back
+};
+
+#endif // FARES_H
+
+// -----------------------------
+// FILE: fares.cpp
+// -----------------------------
+
+#include "fares.h"
+#include "models.h"
+#include <algorithm>
+#include <iterator>
+
+QString classCode(SeatClass c) {
+    switch (c) {
+    case SeatClass::ThirdAC: return "3A";
+    case SeatClass::SecondAC: return "2A";
+    case SeatClass::ChairCar: return "CC";
+    case SeatClass::Sleeper: break;
+    }
+    return "SL";
+}
+
+SeatClass classFromCode(const QString &code) {
+    if (code == "3A") return SeatClass::ThirdAC;
+    if (code == "2A") return SeatClass::SecondAC;
+    if (code == "CC") return SeatClass::ChairCar;
+    return SeatClass::Sleeper;
+}
+
+QVector<FareRule> FareEngine::defaultRules() {
+    return {
+        {FareRule::ByClass, int(SeatClass::ThirdAC), int(SeatClass::ThirdAC), 2.5},
+        {FareRule::ByClass, int(SeatClass::SecondAC), int(SeatClass::SecondAC), 3.5},
+        {FareRule::ByClass, int(SeatClass::ChairCar), int(SeatClass::ChairCar), 1.8},
+        {FareRule::ByQuota, int(Quota::Tatkal), int(Quota::Tatkal), 1.3},
+        {FareRule::ByAge, 0, 11, 0.5},            // children
+        {FareRule::ByAge, 60, kMaxAge, 0.6},      // senior citizens
+        {FareRule::ByDistance, 500, 1000000, 0.9}, // tapering on long journeys
+        {FareRule::ByDistance, 1000, 1000000, 0.9},
+        // no ByDemand rules: load is priced through the run's surge instead
+    };
+}
+
+void FareEngine::setRules(const QVector<FareRule> &rules) {
+    ruleList = rules;
+    std::fill(std::begin(classF), std::end(classF), 1.0);
+    std::fill(std::begin(quotaF), std::end(quotaF), 1.0);
+    std::fill(std::begin(ageF), std::end(ageF), 1.0);
+    std::fill(std::begin(distanceF), std::end(distanceF), 1.0);
+    std::fill(std::begin(demandF), std::end(demandF), 1.0);
+    // key range of a rule applied to table slots [lo, hi]
+    auto apply = [](double *table, int size, int lo, int hi, double factor) {
+        for (int i = qMax(0, lo); i <= qMin(hi, size - 1); ++i) table[i] *= factor;
+    };
+    for (const FareRule &r: rules) {
+        switch (r.kind) {
+        case FareRule::ByClass: apply(classF, kClassCount, r.low, r.high, r.factor); break;
+        case FareRule::ByQuota: apply(quotaF, kQuotaCount, r.low, r.high, r.factor); break;
+        case FareRule::ByAge: apply(ageF, kMaxAge + 1, r.low, r.high, r.factor); break;
+        case FareRule::ByDemand: apply(demandF, 101, r.low, r.high, r.factor); break;
+        case FareRule::ByDistance:
+            // a band counts when its first km is covered; the last band is open ended
+            apply(distanceF, kDistanceBands, (r.low + kBandKm - 1) / kBandKm, r.high / kBandKm, r.factor);
+            break;
+        }
+    }
+}
+
+void FareEngine::build(const QVector<Train> &trains) {
+    routes.clear();
+    units.clear();
+    for (const Train &t: trains) appendTrain(t);
+}
+
+void FareEngine::appendTrain(const Train &t) {
+    // same stop list as Timetable::appendTrain: legacy trains are two endpoints
+    const int n = qMax(2, int(t.stops.size()));
+    bool haveKm = t.stops.size() >= 2;
+    for (int i = 0; haveKm && i < t.stops.size(); ++i)
+        haveKm = t.stops[i].km >= 0 && (i == 0 || t.stops[i].km >= t.stops[i - 1].km);
+    if (haveKm) haveKm = t.stops.last().km > t.stops.first().km;
+
+    Route r;
+    r.begin = units.size();
+    r.seats = t.totalSeats;
+    for (int i = 0; i < n; ++i) units.append(haveKm ? float(t.stops[i].km - t.stops.first().km) : float(i));
+    const double total = units.last();
+    r.perUnit = t.baseFare / total;
+    r.kmPerUnit = haveKm ? 1.0 : 0.0;
+    routes.append(r);
+}
+
+double FareEngine::quote(const FareQuery &q) const {
+    double fare;
+    quote(&q, 1, &fare);
+    return fare;
+}
+
+void FareEngine::quote(const FareQuery *queries, int n, double *out) const {
+    for (int i = 0; i < n; ++i) {
+        const FareQuery &q = queries[i];
+        const Route &r = routes[q.train];
+        const float *at = units.constData() + r.begin;
+        const double span = at[q.toStop] - at[q.fromStop];
+        const int band = qMin(int(span * r.kmPerUnit) / kBandKm, kDistanceBands - 1);
+        const int pct = r.seats > 0 ? qBound(0, q.load * 100 / r.seats, 100) : 0;
+        out[i] = r.perUnit * span * classF[int(q.seatClass)] * quotaF[int(q.quota)]
+                 * ageF[qBound(0, q.age, kMaxAge)] * distanceF[band] * demandF[pct] * q.surge;
+    }
+    if (script.isEmpty()) return;
+    // second pass: the script sees each table quote and its inputs
+    QVector<double> vars(script.variableCount());
+    for (int i = 0; i < n; ++i) {
+        const FareQuery &q = queries[i];
+        const Route &r = routes[q.train];
+        const float *at = units.constData() + r.begin;
+        vars[FareScript::FareVar] = out[i];
+        vars[FareScript::KmVar] = (at[q.toStop] - at[q.fromStop]) * r.kmPerUnit;
+        vars[FareScript::HopsVar] = q.toStop - q.fromStop;
+        vars[FareScript::AgeVar] = q.age;
+        vars[FareScript::LoadVar] = r.seats > 0 ? qBound(0, q.load * 100 / r.seats, 100) : 0;
+        vars[FareScript::ClassVar] = int(q.seatClass);
+        vars[FareScript::QuotaVar] = int(q.quota);
+        vars[FareScript::SurgeVar] = q.surge;
+        out[i] = qMax(0.0, script.run(vars.data()));
+    }
+}
+
+// -----------------------------
+// FILE: coaches.h
+// -----------------------------
+
+#ifndef COACHES_H
+#define COACHES_H
+
+#include <QtGlobal>
+#include <QtAlgorithms>
+#include "fares.h"
+
+// Where a place sits in its coach: berths in sleeper classes, seats in chair cars.
+enum class Berth : quint8 { Lower, Middle, Upper, SideLower, SideUpper, Window, Centre, Aisle };
+constexpr int kBerthCount = 8;
+
+constexpr const char *berthCode(Berth b) {
+    switch (b) {
+    case Berth::Lower: return "LB";
+    case Berth::Middle: return "MB";
+    case Berth::Upper: return "UB";
+    case Berth::SideLower: return "SL";
+    case Berth::SideUpper: return "SU";
+    case Berth::Window: return "WS";
+    case Berth::Centre: return "CS";
+    case Berth::Aisle: return "AS";
+    }
+    return "";
+}
+
+inline int berthFromCode(const QString &code) { // -1 for unknown codes
+    for (int b = 0; b < kBerthCount; ++b) {
+        if (code == berthCode(Berth(b))) return b;
+    }
+    return -1;
+}
+
+constexpr int kMaxCoachSeats = 128; // width of a SeatMask
+constexpr int kMaxBays = 32;
+
+// One bit per place of a coach, place n (1-based) at bit n - 1.
+struct SeatMask {
+    quint64 w[2] = {0, 0};
+
+    constexpr void set(int seat) { w[(seat - 1) / 64] |= quint64(1) << ((seat - 1) % 64); }
+    constexpr void reset(int seat) { w[(seat - 1) / 64] &= ~(quint64(1) << ((seat - 1) % 64)); }
+    constexpr bool test(int seat) const { return w[(seat - 1) / 64] >> ((seat - 1) % 64) & 1; }
+    constexpr bool any() const { return (w[0] | w[1]) != 0; }
+    constexpr int count() const { return qPopulationCount(w[0]) + qPopulationCount(w[1]); }
+    constexpr int first() const { // lowest place, 0 if none
+        return w[0] ? int(qCountTrailingZeroBits(w[0])) + 1 : w[1] ? int(qCountTrailingZeroBits(w[1])) + 65 : 0;
+    }
+    constexpr SeatMask operator&(const SeatMask &o) const { return SeatMask{{w[0] & o.w[0], w[1] & o.w[1]}}; }
+    constexpr SeatMask operator|(const SeatMask &o) const { return SeatMask{{w[0] | o.w[0], w[1] | o.w[1]}}; }
+    constexpr SeatMask operator~() const { return SeatMask{{~w[0], ~w[1]}}; }
+};
+
+// Standard coach layouts. A coach is a run of identical bays (a compartment
+// with its side berths, or a row of chair car seats) numbered from 1, and
+// the last bay may be cut short: 78 chair car seats are 15 rows of 5 and 3.
+template <SeatClass C> struct CoachLayout;
+
+template <> struct CoachLayout<SeatClass::Sleeper> {
+    static constexpr int kSeats = 72;
+    static constexpr char kPrefix = 'S';
+    static constexpr Berth kBay[] = {Berth::Lower, Berth::Middle, Berth::Upper, Berth::Lower,
+                                     Berth::Middle, Berth::Upper, Berth::SideLower, Berth::SideUpper};
+};
+
+template <> struct CoachLayout<SeatClass::ThirdAC> {
+    static constexpr int kSeats = 64;
+    static constexpr char kPrefix = 'B';
+    static constexpr Berth kBay[] = {Berth::Lower, Berth::Middle, Berth::Upper, Berth::Lower,
+                                     Berth::Middle, Berth::Upper, Berth::SideLower, Berth::SideUpper};
+};
+
+template <> struct CoachLayout<SeatClass::SecondAC> {
+    static constexpr int kSeats = 48;
+    static constexpr char kPrefix = 'A';
+    static constexpr Berth kBay[] = {Berth::Lower, Berth::Upper, Berth::Lower, Berth::Upper,
+                                     Berth::SideLower, Berth::SideUpper};
+};
+
+template <> struct CoachLayout<SeatClass::ChairCar> {
+    static constexpr int kSeats = 78;
+    static constexpr char kPrefix = 'C';
+    static constexpr Berth kBay[] = {Berth::Window, Berth::Centre, Berth::Aisle, Berth::Aisle, Berth::Window};
+};
+
+// A layout expanded to every place a SeatMask can hold, so coaches with a
+// non-standard seat count still look up by place. Built at compile time.
+struct CoachTable {
+    int seats;   // standard places per coach
+    int bay;     // places per bay
+    char prefix; // coach letter, e.g. 'S' for S1, S2...
+    Berth berth[kMaxCoachSeats];       // by place - 1
+    quint8 bayOf[kMaxCoachSeats];      // by place - 1
+    SeatMask byBerth[kBerthCount];     // places of each berth type
+    SeatMask bays[kMaxBays];           // places of each bay
+    SeatMask upTo[kMaxCoachSeats + 1]; // places 1..n
+};
+
+template <SeatClass C>
+constexpr CoachTable makeCoachTable() {
+    using L = CoachLayout<C>;
+    constexpr int bay = int(sizeof(L::kBay) / sizeof(L::kBay[0]));
+    static_assert(L::kSeats <= kMaxCoachSeats && (kMaxCoachSeats + bay - 1) / bay <= kMaxBays,
+                  "coach layout does not fit a SeatMask");
+    CoachTable t{};
+    t.seats = L::kSeats;
+    t.bay = bay;
+    t.prefix = L::kPrefix;
+    for (int i = 0; i < kMaxCoachSeats; ++i) {
+        t.berth[i] = L::kBay[i % bay];
+        t.bayOf[i] = quint8(i / bay);
+        t.byBerth[int(t.berth[i])].set(i + 1);
+        t.bays[i / bay].set(i + 1);
+        t.upTo[i + 1] = t.upTo[i];
+        t.upTo[i + 1].set(i + 1);
+    }
+    return t;
+}
+
+inline constexpr CoachTable kCoachTables[kClassCount] = {
+    makeCoachTable<SeatClass::Sleeper>(), makeCoachTable<SeatClass::ThirdAC>(),
+    makeCoachTable<SeatClass::SecondAC>(), makeCoachTable<SeatClass::ChairCar>(),
+};
+
+constexpr const CoachTable &coachTable(SeatClass c) { return kCoachTables[int(c)]; }
+constexpr Berth berthOf(SeatClass c, int seat) { return coachTable(c).berth[(seat - 1) % kMaxCoachSeats]; }
+
+static_assert(berthOf(SeatClass::Sleeper, 7) == Berth::SideLower, "sleeper bay");
+static_assert(berthOf(SeatClass::ChairCar, 78) == Berth::Aisle, "chair car last row");
+
+#endif // COACHES_H
+
+// -----------------------------
+// FILE: allocator.h
+// -----------------------------
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <QVector>
+#include "coaches.h"
+#include "inventory.h"
+
+struct Train;
+
+// One passenger's seat to find
+struct SeatRequest {
+    int fromStop;
+    int toStop;
+    SeatClass seatClass = SeatClass::Sleeper;
+    int berthPref = -1;  // a Berth, -1 = none
+    bool senior = false; // gets a lower berth unless berthPref says otherwise
+};
+
+// SeatAllocator picks seats coach by coach instead of taking the lowest free
+// seat of the class. A coach's free places over a journey come out of the
+// run's hop bitmaps as one SeatMask, and preferences and bays are SeatMasks
+// from the compile-time CoachTable, so each candidate coach costs a few
+// word operations per hop:
+//   - a single passenger gets the first free place matching the preference
+//     in any coach, else the first free place of the class;
+//   - a group sharing class and journey is kept within one bay, else two or
+//     three neighbouring bays, else one coach, else placed one by one; inside
+//     the chosen places preferences and seniors are served first.
+class SeatAllocator {
+public:
+    void build(const QVector<Train> &trains);
+    void appendTrain(const Train &t);
+
+    // takes a seat on seats for every request of train's run, all or none;
+    // out[i] gets the seat of req[i]
+    bool allocate(int train, SeatInventory &seats, const SeatRequest *req, int n, int *out) const;
+
+private:
+    struct Coach {
+        int offset; // run seat number of the coach's place 1, minus 1
+        int places; // at most kMaxCoachSeats
+        SeatClass seatClass;
+    };
+
+    static SeatMask wanted(const SeatRequest &r);
+    static SeatMask freePlaces(const SeatInventory &seats, const Coach &c, int fromStop, int toStop);
+    int single(int train, SeatInventory &seats, const SeatRequest &r) const;
+    bool together(int train, SeatInventory &seats, const SeatRequest *req, int n, int *out) const;
+    static bool place(SeatInventory &seats, const Coach &c, SeatMask free, const SeatRequest *req, int n, int *out);
+
+    QVector<int> first;    // per train: its first coach in coaches; one extra entry at the end
+    QVector<Coach> coaches; // trains back to back, in run seat order
+};
+
+#endif // ALLOCATOR_H
+
+// -----------------------------
+// FILE: allocator.cpp
+// -----------------------------
+
+#include "allocator.h"
+#include "models.h"
+
+void SeatAllocator::build(const QVector<Train> &trains) {
+    first.clear();
+    coaches.clear();
+    for (const Train &t: trains) appendTrain(t);
+}
+
+void SeatAllocator::appendTrain(const Train &t) {
+    if (first.isEmpty()) first.append(0);
+    // same numbering as Train::place: class after class, groups in list order
+    int offset = 0;
+    const QVector<int> seats = t.classSeats();
+    for (int c = 0; c < kClassCount; ++c) {
+        const int end = offset + seats[c];
+        if (t.coaches.isEmpty()) {
+            const int per = coachTable(SeatClass(c)).seats;
+            for (; offset < end; offset += per) coaches.append(Coach{offset, qMin(per, end - offset), SeatClass(c)});
+        }
+        for (const CoachGroup &g: t.coaches) {
+            if (int(g.seatClass) != c) continue;
+            for (int k = 0; k < g.coaches && g.seatsPerCoach > 0; ++k, offset += g.seatsPerCoach)
+                coaches.append(Coach{offset, qMin(g.seatsPerCoach, kMaxCoachSeats), SeatClass(c)});
+        }
+        offset = end;
+    }
+    first.append(coaches.size());
+}
+
+SeatMask SeatAllocator::wanted(const SeatRequest &r) {
+    const CoachTable &t = coachTable(r.seatClass);
+    if (r.berthPref >= 0 && r.berthPref < kBerthCount) {
+        SeatMask m = t.byBerth[r.berthPref];
+        // no window seats in a sleeper: lower berths are the ones at the window
+        if (Berth(r.berthPref) == Berth::Window && !m.any())
+            m = t.byBerth[int(Berth::Lower)] | t.byBerth[int(Berth::SideLower)];
+        return m;
+    }
+    if (r.senior) return t.byBerth[int(Berth::Lower)] | t.byBerth[int(Berth::SideLower)];
+    return SeatMask();
+}
+
+SeatMask SeatAllocator::freePlaces(const SeatInventory &seats, const Coach &c, int fromStop, int toStop) {
+    SeatMask m;
+    m.w[0] = seats.freeBits(c.offset + 1, fromStop, toStop);
+    if (c.places > 64) m.w[1] = seats.freeBits(c.offset + 65, fromStop, toStop);
+    return m & coachTable(c.seatClass).upTo[c.places];
+}
+
+bool SeatAllocator::allocate(int train, SeatInventory &seats, const SeatRequest *req, int n, int *out) const {
+    if (train < 0 || train + 1 >= first.size() || n <= 0) return false;
+    bool sameJourney = n > 1;
+    for (int i = 1; i < n && sameJourney; ++i)
+        sameJourney = req[i].seatClass == req[0].seatClass && req[i].fromStop == req[0].fromStop && req[i].toStop == req[0].toStop;
+    if (sameJourney && together(train, seats, req, n, out)) return true;
+    for (int i = 0; i < n; ++i) {
+        out[i] = single(train, seats, req[i]);
+        if (out[i] > 0) continue;
+        while (i-- > 0) seats.release(out[i], req[i].fromStop, req[i].toStop);
+        return false;
+    }
+    return true;
+}
+
+int SeatAllocator::single(int train, SeatInventory &seats, const SeatRequest &r) const {
+    if (seats.available(r.fromStop, r.toStop, int(r.seatClass)) <= 0) return 0;
+    const SeatMask want = wanted(r);
+    int fallback = 0;
+    for (int i = first[train]; i < first[train + 1]; ++i) {
+        const Coach &c = coaches[i];
+        if (c.seatClass != r.seatClass) continue;
+        const SeatMask free = freePlaces(seats, c, r.fromStop, r.toStop);
+        const SeatMask match = free & want;
+        if (match.any()) {
+            fallback = c.offset + match.first();
+            break;
+        }
+        if (!fallback && free.any()) {
+            fallback = c.offset + free.first();
+            if (!want.any()) break;
+        }
+    }
+    // coaches only cover kMaxCoachSeats places each; seats past that are still sold
+    if (!fallback) fallback = seats.findFree(r.fromStop, r.toStop, int(r.seatClass));
+    return fallback > 0 && seats.occupy(fallback, r.fromStop, r.toStop) ? fallback : 0;
+}
+
+bool SeatAllocator::together(int train, SeatInventory &seats, const SeatRequest *req, int n, int *out) const {
+    const SeatRequest &r = req[0];
+    if (seats.available(r.fromStop, r.toStop, int(r.seatClass)) < n) return false;
+    const CoachTable &t = coachTable(r.seatClass);
+    // free places per coach of the class, computed once for every span tried
+    QVector<SeatMask> free;
+    QVector<int> index;
+    for (int i = first[train]; i < first[train + 1]; ++i) {
+        if (coaches[i].seatClass != r.seatClass) continue;
+        free.append(freePlaces(seats, coaches[i], r.fromStop, r.toStop));
+        index.append(i);
+    }
+    for (int span = 1; span <= 3; ++span) {
+        for (int k = 0; k < free.size(); ++k) {
+            const int bays = (coaches[index[k]].places + t.bay - 1) / t.bay;
+            for (int b = 0; b + span <= bays; ++b) {
+                SeatMask area = t.bays[b];
+                for (int s = 1; s < span; ++s) area = area | t.bays[b + s];
+                if ((free[k] & area).count() >= n) return place(seats, coaches[index[k]], free[k] & area, req, n, out);
+            }
+        }
+    }
+    for (int k = 0; k < free.size(); ++k) {
+        if (free[k].count() >= n) return place(seats, coaches[index[k]], free[k], req, n, out);
+    }
+    return false;
+}
+
+bool SeatAllocator::place(SeatInventory &seats, const Coach &c, SeatMask free, const SeatRequest *req, int n, int *out) {
+    // passengers with a wish choose first, the rest take what is left in place order
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            const SeatMask want = wanted(req[i]);
+            if (want.any() != (pass == 0)) continue;
+            const SeatMask match = free & want;
+            const int p = match.any() ? match.first() : free.first();
+            free.reset(p);
+            out[i] = c.offset + p;
+        }
+    }
+    for (int i = 0; i < n; ++i) seats.occupy(out[i], req[i].fromStop, req[i].toStop);
+    return true;
+}
+
+// -----------------------------
+// FILE: metrics.h
+// -----------------------------
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QString>
+#include <QtGlobal>
+#include <chrono>
+
+// Latency histograms and event counters for BookingDatabase operations.
+// Each thread records into its own block with relaxed loads and stores (one
+// writer per block, so no locks and no read-modify-write); a snapshot sums
+// the blocks of every thread that has recorded. Configure with
+// RAILCONNECT_METRICS=OFF and RC_TIMED / RC_COUNT compile to nothing.
+namespace Metrics {
+
+enum Op : quint8 {
+    AddTrain, AddTrains, SearchTrains, AllTrains, PlanJourneys, BookTicket, CancelMany, CancelTrain,
+    HoldSeats, ConfirmHold, ReleaseHold, ExpireHolds, RollWindow, ReloadFareRules,
+    LoadFromFiles, SaveToFiles, kOpCount
+};
+enum Counter : quint8 {
+    Confirmed, Queued, Promoted, Cancelled, HoldsPlaced, HoldsExpired, SaveFailures, SeatConflicts, kCounterCount
+};
+
+const char *opName(Op op);           // e.g. "bookTicket"
+const char *counterName(Counter c);  // e.g. "confirmed"
+
+// HDR-style buckets: below 16 ns every value has its own bucket, above that
+// each power of two is split into 16 linear steps, so a bucket's width is at
+// most 1/16 of its values. Values are clamped below 2^40 ns (about 18 min).
+constexpr int kSubBuckets = 16;
+constexpr int kMaxExponent = 40;
+constexpr int kBuckets = (kMaxExponent - 3) * kSubBuckets;
+
+constexpr int bucketOf(quint64 nanos) {
+    if (nanos < kSubBuckets) return int(nanos);
+    if (nanos >> kMaxExponent) return kBuckets - 1;
+    int e = 63;
+    while (!(nanos >> e)) --e;
+    return (e - 3) * kSubBuckets + int(nanos >> (e - 4)) - kSubBuckets;
+}
+
+constexpr quint64 bucketStart(int b) { // smallest value of bucket b
+    return b < kSubBuckets ? quint64(b) : quint64(kSubBuckets + b % kSubBuckets) << (b / kSubBuckets - 1);
+}
+
+static_assert(bucketOf(bucketStart(200)) == 200 && bucketOf(bucketStart(201) - 1) == 200, "bucket bounds");
+
+struct Histogram {
+    quint64 count = 0;
+    quint64 sum = 0; // ns
+    quint64 max = 0;
+    quint64 buckets[kBuckets] = {};
+
+    quint64 percentile(double p) const; // ns, bucket upper edge, at most max
+};
+
+struct Snapshot {
+    Histogram ops[kOpCount];
+    qint64 counters[kCounterCount] = {};
+
+    QString toText() const; // one line per operation that ran, then the counters
+};
+
+Snapshot snapshot();
+void record(Op op, quint64 nanos);
+void add(Counter c, qint64 delta = 1);
+
+// records the time until the end of its scope
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Op op) : op(op), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        const auto spent = std::chrono::steady_clock::now() - start;
+        record(op, quint64(std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count()));
+    }
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+    Op op;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // namespace Metrics
+
+#ifdef RAILCONNECT_METRICS
+#define RC_METRICS_CAT2(a, b) a##b
+#define RC_METRICS_CAT(a, b) RC_METRICS_CAT2(a, b)
+#define RC_TIMED(op) const Metrics::ScopedTimer RC_METRICS_CAT(rcTimer, __LINE__)(Metrics::op)
+#define RC_COUNT(counter, n) Metrics::add(Metrics::counter, n)
+#else
+#define RC_TIMED(op) do {} while (0)
+#define RC_COUNT(counter, n) do {} while (0)
+#endif
+
+#endif // METRICS_H
+
+// -----------------------------
+// FILE: metrics.cpp
+// -----------------------------
+
+#include "metrics.h"
+#include <QMutex>
+#include <QStringList>
+#include <QVector>
+#include <atomic>
+
+namespace Metrics {
+
+namespace {
+
+// Written only by its thread. Blocks outlive their threads so a snapshot
+// still includes work done on pool threads that have since exited.
+struct ThreadBlock {
+    std::atomic<quint64> count[kOpCount];
+    std::atomic<quint64> sum[kOpCount];
+    std::atomic<quint64> max[kOpCount];
+    std::atomic<quint64> buckets[kOpCount][kBuckets];
+    std::atomic<qint64> counters[kCounterCount];
+};
+
+QMutex registryLock;
+QVector<ThreadBlock *> registry;
+
+ThreadBlock &local() {
+    thread_local ThreadBlock *block = nullptr;
+    if (!block) {
+        block = new ThreadBlock(); // value-initialized: all zero
+        QMutexLocker lock(&registryLock);
+        registry.append(block);
+    }
+    return *block;
+}
+
+template <typename T>
+void bump(std::atomic<T> &a, T delta) {
+    a.store(a.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+} // namespace
+
+const char *opName(Op op) {
+    static const char *const names[kOpCount] = {
+        "addTrain", "addTrains", "searchTrains", "allTrains", "planJourneys", "bookTicket", "cancelMany", "cancelTrain",
+        "holdSeats", "confirmHold", "releaseHold", "expireHolds", "rollWindow", "reloadFareRules",
+        "loadFromFiles", "saveToFiles",
+    };
+    return names[op];
+}
+
+const char *counterName(Counter c) {
+    static const char *const names[kCounterCount] = {
+        "confirmed", "queued", "promoted", "cancelled", "holdsPlaced", "holdsExpired", "saveFailures",
+        "seatConflicts",
+    };
+    return names[c];
+}
+
+void record(Op op, quint64 nanos) {
+    ThreadBlock &b = local();
+    bump<quint64>(b.count[op], 1);
+    bump<quint64>(b.sum[op], nanos);
+    bump<quint64>(b.buckets[op][bucketOf(nanos)], 1);
+    if (nanos > b.max[op].load(std::memory_order_relaxed)) b.max[op].store(nanos, std::memory_order_relaxed);
+}
+
+void add(Counter c, qint64 delta) {
+    bump<qint64>(local().counters[c], delta);
+}
+
+Snapshot snapshot() {
+    Snapshot s;
+    QMutexLocker lock(&registryLock);
+    for (const ThreadBlock *b: std::as_const(registry)) {
+        for (int op = 0; op < kOpCount; ++op) {
+            Histogram &h = s.ops[op];
+            h.count += b->count[op].load(std::memory_order_relaxed);
+            h.sum += b->sum[op].load(std::memory_order_relaxed);
+            h.max = qMax(h.max, b->max[op].load(std::memory_order_relaxed));
+            for (int i = 0; i < kBuckets; ++i) h.buckets[i] += b->buckets[op][i].load(std::memory_order_relaxed);
+        }
+        for (int c = 0; c < kCounterCount; ++c) s.counters[c] += b->counters[c].load(std::memory_order_relaxed);
+    }
+    return s;
+}
+
+quint64 Histogram::percentile(double p) const {
+    if (count == 0) return 0;
+    // blocks are read one field at a time, so buckets may hold a few more than count
+    const quint64 rank = qMax<quint64>(1, quint64(p * count + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) return qMin(max, i + 1 < kBuckets ? bucketStart(i + 1) - 1 : max);
+    }
+    return max;
+}
+
+QString Snapshot::toText() const {
+    QStringList lines;
+    auto us = [](quint64 nanos) { return QString::number(nanos / 1000.0, 'f', 1); };
+    for (int op = 0; op < kOpCount; ++op) {
+        const Histogram &h = ops[op];
+        if (h.count == 0) continue;
+        lines << QString("%1: n=%2 mean=%3us p50=%4us p99=%5us p99.9=%6us max=%7us")
+                     .arg(opName(Op(op))).arg(h.count).arg(us(h.sum / h.count))
+                     .arg(us(h.percentile(0.5))).arg(us(h.percentile(0.99)))
+                     .arg(us(h.percentile(0.999))).arg(us(h.max));
+    }
+    QStringList counts;
+    for (int c = 0; c < kCounterCount; ++c) counts << QString("%1=%2").arg(counterName(Counter(c))).arg(counters[c]);
+    lines << counts.join(' ');
+    return lines.join('\n');
+}
+
+} // namespace Metrics
+
+// -----------------------------
+// FILE: trace.h
+// -----------------------------
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QIODevice>
+#include <QtGlobal>
+
+// Scoped spans kept in a per-thread ring buffer, like a flight recorder: the
+// last kRingSize spans of every thread are always available and can be saved
+// as Chrome trace JSON, which chrome://tracing and Perfetto open directly.
+// Recording a span is two clock reads and six stores into the thread's
+// own ring. Configure with RAILCONNECT_TRACING=OFF and RC_TRACE
+// compiles to nothing.
+namespace Trace {
+
+constexpr int kRingSize = 1 << 13; // spans kept per thread; older ones are overwritten
+
+qint64 now(); // ns since the process started tracing
+// name must outlive the trace, i.e. be a string literal
+void record(const char *name, qint64 start, qint64 end);
+bool writeJson(QIODevice &dev); // retained spans of every thread
+
+class Span {
+public:
+    explicit Span(const char *name) : name(name), start(now()) {}
+    ~Span() { record(name, start, now()); }
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+private:
+    const char *name;
+    qint64 start;
+};
+
+} // namespace Trace
+
+#ifdef RAILCONNECT_TRACING
+#define RC_TRACE_CAT2(a, b) a##b
+#define RC_TRACE_CAT(a, b) RC_TRACE_CAT2(a, b)
+#define RC_TRACE(name) const Trace::Span RC_TRACE_CAT(rcSpan, __LINE__)(name)
+#else
+#define RC_TRACE(name) do {} while (0)
+#endif
+
+#endif // TRACE_H
+
+// -----------------------------
+// FILE: trace.cpp
+// -----------------------------
+
+#include "trace.h"
+#include "jsonexport.h"
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <atomic>
+#include <chrono>
+
+namespace Trace {
+
+namespace {
+
+// seq is a per-slot seqlock: 2 * span + 1 while span is being written,
+// 2 * span + 2 once it is complete, so a reader can tell a torn copy
+struct Event {
+    std::atomic<quint64> seq;
+    std::atomic<const char *> name;
+    std::atomic<qint64> start;
+    std::atomic<qint64> end;
+};
+
+// Written only by its thread; read by writeJson from any thread.
+struct Ring {
+    int tid;
+    QString threadName;
+    std::atomic<quint64> head; // spans ever recorded; the next goes to head % kRingSize
+    Event events[kRingSize];
+};
+
+const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+QMutex registryLock;
+QVector<Ring *> registry; // rings outlive their threads, like metrics blocks
+
+Ring &local() {
+    thread_local Ring *ring = nullptr;
+    if (!ring) {
+        ring = new Ring(); // value-initialized: empty
+        QMutexLocker lock(&registryLock);
+        ring->tid = registry.size() + 1;
+        ring->threadName = QThread::currentThread()->objectName();
+        if (ring->threadName.isEmpty()) ring->threadName = QString("thread %1").arg(ring->tid);
+        registry.append(ring);
+    }
+    return *ring;
+}
+
+} // namespace
+
+qint64 now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void record(const char *name, qint64 start, qint64 end) {
+    Ring &r = local();
+    const quint64 h = r.head.load(std::memory_order_relaxed);
+    Event &e = r.events[h % kRingSize];
+    e.seq.store(2 * h + 1, std::memory_order_relaxed);
+    // the odd seq is visible before any of the payload it guards
+    std::atomic_thread_fence(std::memory_order_release);
+    e.name.store(name, std::memory_order_relaxed);
+    e.start.store(start, std::memory_order_relaxed);
+    e.end.store(end, std::memory_order_relaxed);
+    e.seq.store(2 * h + 2, std::memory_order_release);
+    r.head.store(h + 1, std::memory_order_release);
+}
+
+bool writeJson(QIODevice &dev) {
+    QByteArray out = "{\"traceEvents\":[";
+    bool first = true;
+    auto begin = [&](const char *ph, const char *name, int tid) {
+        if (!first) out += ',';
+        first = false;
+        out += "\n{\"ph\":\""; out += ph;
+        out += "\",\"name\":"; JsonExport::appendString(out, QString::fromUtf8(name));
+        out += ",\"pid\":1,\"tid\":"; JsonExport::appendNumber(out, tid);
+    };
+    QMutexLocker lock(&registryLock);
+    for (const Ring *r: std::as_const(registry)) {
+        begin("M", "thread_name", r->tid);
+        out += ",\"args\":{\"name\":"; JsonExport::appendString(out, r->threadName); out += "}}";
+        const quint64 head = r->head.load(std::memory_order_acquire);
+        const quint64 from = head > quint64(kRingSize) ? head - kRingSize : 0;
+        for (quint64 i = from; i < head; ++i) {
+            const Event &e = r->events[i % kRingSize];
+            const quint64 seq = e.seq.load(std::memory_order_acquire);
+            if (seq != 2 * i + 2) continue; // being overwritten by a later span
+            const char *name = e.name.load(std::memory_order_relaxed);
+            const qint64 start = e.start.load(std::memory_order_relaxed);
+            const qint64 end = e.end.load(std::memory_order_relaxed);
+            // a copy the owning thread wrote over meanwhile is dropped
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (e.seq.load(std::memory_order_relaxed) != seq) continue;
+            begin("X", name, r->tid);
+            out += ",\"cat\":\"railconnect\",\"ts\":"; JsonExport::appendNumber(out, start / 1000.0);
+            out += ",\"dur\":"; JsonExport::appendNumber(out, (end - start) / 1000.0);
+            out += '}';
+        }
+    }
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return dev.write(out) == out.size();
+}
+
+} // namespace Trace
+
+// -----------------------------
+// FILE: metricsserver.h
+// -----------------------------
+
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QByteArray>
+#include <QObject>
+#include <QTcpServer>
+#include <functional>
+
+class QTcpSocket;
+
+// Answers GET /metrics on a localhost port with the Prometheus text format.
+// The body comes from a callback run on the GUI thread per scrape, so the
+// server itself knows nothing about bookings.
+class MetricsServer : public QObject {
+public:
+    using Render = std::function<QByteArray()>;
+
+    explicit MetricsServer(Render render, QObject *parent = nullptr);
+    bool listen(quint16 port); // binds 127.0.0.1 only
+    QString errorString() const { return server.errorString(); }
+
+private:
+    void serve(QTcpSocket *socket);
+
+    static constexpr int kRequestTimeoutMs = 5000; // to receive the request headers
+
+    QTcpServer server;
+    Render render;
+};
+
+#endif // METRICSSERVER_H
+
+// -----------------------------
+// FILE: metricsserver.cpp
+// -----------------------------
+
+#include "metricsserver.h"
+#include <QHostAddress>
+#include <QTcpSocket>
+#include <QTimer>
+#include <memory>
+
+MetricsServer::MetricsServer(Render render, QObject *parent)
+    : QObject(parent), render(std::move(render)) {
+    connect(&server, &QTcpServer::newConnection, this, [this]() {
+        while (QTcpSocket *socket = server.nextPendingConnection()) serve(socket);
+    });
+}
+
+bool MetricsServer::listen(quint16 port) {
+    return server.listen(QHostAddress::LocalHost, port);
+}
+
+void MetricsServer::serve(QTcpSocket *socket) {
+    connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+    // a client that never finishes its headers is dropped rather than kept open
+    QTimer *deadline = new QTimer(socket);
+    deadline->setSingleShot(true);
+    connect(deadline, &QTimer::timeout, socket, [socket]() {
+        socket->abort();
+        socket->deleteLater();
+    });
+    deadline->start(kRequestTimeoutMs);
+    auto request = std::make_shared<QByteArray>();
+    auto handler = std::make_shared<QMetaObject::Connection>();
+    *handler = connect(socket, &QTcpSocket::readyRead, socket, [this, socket, request, handler, deadline]() {
+        request->append(socket->readAll());
+        const int end = request->indexOf("\r\n\r\n");
+        if (end < 0 && request->size() < 8192) return; // headers not complete yet
+        // one reply per connection: whatever the client sends after it is ignored
+        disconnect(*handler);
+        deadline->stop();
+        // only the request line matters: "GET /metrics HTTP/1.1"
+        const QList<QByteArray> line = request->left(request->indexOf("\r\n")).split(' ');
+        QByteArray status = "200 OK", body;
+        if (end < 0) status = "431 Request Header Fields Too Large";
+        else if (line.size() < 2 || line[0] != "GET") status = "405 Method Not Allowed";
+        else if (line[1] != "/metrics") status = "404 Not Found";
+        else body = render();
+        QByteArray reply = "HTTP/1.1 " + status + "\r\n";
+        reply += "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+        reply += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+        reply += "Connection: close\r\n\r\n";
+        socket->write(reply + body);
+        socket->disconnectFromHost();
+    });
+}
+
+// -----------------------------
+// FILE: importer.h
+// -----------------------------
+
+#ifndef IMPORTER_H
+#define IMPORTER_H
+
+#include <QString>
+#include <QVector>
+#include "models.h"
+
+// Bulk timetable import from files on local disk. Input is split into
+// line-aligned slices parsed on the global thread pool, station names are
+// interned so all stops of a station share one QString, and trains are
+// assembled per trip in parallel. Nothing is indexed here: hand the result
+// to BookingDatabase::addTrains, which builds the indexes once per batch.
+// Fields may be quoted but must not span lines.
+namespace TimetableImport {
+
+struct Options {
+    QVector<CoachGroup> coaches{CoachGroup::standard(SeatClass::Sleeper, 1)}; // of every train
+    double farePerKm = 0.5;  // base fare of a train whose stops carry km
+    double flatFare = 100.0; // base fare otherwise
+};
+
+struct Result {
+    QVector<Train> trains;
+    qint64 rows = 0;    // stop rows read
+    qint64 skipped = 0; // rows naming unknown trips or stops, and trips of fewer than two stops
+    QString error;      // set when a file or required column is missing
+};
+
+// One row per stop, a train's rows in route order. Columns are found by the
+// header: train_id and station are required; name, arrival and departure
+// (hh:mm or hh:mm:ss, may pass 24:00), km and base_fare are optional.
+Result readCsv(const QString &path, const Options &opt = Options());
+
+// stops.txt, trips.txt and stop_times.txt of a GTFS feed. Each trip becomes
+// a train keyed by trip_id and named by trip_short_name and trip_headsign;
+// platforms count as their parent station; shape_dist_traveled is read as km.
+Result readGtfs(const QString &dir, const Options &opt = Options());
+
+} // namespace TimetableImport
+
+#endif // IMPORTER_H
+
+// -----------------------------
+// FILE: importer.cpp
+// -----------------------------
+
+#include "importer.h"
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QThreadPool>
+#include <QVarLengthArray>
+#include <QtConcurrent>
+#include <algorithm>
+#include <numeric>
+
+namespace TimetableImport {
+
+namespace {
+
+// One CSV record. Fields point into the file's bytes, except quoted fields
+// with "" escapes, which are unescaped into the record's own storage.
+class Record {
+public:
+    // reads the line starting at p; returns the start of the next one
+    const char *read(const char *p, const char *end);
+    QByteArrayView field(int i) const {
+        if (i < 0 || i >= fields.size()) return QByteArrayView();
+        return fields[i].copy >= 0 ? QByteArrayView(unescaped[fields[i].copy]) : fields[i].view;
+    }
+    int size() const { return fields.size(); }
+
+private:
+    struct Field {
+        QByteArrayView view;
+        int copy;
+    };
+    QVarLengthArray<Field, 16> fields;
+    QVarLengthArray<QByteArray, 2> unescaped;
+};
+
+const char *Record::read(const char *p, const char *end) {
+    fields.clear();
+    unescaped.clear();
+    for (;;) {
+        Field f{QByteArrayView(), -1};
+        if (p < end && *p == '"') {
+            const char *start = ++p;
+            bool escaped = false;
+            while (p < end && (*p != '"' || (p + 1 < end && p[1] == '"'))) {
+                if (*p == '"') { escaped = true; ++p; }
+                ++p;
+            }
+            f.view = QByteArrayView(start, p - start);
+            if (escaped) {
+                unescaped.append(f.view.toByteArray().replace("\"\"", "\""));
+                f.copy = unescaped.size() - 1;
+            }
+            while (p < end && *p != ',' && *p != '\n') ++p; // closing quote and any '\r'
+        } else {
+            const char *start = p;
+            while (p < end && *p != ',' && *p != '\n') ++p;
+            const char *stop = p > start && p[-1] == '\r' ? p - 1 : p;
+            f.view = QByteArrayView(start, stop - start);
+        }
+        fields.append(f);
+        if (p >= end) return end;
+        if (*p++ == '\n') return p;
+    }
+}
+
+QByteArrayView trimmed(QByteArrayView v) {
+    while (!v.isEmpty() && (v.front() == ' ' || v.front() == '\t')) v = v.sliced(1);
+    while (!v.isEmpty() && (v.back() == ' ' || v.back() == '\t')) v.chop(1);
+    return v;
+}
+
+// "h:mm" or "hh:mm:ss" to minutes after midnight (seconds dropped); -1 if empty or malformed
+int parseMinutes(QByteArrayView v) {
+    v = trimmed(v);
+    if (v.isEmpty()) return -1;
+    int part[3] = {0, 0, 0};
+    int n = 0;
+    for (char c: v) {
+        if (c == ':') {
+            if (++n > 2) return -1;
+        } else if (c >= '0' && c <= '9') {
+            part[n] = part[n] * 10 + (c - '0');
+        } else {
+            return -1;
+        }
+    }
+    if (n == 0 || part[1] > 59 || part[2] > 59) return -1;
+    return part[0] * 60 + part[1];
+}
+
+double parseNumber(QByteArrayView v, double fallback) {
+    v = trimmed(v);
+    bool ok = false;
+    const double d = QByteArray::fromRawData(v.data(), v.size()).toDouble(&ok);
+    return ok ? d : fallback;
+}
+
+QString text(QByteArrayView v) {
+    return QString::fromUtf8(trimmed(v));
+}
+
+// header: column name -> index
+QHash<QByteArray, int> columns(const Record &header) {
+    QHash<QByteArray, int> cols;
+    for (int i = 0; i < header.size(); ++i) {
+        QByteArrayView name = trimmed(header.field(i));
+        if (i == 0 && name.startsWith("\xEF\xBB\xBF")) name = name.sliced(3); // UTF-8 BOM
+        cols.insert(name.toByteArray(), i);
+    }
+    return cols;
+}
+
+struct StopRow {
+    int trip;
+    int seq;
+    int stop;
+    int arrival;
+    int departure;
+    float km;
+};
+
+struct TripInfo {
+    QString id;
+    QString name;
+    double fare = -1; // from the file; -1 = derive from options
+};
+
+// A line-aligned piece of a file with what its worker parsed out of it
+struct Slice {
+    const char *begin;
+    const char *end;
+    QVector<StopRow> rows;
+    qint64 skipped = 0;
+    // CSV only: trains and stations numbered within the slice, merged afterwards
+    QHash<QByteArray, int> tripIds;
+    QVector<TripInfo> trips;
+    QHash<QByteArray, int> stationIds;
+    QVector<QString> stations;
+};
+
+// about four slices per pool thread, each ending at a line end
+QVector<Slice> split(const char *begin, const char *end) {
+    const qint64 parts = qMax(1, QThreadPool::globalInstance()->maxThreadCount() * 4);
+    const qint64 step = qMax<qint64>(1 << 16, (end - begin) / parts + 1);
+    QVector<Slice> slices;
+    for (const char *p = begin; p < end;) {
+        const char *stop = end - p > step ? p + step : end;
+        while (stop < end && stop[-1] != '\n') ++stop;
+        slices.append(Slice{p, stop, {}, 0, {}, {}, {}, {}});
+        p = stop;
+    }
+    return slices;
+}
+
+bool readFile(const QString &path, QByteArray &data, Result &res) {
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        res.error = QString("cannot read %1").arg(path);
+        return false;
+    }
+    data = f.readAll();
+    return true;
+}
+
+QString missing(const QString &file, const QHash<QByteArray, int> &cols, std::initializer_list<const char *> required) {
+    for (const char *c: required) {
+        if (!cols.contains(c)) return QString("%1 has no %2 column").arg(file, c);
+    }
+    return QString();
+}
+
+// Rows of every slice grouped by trip, keeping slice and row order; then per
+// trip (in parallel) sorted by seq when asked and turned into a Train.
+void assemble(QVector<Slice> &slices, const QVector<TripInfo> &trips, const QVector<QString> &stations,
+              bool sortBySeq, const Options &opt, Result &res) {
+    QVector<int> begin(trips.size() + 1, 0);
+    for (const Slice &s: std::as_const(slices)) {
+        for (const StopRow &r: s.rows) ++begin[r.trip + 1];
+        res.skipped += s.skipped;
+    }
+    std::partial_sum(begin.begin(), begin.end(), begin.begin());
+    QVector<StopRow> rows(begin.last());
+    QVector<int> fill(begin.begin(), begin.end() - 1);
+    for (Slice &s: slices) {
+        for (const StopRow &r: std::as_const(s.rows)) rows[fill[r.trip]++] = r;
+        s.rows = QVector<StopRow>(); // free as we go
+    }
+    res.rows += rows.size();
+
+    QVector<int> ids(trips.size());
+    std::iota(ids.begin(), ids.end(), 0);
+    QVector<Train> built(trips.size());
+    StopRow *all = rows.data();
+    Train *out = built.data();
+    int seats = 0;
+    for (const CoachGroup &g: opt.coaches) seats += g.coaches * g.seatsPerCoach;
+    QtConcurrent::blockingMap(ids, [&](int trip) {
+        StopRow *first = all + begin[trip];
+        StopRow *last = all + begin[trip + 1];
+        if (last - first < 2) return; // dropped below
+        if (sortBySeq) std::stable_sort(first, last, [](const StopRow &a, const StopRow &b) { return a.seq < b.seq; });
+        Train &t = out[trip];
+        t.trainId = trips[trip].id;
+        t.name = trips[trip].name;
+        t.totalSeats = seats;
+        t.bookedSeats = 0;
+        t.coaches = opt.coaches;
+        t.stops.reserve(last - first);
+        for (StopRow *r = first; r < last; ++r) {
+            // a stop with one time given uses it for both
+            const int arrival = r->arrival >= 0 ? r->arrival : r->departure;
+            const int departure = r->departure >= 0 ? r->departure : r->arrival;
+            t.stops.append(Stop{stations[r->stop], arrival, departure, r->km >= 0 ? qRound(r->km) : -1});
+        }
+        t.stops.first().arrival = -1;
+        t.stops.last().departure = -1;
+        t.source = t.stops.first().station;
+        t.destination = t.stops.last().station;
+        const int km = t.stops.last().km - t.stops.first().km;
+        if (trips[trip].fare >= 0) t.baseFare = trips[trip].fare;
+        else t.baseFare = t.stops.first().km >= 0 && km > 0 ? opt.farePerKm * km : opt.flatFare;
+    });
+    res.trains.reserve(res.trains.size() + built.size());
+    for (int trip = 0; trip < built.size(); ++trip) {
+        if (begin[trip + 1] - begin[trip] >= 2) res.trains.append(std::move(built[trip]));
+        else res.skipped += begin[trip + 1] - begin[trip];
+    }
+}
+
+} // namespace
+
+Result readCsv(const QString &path, const Options &opt) {
+    Result res;
+    QByteArray data;
+    if (!readFile(path, data, res)) return res;
+    const char *p = data.constData();
+    const char *end = p + data.size();
+    Record header;
+    p = header.read(p, end);
+    const QHash<QByteArray, int> cols = columns(header);
+    res.error = missing(path, cols, {"train_id", "station"});
+    if (!res.error.isEmpty()) return res;
+    const int cTrain = cols.value("train_id"), cStation = cols.value("station");
+    const int cName = cols.value("name", -1), cFare = cols.value("base_fare", -1);
+    const int cArr = cols.value("arrival", -1), cDep = cols.value("departure", -1), cKm = cols.value("km", -1);
+
+    QVector<Slice> slices = split(p, end);
+    QtConcurrent::blockingMap(slices, [=](Slice &s) {
+        Record r;
+        for (const char *q = s.begin; q < s.end;) {
+            q = r.read(q, s.end);
+            const QByteArrayView train = trimmed(r.field(cTrain));
+            const QByteArrayView station = trimmed(r.field(cStation));
+            if (train.isEmpty() || station.isEmpty()) {
+                if (r.size() > 1 || !trimmed(r.field(0)).isEmpty()) ++s.skipped; // blank lines are not errors
+                continue;
+            }
+            auto trip = s.tripIds.constFind(train.toByteArray());
+            if (trip == s.tripIds.constEnd()) {
+                trip = s.tripIds.insert(train.toByteArray(), s.trips.size());
+                s.trips.append(TripInfo{text(train), text(r.field(cName)), parseNumber(r.field(cFare), -1)});
+            }
+            auto stop = s.stationIds.constFind(station.toByteArray());
+            if (stop == s.stationIds.constEnd()) {
+                stop = s.stationIds.insert(station.toByteArray(), s.stations.size());
+                s.stations.append(text(station));
+            }
+            s.rows.append(StopRow{trip.value(), 0, stop.value(), parseMinutes(r.field(cArr)), parseMinutes(r.field(cDep)),
+                                  float(parseNumber(r.field(cKm), -1))});
+        }
+    });
+
+    // merge the slices' numbering into one; rows keep file order
+    QHash<QString, int> tripIds, stationIds;
+    QVector<TripInfo> trips;
+    QVector<QString> stations;
+    for (Slice &s: slices) {
+        QVector<int> tripMap(s.trips.size()), stationMap(s.stations.size());
+        for (int i = 0; i < s.trips.size(); ++i) {
+            auto it = tripIds.constFind(s.trips[i].id);
+            if (it == tripIds.constEnd()) {
+                it = tripIds.insert(s.trips[i].id, trips.size());
+                trips.append(s.trips[i]);
+            }
+            tripMap[i] = it.value();
+        }
+        for (int i = 0; i < s.stations.size(); ++i) {
+            auto it = stationIds.constFind(s.stations[i]);
+            if (it == stationIds.constEnd()) {
+                it = stationIds.insert(s.stations[i], stations.size());
+                stations.append(s.stations[i]);
+            }
+            stationMap[i] = it.value();
+        }
+        for (StopRow &row: s.rows) {
+            row.trip = tripMap[row.trip];
+            row.stop = stationMap[row.stop];
+        }
+    }
+    assemble(slices, trips, stations, false, opt, res);
+    return res;
+}
+
+Result readGtfs(const QString &dir, const Options &opt) {
+    Result res;
+    const QDir feed(dir);
+    QByteArray data;
+    Record r;
+
+    // stops: each stop id resolves to its station's interned name
+    if (!readFile(feed.filePath("stops.txt"), data, res)) return res;
+    const char *p = data.constData(), *end = p + data.size();
+    p = r.read(p, end);
+    QHash<QByteArray, int> cols = columns(r);
+    res.error = missing("stops.txt", cols, {"stop_id", "stop_name"});
+    if (!res.error.isEmpty()) return res;
+    int cId = cols.value("stop_id"), cName = cols.value("stop_name"), cParent = cols.value("parent_station", -1);
+    QHash<QByteArray, int> stopIds;
+    QVector<QString> stopNames;
+    QVector<QByteArray> parents;
+    while (p < end) {
+        p = r.read(p, end);
+        const QByteArrayView id = trimmed(r.field(cId));
+        if (id.isEmpty()) continue;
+        stopIds.insert(id.toByteArray(), stopNames.size());
+        stopNames.append(text(r.field(cName)));
+        parents.append(trimmed(r.field(cParent)).toByteArray());
+    }
+    QHash<QString, int> nameIds;
+    QVector<QString> stations;
+    QVector<int> stationOf(stopNames.size());
+    for (int i = 0; i < stopNames.size(); ++i) {
+        const int parent = parents[i].isEmpty() ? -1 : stopIds.value(parents[i], -1);
+        const QString &name = stopNames[parent >= 0 ? parent : i];
+        auto it = nameIds.constFind(name);
+        if (it == nameIds.constEnd()) {
+            it = nameIds.insert(name, stations.size());
+            stations.append(name);
+        }
+        stationOf[i] = it.value();
+    }
+
+    // trips
+    if (!readFile(feed.filePath("trips.txt"), data, res)) return res;
+    p = data.constData();
+    end = p + data.size();
+    p = r.read(p, end);
+    cols = columns(r);
+    res.error = missing("trips.txt", cols, {"trip_id"});
+    if (!res.error.isEmpty()) return res;
+    cId = cols.value("trip_id");
+    const int cRoute = cols.value("route_id", -1), cShort = cols.value("trip_short_name", -1);
+    const int cHeadsign = cols.value("trip_headsign", -1);
+    QHash<QByteArray, int> tripIds;
+    QVector<TripInfo> trips;
+    while (p < end) {
+        p = r.read(p, end);
+        const QByteArrayView id = trimmed(r.field(cId));
+        if (id.isEmpty() || tripIds.contains(id.toByteArray())) continue;
+        QString name = QString("%1 %2").arg(text(r.field(cShort)), text(r.field(cHeadsign))).trimmed();
+        if (name.isEmpty()) name = text(r.field(cRoute));
+        tripIds.insert(id.toByteArray(), trips.size());
+        trips.append(TripInfo{text(id), name, -1});
+    }
+
+    // stop times: the bulk of a feed, parsed in parallel against the two read-only tables
+    if (!readFile(feed.filePath("stop_times.txt"), data, res)) return res;
+    p = data.constData();
+    end = p + data.size();
+    p = r.read(p, end);
+    cols = columns(r);
+    res.error = missing("stop_times.txt", cols, {"trip_id", "stop_id", "stop_sequence"});
+    if (!res.error.isEmpty()) return res;
+    const int cTrip = cols.value("trip_id"), cStop = cols.value("stop_id"), cSeq = cols.value("stop_sequence");
+    const int cArr = cols.value("arrival_time", -1), cDep = cols.value("departure_time", -1);
+    const int cDist = cols.value("shape_dist_traveled", -1);
+    QVector<Slice> slices = split(p, end);
+    QtConcurrent::blockingMap(slices, [&](Slice &s) {
+        Record row;
+        QByteArray key; // reused lookup buffer
+        for (const char *q = s.begin; q < s.end;) {
+            q = row.read(q, s.end);
+            key = trimmed(row.field(cTrip)).toByteArray();
+            const int trip = tripIds.value(key, -1);
+            key = trimmed(row.field(cStop)).toByteArray();
+            const int stop = stopIds.value(key, -1);
+            if (trip < 0 || stop < 0) {
+                if (row.size() > 1) ++s.skipped;
+                continue;
+            }
+            s.rows.append(StopRow{trip, int(parseNumber(row.field(cSeq), 0)), stationOf[stop],
+                                  parseMinutes(row.field(cArr)), parseMinutes(row.field(cDep)),
+                                  float(parseNumber(row.field(cDist), -1))});
+        }
+    });
+    data = QByteArray();
+    assemble(slices, trips, stations, true, opt, res);
+    return res;
+}
+
+} // namespace TimetableImport
+
+// -----------------------------
+// FILE: chart.h
+// -----------------------------
+
+#ifndef CHART_H
+#define CHART_H
+
+#include <QDate>
+#include <QHash>
+#include <QIODevice>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+class BookingDatabase;
+
+// Confirmed passengers per train, as rows of BookingDatabase::passengers.
+// Removing a passenger moves the last row into its place; move() follows
+// that, and each row remembers where it sits in its train's list, so all
+// updates are O(1).
+class ManifestIndex {
+public:
+    void clear();
+    void add(int row, const QString &trainId);           // passenger appended at row
+    void remove(int row, const QString &trainId);        // call before the row goes
+    void move(int from, int to, const QString &trainId); // passenger now at to
+    const QVector<int> &rows(const QString &trainId) const; // unordered
+    QStringList trainIds() const { return byTrain.keys(); }
+
+private:
+    QHash<QString, QVector<int>> byTrain;
+    QVector<int> slot; // per row: position in its train's list
+};
+
+// Reservation charts: a run's confirmed passengers by coach and seat, with
+// RAC and waitlist counts per class. Passengers are streamed from the
+// database through one line buffer; nothing but the sorted row numbers is
+// copied. The database must not change while a chart is written.
+namespace Chart {
+
+enum Format { Csv, Text };
+
+// rows of the run's passengers, in seat order (class, coach, seat)
+QVector<int> manifest(const BookingDatabase &db, const QString &trainId, const QDate &date);
+bool write(QIODevice &dev, const BookingDatabase &db, const QString &trainId, const QDate &date, Format format);
+// one file per train with passengers on date, written in parallel as
+// dir/chart-<train>-<yyyyMMdd>.csv or .txt. Returns the files written;
+// *failed gets the trains whose file could not be.
+int writeAll(const BookingDatabase &db, const QDate &date, const QString &dir, Format format,
+             QStringList *failed = nullptr);
+
+} // namespace Chart
+
+#endif // CHART_H
+
+// -----------------------------
+// FILE: chart.cpp
+// -----------------------------
+
+#include "chart.h"
+#include "models.h"
+#include <QDir>
+#include <QSaveFile>
+#include <QtConcurrent>
+#include <algorithm>
+#include "trace.h"
+
+void ManifestIndex::clear() {
+    byTrain.clear();
+    slot.clear();
+}
+
+void ManifestIndex::add(int row, const QString &trainId) {
+    if (slot.size() <= row) slot.resize(row + 1);
+    QVector<int> &list = byTrain[trainId];
+    slot[row] = list.size();
+    list.append(row);
+}
+
+void ManifestIndex::remove(int row, const QString &trainId) {
+    auto it = byTrain.find(trainId);
+    if (it == byTrain.end()) return;
+    QVector<int> &list = it.value();
+    const int at = slot[row];
+    const int last = list.last();
+    list[at] = last;
+    slot[last] = at;
+    list.removeLast();
+    if (list.isEmpty()) byTrain.erase(it);
+}
+
+void ManifestIndex::move(int from, int to, const QString &trainId) {
+    const int at = slot[from];
+    byTrain[trainId][at] = to;
+    slot[to] = at;
+}
+
+const QVector<int> &ManifestIndex::rows(const QString &trainId) const {
+    static const QVector<int> none;
+    auto it = byTrain.constFind(trainId);
+    return it == byTrain.constEnd() ? none : it.value();
+}
+
+namespace Chart {
+
+namespace {
+
+constexpr int kFlushBytes = 64 * 1024;
+
+void appendCsv(QByteArray &out, const QString &s) {
+    const QByteArray utf8 = s.toUtf8();
+    if (!utf8.contains(',') && !utf8.contains('"') && !utf8.contains('\n')) {
+        out += utf8;
+        return;
+    }
+    out += '"';
+    for (char c: utf8) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+// text columns are padded (or cut) to a fixed width
+void appendCell(QByteArray &out, const QString &s, int width) {
+    const QString cell = s.left(width);
+    out += cell.toUtf8();
+    out += QByteArray(width - cell.size() + 1, ' ');
+}
+
+int trainIndexOf(const BookingDatabase &db, const QString &trainId) {
+    for (int i = 0; i < db.trains.size(); ++i) {
+        if (db.trains[i].trainId == trainId) return i;
+    }
+    return -1;
+}
+
+QString stationAt(const BookingDatabase &db, int trainIndex, int stop) {
+    const int n = db.timetable.stopCount(trainIndex);
+    if (stop < 0 || stop >= n) stop = n - 1;
+    return db.timetable.stationName(db.timetable.stops(trainIndex)[stop].station);
+}
+
+QString fileName(const QString &trainId, const QDate &date, Format format) {
+    QString id = trainId;
+    for (QChar &c: id) {
+        if (!c.isLetterOrNumber() && c != '-' && c != '_') c = '_';
+    }
+    return QString("chart-%1-%2.%3").arg(id, date.toString("yyyyMMdd"), format == Csv ? "csv" : "txt");
+}
+
+} // namespace
+
+QVector<int> manifest(const BookingDatabase &db, const QString &trainId, const QDate &date) {
+    QVector<int> rows;
+    for (int r: db.manifests.rows(trainId)) {
+        if (db.passengers[r].journeyDate == date) rows.append(r);
+    }
+    // seats are numbered class after class and coach after coach
+    std::sort(rows.begin(), rows.end(), [&](int a, int b) {
+        const Passenger &x = db.passengers[a], &y = db.passengers[b];
+        if (x.seatNo != y.seatNo) return x.seatNo < y.seatNo;
+        return x.fromStop < y.fromStop; // a seat reused along the route
+    });
+    return rows;
+}
+
+bool write(QIODevice &dev, const BookingDatabase &db, const QString &trainId, const QDate &date, Format format) {
+    RC_TRACE("Chart::write");
+    const int ti = trainIndexOf(db, trainId);
+    if (ti < 0) return false;
+    const Train &t = db.trains[ti];
+    const QVector<int> rows = manifest(db, trainId, date);
+
+    QByteArray out;
+    out.reserve(kFlushBytes + 1024);
+    bool ok = true;
+    auto flush = [&](bool force) {
+        if (ok && (force || out.size() >= kFlushBytes)) {
+            ok = dev.write(out) == out.size();
+            out.resize(0);
+        }
+    };
+
+    if (format == Csv) {
+        out += "coach,seat,berth,pnr,name,age,gender,from,to,class,quota,fare\n";
+    } else {
+        out += QString("Reservation chart %1 %2, %3: %4 passenger(s)\n")
+                   .arg(t.trainId, t.name, date.toString(Qt::ISODate)).arg(rows.size()).toUtf8();
+    }
+    int coach = -1;
+    SeatClass coachClass = SeatClass::Sleeper;
+    for (int r: rows) {
+        const Passenger &p = db.passengers[r];
+        const SeatPlace at = t.place(p.seatNo);
+        const QString coachName = at.coach > 0 ? QString("%1%2").arg(QChar(coachTable(at.seatClass).prefix)).arg(at.coach)
+                                               : QString();
+        const QString berth = at.coach > 0 ? QString(berthCode(berthOf(at.seatClass, at.seat))) : QString();
+        const int seat = at.coach > 0 ? at.seat : p.seatNo;
+        if (format == Csv) {
+            appendCsv(out, coachName); out += ',';
+            out += QByteArray::number(seat); out += ',';
+            out += berth.toUtf8(); out += ',';
+            appendCsv(out, p.pnr); out += ',';
+            appendCsv(out, p.name); out += ',';
+            out += QByteArray::number(p.age); out += ',';
+            appendCsv(out, p.gender); out += ',';
+            appendCsv(out, stationAt(db, ti, p.fromStop)); out += ',';
+            appendCsv(out, stationAt(db, ti, p.toStop)); out += ',';
+            out += classCode(p.seatClass).toUtf8(); out += ',';
+            out += quotaCode(p.quota).toUtf8(); out += ',';
+            out += QByteArray::number(p.fare, 'f', 2);
+        } else {
+            if (at.coach != coach || at.seatClass != coachClass) {
+                coach = at.coach;
+                coachClass = at.seatClass;
+                out += QString("\nCoach %1 (%2)\n").arg(coachName.isEmpty() ? "-" : coachName, classCode(at.seatClass)).toUtf8();
+            }
+            appendCell(out, QString("%1 %2").arg(seat).arg(berth), 7);
+            appendCell(out, p.pnr, 12);
+            appendCell(out, p.name, 24);
+            appendCell(out, QString("%1/%2").arg(p.age).arg(p.gender.left(1)), 6);
+            appendCell(out, stationAt(db, ti, p.fromStop), 16);
+            appendCell(out, stationAt(db, ti, p.toStop), 16);
+            out += quotaCode(p.quota).toUtf8();
+        }
+        out += '\n';
+        flush(false);
+    }
+    if (format == Text) {
+        // RAC and waitlisted tickets have no seat yet: only their numbers go on the chart
+        out += '\n';
+        const QVector<int> seats = t.classSeats();
+        for (int c = 0; c < kClassCount; ++c) {
+            if (seats[c] == 0) continue;
+            out += QString("%1: RAC %2, WL %3\n").arg(classCode(SeatClass(c)))
+                       .arg(db.waitlist.depth(trainId, date, c, BookingStatus::RAC))
+                       .arg(db.waitlist.depth(trainId, date, c, BookingStatus::Waitlisted)).toUtf8();
+        }
+    }
+    flush(true);
+    return ok;
+}
+
+int writeAll(const BookingDatabase &db, const QDate &date, const QString &dir, Format format, QStringList *failed) {
+    RC_TRACE("Chart::writeAll");
+    if (!QDir().mkpath(dir)) {
+        if (failed) *failed = db.manifests.trainIds();
+        return 0;
+    }
+    // one task per train; each reads only its own rows
+    const QStringList ids = db.manifests.trainIds();
+    QVector<int> result = QtConcurrent::blockingMapped<QVector<int>>(ids, [&](const QString &id) {
+        bool any = false;
+        for (int r: db.manifests.rows(id)) {
+            if (db.passengers[r].journeyDate == date) { any = true; break; }
+        }
+        if (!any) return 0; // no chart: nobody travels on this run
+        QSaveFile f(QDir(dir).filePath(fileName(id, date, format)));
+        const bool ok = f.open(QIODevice::WriteOnly) && write(f, db, id, date, format) && f.commit();
+        return ok ? 1 : -1;
+    });
+    int written = 0;
+    for (int i = 0; i < ids.size(); ++i) {
+        if (result[i] > 0) ++written;
+        else if (result[i] < 0 && failed) failed->append(ids[i]);
+    }
+    return written;
+}
+
+} // namespace Chart
+
+// -----------------------------
+// FILE: analytics.h
+// -----------------------------
+
+#ifndef ANALYTICS_H
+#define ANALYTICS_H
+
+#include <QDate>
+#include <QHash>
+#include <QIODevice>
+#include <QString>
+#include <QVector>
+#include "fares.h"
+
+class BookingDatabase;
+struct Passenger;
+
+// Column store of ticket sales for revenue and occupancy reports. Train
+// and route (boarding-alighting stations) are dictionary encoded, so a
+// group-by reads a few flat arrays of small integers plus the fares.
+namespace Analytics {
+
+struct Dictionary {
+    QVector<QString> values;
+    QHash<QString, quint32> codes;
+
+    quint32 code(const QString &s); // adds s when new
+    int size() const { return values.size(); }
+};
+
+struct Columns {
+    Dictionary trains;
+    Dictionary routes;          // "from-to"
+    QVector<quint32> train;     // code in trains, per row
+    QVector<quint32> route;     // code in routes, per row
+    QVector<qint32> day;        // julian day of the journey
+    QVector<quint8> seatClass;  // SeatClass
+    QVector<double> fare;
+
+    qint64 size() const { return fare.size(); }
+    void reserve(qint64 rows);
+    void append(const QString &trainId, const QString &from, const QString &to, const QDate &date,
+                SeatClass c, double amount);
+
+    // confirmed tickets of db, plus the past ones in its archive when asked
+    static Columns fromBookings(const BookingDatabase &db, bool withArchive = true);
+};
+
+// Our own columnar file: a header with both dictionaries, then groups of
+// kGroupRows rows in which each column is packed to the narrowest integer
+// width its values need and zlib-compressed on its own. Groups are packed
+// in parallel.
+constexpr int kGroupRows = 1 << 20;
+bool write(QIODevice &dev, const Columns &cols);
+bool read(QIODevice &dev, Columns &cols);
+
+enum GroupKey : quint8 { ByTrain = 1, ByRoute = 2, ByDay = 4, ByClass = 8 };
+
+// one group of a report; keys not grouped by are -1 / invalid
+struct Group {
+    int train = -1;  // code in Columns::trains
+    int route = -1;  // code in Columns::routes
+    QDate day;
+    int seatClass = -1;
+    qint64 tickets = 0;
+    double revenue = 0.0;
+};
+
+// Tickets and revenue per combination of the keys (an OR of GroupKey),
+// highest revenue first. Rows are split across the thread pool; when the
+// key space is small each part adds into a flat array indexed by the
+// combined key, otherwise into a hash, and the parts are merged at the end.
+QVector<Group> groupBy(const Columns &cols, int keys);
+
+} // namespace Analytics
+
+#endif // ANALYTICS_H
+
+// -----------------------------
+// FILE: analytics.cpp
+// -----------------------------
+
+#include "analytics.h"
+#include "models.h"
+#include <QDataStream>
+#include <QFile>
+#include <QJsonDocument>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <QtEndian>
+#include <algorithm>
+#include "trace.h"
+
+namespace Analytics {
+
+quint32 Dictionary::code(const QString &s) {
+    auto it = codes.constFind(s);
+    if (it != codes.constEnd()) return it.value();
+    const quint32 c = values.size();
+    values.append(s);
+    codes.insert(s, c);
+    return c;
+}
+
+void Columns::reserve(qint64 rows) {
+    train.reserve(rows);
+    route.reserve(rows);
+    day.reserve(rows);
+    seatClass.reserve(rows);
+    fare.reserve(rows);
+}
+
+void Columns::append(const QString &trainId, const QString &from, const QString &to, const QDate &date,
+                     SeatClass c, double amount) {
+    train.append(trains.code(trainId));
+    route.append(routes.code(from + '-' + to));
+    day.append(qint32(date.toJulianDay()));
+    seatClass.append(quint8(c));
+    fare.append(amount);
+}
+
+Columns Columns::fromBookings(const BookingDatabase &db, bool withArchive) {
+    RC_TRACE("Analytics::fromBookings");
+    QHash<QString, int> index;
+    for (int i = 0; i < db.trains.size(); ++i) index.insert(db.trains[i].trainId, i);
+    auto station = [&](int ti, int stop) {
+        if (ti < 0) return QString("?"); // train since removed
+        const int n = db.timetable.stopCount(ti);
+        if (stop < 0 || stop >= n) stop = n - 1;
+        return db.timetable.stationName(db.timetable.stops(ti)[stop].station);
+    };
+    Columns cols;
+    auto add = [&](const Passenger &p) {
+        const int ti = index.value(p.trainId, -1);
+        cols.append(p.trainId, station(ti, p.fromStop), station(ti, p.toStop), p.journeyDate, p.seatClass, p.fare);
+    };
+    if (withArchive) {
+        // archived tickets travelled already: they were confirmed ones
+        QFile af(db.archivePath());
+        if (af.open(QIODevice::ReadOnly)) {
+            while (!af.atEnd()) {
+                const QByteArray line = af.readLine();
+                const QJsonDocument d = QJsonDocument::fromJson(line);
+                if (!d.isObject()) continue;
+                const Passenger p = Passenger::fromJson(d.object());
+                if (p.status == BookingStatus::Confirmed) add(p);
+            }
+        }
+    }
+    cols.reserve(cols.size() + db.passengers.size());
+    for (const Passenger &p: db.passengers) add(p);
+    return cols;
+}
+
+namespace {
+
+constexpr quint32 kMagic = 0x52434f4c; // "RCOL"
+constexpr quint16 kVersion = 1;
+
+// bytes needed for the largest value
+int widthOf(const quint32 *v, qint64 n) {
+    quint32 top = 0;
+    for (qint64 i = 0; i < n; ++i) top = qMax(top, v[i]);
+    return top < 0x100 ? 1 : top < 0x10000 ? 2 : 4;
+}
+
+QByteArray pack(const quint32 *v, qint64 n, int width) {
+    QByteArray raw(n * width, Qt::Uninitialized);
+    uchar *out = reinterpret_cast<uchar *>(raw.data());
+    for (qint64 i = 0; i < n; ++i, out += width) {
+        if (width == 1) *out = uchar(v[i]);
+        else if (width == 2) qToLittleEndian(quint16(v[i]), out);
+        else qToLittleEndian(v[i], out);
+    }
+    return raw;
+}
+
+bool unpack(const QByteArray &raw, int width, qint64 n, quint32 *v) {
+    if ((width != 1 && width != 2 && width != 4) || raw.size() != n * width) return false;
+    const uchar *in = reinterpret_cast<const uchar *>(raw.constData());
+    for (qint64 i = 0; i < n; ++i, in += width) {
+        if (width == 1) v[i] = *in;
+        else if (width == 2) v[i] = qFromLittleEndian<quint16>(in);
+        else v[i] = qFromLittleEndian<quint32>(in);
+    }
+    return true;
+}
+
+void writeDictionary(QDataStream &out, const Dictionary &d) {
+    QByteArray joined;
+    for (const QString &s: d.values) {
+        joined += s.toUtf8();
+        joined += '\0';
+    }
+    out << quint32(d.size()) << qCompress(joined);
+}
+
+bool readDictionary(QDataStream &in, Dictionary &d) {
+    quint32 n = 0;
+    QByteArray packed;
+    in >> n >> packed;
+    const QByteArray joined = qUncompress(packed);
+    d = Dictionary();
+    qsizetype at = 0;
+    for (quint32 i = 0; i < n; ++i) {
+        const qsizetype end = joined.indexOf('\0', at);
+        if (end < 0) return false;
+        d.code(QString::fromUtf8(joined.constData() + at, end - at));
+        at = end + 1;
+    }
+    return in.status() == QDataStream::Ok && d.size() == int(n);
+}
+
+// one row group, every column as (width, compressed bytes)
+struct Block {
+    qint64 begin;
+    qint64 rows;
+    QByteArray bytes;
+};
+
+} // namespace
+
+bool write(QIODevice &dev, const Columns &cols) {
+    RC_TRACE("Analytics::write");
+    const qint64 n = cols.size();
+    qint32 firstDay = 0;
+    if (n > 0) firstDay = *std::min_element(cols.day.begin(), cols.day.end());
+
+    QVector<Block> blocks;
+    for (qint64 b = 0; b < n; b += kGroupRows) blocks.append(Block{b, qMin<qint64>(kGroupRows, n - b), {}});
+    QtConcurrent::blockingMap(blocks, [&](Block &blk) {
+        RC_TRACE("pack row group");
+        QDataStream out(&blk.bytes, QIODevice::WriteOnly);
+        out.setVersion(QDataStream::Qt_6_0);
+        auto column = [&](const quint32 *v) {
+            const int width = widthOf(v, blk.rows);
+            out << quint8(width) << qCompress(pack(v, blk.rows, width));
+        };
+        column(cols.train.constData() + blk.begin);
+        column(cols.route.constData() + blk.begin);
+        QVector<quint32> days(blk.rows);
+        for (qint64 i = 0; i < blk.rows; ++i) days[i] = quint32(cols.day[blk.begin + i] - firstDay);
+        column(days.constData());
+        QVector<quint32> classes(cols.seatClass.begin() + blk.begin, cols.seatClass.begin() + blk.begin + blk.rows);
+        column(classes.constData());
+        QByteArray fares(blk.rows * 8, Qt::Uninitialized);
+        for (qint64 i = 0; i < blk.rows; ++i) qToLittleEndian(cols.fare[blk.begin + i], fares.data() + i * 8);
+        out << quint8(8) << qCompress(fares);
+    });
+
+    QDataStream out(&dev);
+    out.setVersion(QDataStream::Qt_6_0);
+    out << kMagic << kVersion << qint64(n) << qint32(kGroupRows) << firstDay;
+    writeDictionary(out, cols.trains);
+    writeDictionary(out, cols.routes);
+    for (const Block &blk: std::as_const(blocks)) {
+        if (out.status() != QDataStream::Ok) break;
+        out.writeRawData(blk.bytes.constData(), blk.bytes.size());
+    }
+    return out.status() == QDataStream::Ok;
+}
+
+bool read(QIODevice &dev, Columns &cols) {
+    RC_TRACE("Analytics::read");
+    QDataStream in(&dev);
+    in.setVersion(QDataStream::Qt_6_0);
+    quint32 magic = 0;
+    quint16 version = 0;
+    qint64 n = 0;
+    qint32 groupRows = 0, firstDay = 0;
+    in >> magic >> version >> n >> groupRows >> firstDay;
+    if (magic != kMagic || version != kVersion || n < 0 || groupRows <= 0) return false;
+    cols = Columns();
+    if (!readDictionary(in, cols.trains) || !readDictionary(in, cols.routes)) return false;
+    // n comes from the file: a row group is five columns of at least a width
+    // byte, a length and a size prefix, and zlib packs the 8-byte fares at
+    // most about 1000:1, so more rows than the rest of the file could hold
+    // means corrupt input. Sequential devices have no size to check against:
+    // their columns grow a group at a time as the data arrives.
+    const qint64 groups = n / groupRows + (n % groupRows != 0);
+    if (!dev.isSequential()) {
+        const qint64 left = dev.size() - dev.pos();
+        if (groups > left / (5 * 9) || n / 130 > left) return false;
+        cols.train.reserve(n);
+        cols.route.reserve(n);
+        cols.day.reserve(n);
+        cols.seatClass.reserve(n);
+        cols.fare.reserve(n);
+    }
+    QVector<quint32> scratch(qMin<qint64>(n, groupRows));
+    for (qint64 b = 0; b < n; b += groupRows) {
+        const qint64 rows = qMin<qint64>(groupRows, n - b);
+        cols.train.resize(b + rows);
+        cols.route.resize(b + rows);
+        cols.day.resize(b + rows);
+        cols.seatClass.resize(b + rows);
+        cols.fare.resize(b + rows);
+        auto column = [&](quint32 *v) {
+            quint8 width = 0;
+            QByteArray packed;
+            in >> width >> packed;
+            return in.status() == QDataStream::Ok && unpack(qUncompress(packed), width, rows, v);
+        };
+        if (!column(cols.train.data() + b) || !column(cols.route.data() + b)) return false;
+        if (!column(scratch.data())) return false;
+        for (qint64 i = 0; i < rows; ++i) cols.day[b + i] = firstDay + qint32(scratch[i]);
+        if (!column(scratch.data())) return false;
+        for (qint64 i = 0; i < rows; ++i) cols.seatClass[b + i] = quint8(scratch[i]);
+        quint8 width = 0;
+        QByteArray packed;
+        in >> width >> packed;
+        const QByteArray fares = qUncompress(packed);
+        if (in.status() != QDataStream::Ok || width != 8 || fares.size() != rows * 8) return false;
+        for (qint64 i = 0; i < rows; ++i) cols.fare[b + i] = qFromLittleEndian<double>(fares.constData() + i * 8);
+    }
+    // codes must point into the dictionaries
+    for (qint64 i = 0; i < n; ++i) {
+        if (cols.train[i] >= quint32(cols.trains.size()) || cols.route[i] >= quint32(cols.routes.size())) return false;
+    }
+    return true;
+}
+
+QVector<Group> groupBy(const Columns &cols, int keys) {
+    RC_TRACE("Analytics::groupBy");
+    const qint64 n = cols.size();
+    if (n == 0) return {};
+    const auto [lo, hi] = std::minmax_element(cols.day.begin(), cols.day.end());
+    const qint32 firstDay = *lo;
+
+    // combined key = train * sTrain + route * sRoute + day * sDay + class * sClass;
+    // a key not grouped by has stride 0 and size 1
+    const quint64 nTrain = keys & ByTrain ? cols.trains.size() : 1;
+    const quint64 nRoute = keys & ByRoute ? cols.routes.size() : 1;
+    const quint64 nDay = keys & ByDay ? quint64(*hi - firstDay) + 1 : 1;
+    const quint64 nClass = keys & ByClass ? kClassCount : 1;
+    const quint64 sClass = keys & ByClass ? 1 : 0;
+    const quint64 sDay = keys & ByDay ? nClass : 0;
+    const quint64 sRoute = keys & ByRoute ? nClass * nDay : 0;
+    const quint64 sTrain = keys & ByTrain ? nClass * nDay * nRoute : 0;
+    const double space = double(nTrain) * nRoute * nDay * nClass;
+    const bool dense = space <= double(1 << 18);
+
+    struct Acc {
+        qint64 tickets = 0;
+        double revenue = 0.0;
+    };
+    struct Part {
+        qint64 begin;
+        qint64 end;
+        QVector<Acc> flat;
+        QHash<quint64, Acc> sparse;
+    };
+    QVector<Part> parts;
+    const qint64 step = qMax<qint64>(1 << 16, n / qMax(1, QThreadPool::globalInstance()->maxThreadCount()) + 1);
+    for (qint64 b = 0; b < n; b += step) parts.append(Part{b, qMin(n, b + step), {}, {}});
+
+    const quint32 *train = cols.train.constData();
+    const quint32 *route = cols.route.constData();
+    const qint32 *day = cols.day.constData();
+    const quint8 *cls = cols.seatClass.constData();
+    const double *fare = cols.fare.constData();
+    QtConcurrent::blockingMap(parts, [&](Part &part) {
+        RC_TRACE("group rows");
+        if (dense) {
+            part.flat.resize(qsizetype(space));
+            Acc *acc = part.flat.data();
+            for (qint64 i = part.begin; i < part.end; ++i) {
+                Acc &a = acc[train[i] * sTrain + route[i] * sRoute + quint64(day[i] - firstDay) * sDay + cls[i] * sClass];
+                ++a.tickets;
+                a.revenue += fare[i];
+            }
+        } else {
+            for (qint64 i = part.begin; i < part.end; ++i) {
+                Acc &a = part.sparse[train[i] * sTrain + route[i] * sRoute + quint64(day[i] - firstDay) * sDay + cls[i] * sClass];
+                ++a.tickets;
+                a.revenue += fare[i];
+            }
+        }
+    });
+
+    // merge the parts into the first one
+    Part &total = parts.first();
+    for (int p = 1; p < parts.size(); ++p) {
+        if (dense) {
+            for (qsizetype k = 0; k < total.flat.size(); ++k) {
+                total.flat[k].tickets += parts[p].flat[k].tickets;
+                total.flat[k].revenue += parts[p].flat[k].revenue;
+            }
+        } else {
+            for (auto it = parts[p].sparse.constBegin(); it != parts[p].sparse.constEnd(); ++it) {
+                Acc &a = total.sparse[it.key()];
+                a.tickets += it->tickets;
+                a.revenue += it->revenue;
+            }
+        }
+    }
+
+    QVector<Group> res;
+    auto addGroup = [&](quint64 key, const Acc &a) {
+        Group g;
+        g.tickets = a.tickets;
+        g.revenue = a.revenue;
+        if (keys & ByClass) { g.seatClass = int(key % nClass); key /= nClass; }
+        if (keys & ByDay) { g.day = QDate::fromJulianDay(firstDay + qint64(key % nDay)); key /= nDay; }
+        if (keys & ByRoute) { g.route = int(key % nRoute); key /= nRoute; }
+        if (keys & ByTrain) g.train = int(key);
+        res.append(g);
+    };
+    if (dense) {
+        for (qsizetype k = 0; k < total.flat.size(); ++k) {
+            if (total.flat[k].tickets > 0) addGroup(quint64(k), total.flat[k]);
+        }
+    } else {
+        res.reserve(total.sparse.size());
+        for (auto it = total.sparse.constBegin(); it != total.sparse.constEnd(); ++it) addGroup(it.key(), it.value());
+    }
+    std::sort(res.begin(), res.end(), [](const Group &a, const Group &b) { return a.revenue > b.revenue; });
+    return res;
+}
+
+} // namespace Analytics
+
+// -----------------------------
+// FILE: totals.h
+// -----------------------------
+
+#ifndef TOTALS_H
+#define TOTALS_H
+
+#include <QDate>
+#include <QHash>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+struct Train;
+struct Passenger;
+
+// Running totals over the confirmed tickets, updated as each one is added
+// or removed so a dashboard never walks trains or passengers: tickets and
+// fares overall, per route (a train's end points) and per train, today's
+// net sales, and a max-heap of trains by load factor. An update is one hash
+// lookup plus O(log trains) to re-place the train in the heap.
+class LiveTotals {
+public:
+    struct RouteTotal {
+        QString from;
+        QString to;
+        qint64 tickets;
+        double revenue;
+    };
+    struct TrainLoad {
+        QString trainId;
+        qint64 tickets;
+        double load; // tickets per seat over the booking window
+    };
+
+    // recounts everything but today's sales from the current tickets
+    void build(const QVector<Train> &trains, const QVector<Passenger> &confirmed, int windowDays);
+    void appendTrain(const Train &t);
+    void setWindowDays(int days); // seats of every train change: O(trains)
+
+    void add(const Passenger &p);                  // a ticket confirmed now
+    void remove(const Passenger &p, bool refunded); // cancelled, or travelled when !refunded
+
+    qint64 tickets() const { return totalTickets; }
+    double revenue() const { return totalRevenue; } // fares of the tickets held
+    qint64 soldToday() const;    // confirmed today, net of refunds
+    double takingsToday() const; // their fares
+    QVector<RouteTotal> routes() const; // O(routes)
+    double load(const QString &trainId) const;
+    QVector<TrainLoad> fullest(int k) const; // highest load first; O(k log k)
+
+private:
+    struct Slot {
+        QString trainId;
+        int route;
+        qint64 capacity; // seats times booking window days
+        qint64 tickets;
+    };
+    struct Route {
+        QString from;
+        QString to;
+        qint64 tickets;
+        double revenue;
+    };
+
+    void count(const Passenger &p, int sign);
+    void rollDay();
+    double loadOf(int slot) const {
+        return trainSlots[slot].capacity > 0 ? double(trainSlots[slot].tickets) / trainSlots[slot].capacity : 0.0;
+    }
+    bool above(int a, int b) const { return loadOf(heap[a]) > loadOf(heap[b]); } // heap positions
+    void swapAt(int a, int b);
+    void siftUp(int at);
+    void siftDown(int at);
+
+    QHash<QString, int> slotOf; // trainId -> slot
+    QVector<Slot> trainSlots;
+    QVector<int> heap;          // slots, fullest at the top
+    QVector<int> heapPos;       // per slot: position in heap
+    QHash<QPair<QString, QString>, int> routeOf;
+    QVector<Route> routeTotals;
+    int window = 1;
+    qint64 totalTickets = 0;
+    double totalRevenue = 0.0;
+    QDate salesDay;
+    qint64 sales = 0;
+    double takings = 0.0;
+};
+
+#endif // TOTALS_H
+
+// -----------------------------
+// FILE: totals.cpp
+// -----------------------------
+
+#include "totals.h"
+#include "models.h"
+#include <queue>
+
+void LiveTotals::build(const QVector<Train> &trains, const QVector<Passenger> &confirmed, int windowDays) {
+    slotOf.clear();
+    trainSlots.clear();
+    heap.clear();
+    heapPos.clear();
+    routeOf.clear();
+    routeTotals.clear();
+    window = qMax(1, windowDays);
+    totalTickets = 0;
+    totalRevenue = 0.0;
+    for (const Train &t: trains) appendTrain(t);
+    for (const Passenger &p: confirmed) count(p, +1);
+}
+
+void LiveTotals::appendTrain(const Train &t) {
+    if (slotOf.contains(t.trainId)) return;
+    const QPair<QString, QString> ends(t.source, t.destination);
+    auto it = routeOf.constFind(ends);
+    if (it == routeOf.constEnd()) {
+        it = routeOf.insert(ends, routeTotals.size());
+        routeTotals.append(Route{t.source, t.destination, 0, 0.0});
+    }
+    const int slot = trainSlots.size();
+    slotOf.insert(t.trainId, slot);
+    trainSlots.append(Slot{t.trainId, it.value(), qint64(t.totalSeats) * window, 0});
+    heapPos.append(heap.size());
+    heap.append(slot);
+    siftUp(heapPos[slot]); // no tickets yet: stays at the bottom
+}
+
+void LiveTotals::setWindowDays(int days) {
+    days = qMax(1, days);
+    if (days == window) return;
+    for (Slot &s: trainSlots) s.capacity = s.capacity / window * days;
+    window = days;
+    // every load is scaled by the same factor: the heap order holds
+}
+
+void LiveTotals::count(const Passenger &p, int sign) {
+    const int slot = slotOf.value(p.trainId, -1);
+    totalTickets += sign;
+    totalRevenue += sign * p.fare;
+    if (slot < 0) return; // a train since removed
+    Route &r = routeTotals[trainSlots[slot].route];
+    r.tickets += sign;
+    r.revenue += sign * p.fare;
+    trainSlots[slot].tickets += sign;
+    if (sign > 0) siftUp(heapPos[slot]);
+    else siftDown(heapPos[slot]);
+}
+
+void LiveTotals::rollDay() {
+    const QDate today = QDate::currentDate();
+    if (salesDay == today) return;
+    salesDay = today;
+    sales = 0;
+    takings = 0.0;
+}
+
+void LiveTotals::add(const Passenger &p) {
+    count(p, +1);
+    rollDay();
+    ++sales;
+    takings += p.fare;
+}
+
+void LiveTotals::remove(const Passenger &p, bool refunded) {
+    count(p, -1);
+    if (!refunded) return;
+    rollDay();
+    --sales;
+    takings -= p.fare;
+}
+
+qint64 LiveTotals::soldToday() const {
+    return salesDay == QDate::currentDate() ? sales : 0;
+}
+
+double LiveTotals::takingsToday() const {
+    return salesDay == QDate::currentDate() ? takings : 0.0;
+}
+
+QVector<LiveTotals::RouteTotal> LiveTotals::routes() const {
+    QVector<RouteTotal> res;
+    res.reserve(routeTotals.size());
+    for (const Route &r: routeTotals) res.append(RouteTotal{r.from, r.to, r.tickets, r.revenue});
+    return res;
+}
+
+double LiveTotals::load(const QString &trainId) const {
+    const int slot = slotOf.value(trainId, -1);
+    return slot < 0 ? 0.0 : loadOf(slot);
+}
+
+QVector<LiveTotals::TrainLoad> LiveTotals::fullest(int k) const {
+    // best-first walk of the heap: the next fullest is always a child of one taken
+    QVector<TrainLoad> res;
+    auto lower = [this](int a, int b) { return loadOf(heap[a]) < loadOf(heap[b]); };
+    std::priority_queue<int, std::vector<int>, decltype(lower)> frontier(lower);
+    if (!heap.isEmpty()) frontier.push(0);
+    while (!frontier.empty() && res.size() < k) {
+        const int at = frontier.top();
+        frontier.pop();
+        const Slot &s = trainSlots[heap[at]];
+        res.append(TrainLoad{s.trainId, s.tickets, loadOf(heap[at])});
+        for (int c = 2 * at + 1; c <= 2 * at + 2 && c < heap.size(); ++c) frontier.push(c);
+    }
+    return res;
+}
+
+void LiveTotals::swapAt(int a, int b) {
+    std::swap(heap[a], heap[b]);
+    heapPos[heap[a]] = a;
+    heapPos[heap[b]] = b;
+}
+
+void LiveTotals::siftUp(int at) {
+    while (at > 0 && above(at, (at - 1) / 2)) {
+        swapAt(at, (at - 1) / 2);
+        at = (at - 1) / 2;
+    }
+}
+
+void LiveTotals::siftDown(int at) {
+    for (;;) {
+        int top = at;
+        for (int c = 2 * at + 1; c <= 2 * at + 2 && c < heap.size(); ++c) {
+            if (above(c, top)) top = c;
+        }
+        if (top == at) return;
+        swapAt(at, top);
+        at = top;
+    }
+}
+
+// -----------------------------
+// FILE: dashboard.h
+// -----------------------------
+
+#ifndef DASHBOARD_H
+#define DASHBOARD_H
+
+#include <QDate>
+#include <QHash>
+#include <QLabel>
+#include <QPair>
+#include <QSet>
+#include <QTableWidget>
+#include <QTimer>
+#include <QWidget>
+
+class BookingDatabase;
+
+// Occupancy heatmap: one row per route (a train's end points), one column
+// per day of the booking window, each cell the load of the route's runs
+// that day plus their RAC/waitlist depth. runChanged() only marks a cell;
+// marked cells are redrawn together at most once per frame, so a burst of
+// bookings costs one repaint of the cells it touched.
+class OccupancyDashboard : public QWidget {
+public:
+    static constexpr int kFrameMs = 100; // at most 10 redraws a second
+
+    explicit OccupancyDashboard(BookingDatabase &db, QWidget *parent = nullptr);
+
+    // an empty trainId or invalid date marks everything (trains or window changed)
+    void runChanged(const QString &trainId, const QDate &date);
+
+private:
+    void redraw();
+    void rebuild();
+    void updateCell(int row, int day);
+    void updateSummary();
+
+    BookingDatabase &db;
+    QTableWidget *grid;
+    QLabel *summary;
+    QTimer frame;
+    bool stale = true;              // rebuild on the next frame
+    QSet<QPair<int, int>> dirty;    // (row, day) cells to redraw
+    QHash<QString, int> rowOf;      // trainId -> row
+    QVector<QVector<int>> trainsOn; // per row: indexes into db.trains
+    QDate firstDay;
+};
+
+#endif // DASHBOARD_H
+
+// -----------------------------
+// FILE: dashboard.cpp
+// -----------------------------
+
+#include "dashboard.h"
+#include "models.h"
+#include <QHeaderView>
+#include <QVBoxLayout>
+#include "trace.h"
+
+OccupancyDashboard::OccupancyDashboard(BookingDatabase &db, QWidget *parent) : QWidget(parent), db(db) {
+    QVBoxLayout *lay = new QVBoxLayout(this);
+    summary = new QLabel();
+    summary->setWordWrap(true);
+    grid = new QTableWidget();
+    grid->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    grid->horizontalHeader()->setDefaultSectionSize(48);
+    lay->addWidget(summary);
+    lay->addWidget(grid, 1);
+    frame.setSingleShot(true);
+    frame.setInterval(kFrameMs);
+    connect(&frame, &QTimer::timeout, this, [this]() { redraw(); });
+    frame.start();
+}
+
+void OccupancyDashboard::runChanged(const QString &trainId, const QDate &date) {
+    if (trainId.isEmpty() || !date.isValid()) {
+        stale = true;
+    } else if (!stale) {
+        const int row = rowOf.value(trainId, -1);
+        const int day = int(firstDay.daysTo(date));
+        if (row < 0) stale = true; // a train we have not seen yet
+        else if (day >= 0 && day < grid->columnCount()) dirty.insert(qMakePair(row, day));
+    }
+    // the first change of a frame starts the timer; the rest ride along
+    if (!frame.isActive()) frame.start();
+}
+
+void OccupancyDashboard::redraw() {
+    RC_TRACE("OccupancyDashboard::redraw");
+    // days roll over without any booking to report it
+    const QDate first = db.runs.firstDay().isValid() ? db.runs.firstDay() : QDate::currentDate();
+    if (stale || first != firstDay || grid->columnCount() != db.bookingWindow()) {
+        rebuild();
+    } else {
+        for (const QPair<int, int> &cell: std::as_const(dirty)) updateCell(cell.first, cell.second);
+    }
+    dirty.clear();
+    updateSummary();
+}
+
+void OccupancyDashboard::rebuild() {
+    stale = false;
+    firstDay = db.runs.firstDay().isValid() ? db.runs.firstDay() : QDate::currentDate();
+    rowOf.clear();
+    trainsOn.clear();
+    QHash<QPair<QString, QString>, int> routes;
+    QStringList names;
+    for (int i = 0; i < db.trains.size(); ++i) {
+        const Train &t = db.trains[i];
+        const QPair<QString, QString> ends(t.source, t.destination);
+        auto it = routes.constFind(ends);
+        if (it == routes.constEnd()) {
+            it = routes.insert(ends, trainsOn.size());
+            trainsOn.append(QVector<int>());
+            names << t.source + " - " + t.destination;
+        }
+        trainsOn[it.value()].append(i);
+        rowOf.insert(t.trainId, it.value());
+    }
+    const int days = db.bookingWindow();
+    grid->clear();
+    grid->setRowCount(trainsOn.size());
+    grid->setColumnCount(days);
+    grid->setVerticalHeaderLabels(names);
+    QStringList dates;
+    for (int d = 0; d < days; ++d) dates << firstDay.addDays(d).toString("dd MMM");
+    grid->setHorizontalHeaderLabels(dates);
+    for (int row = 0; row < trainsOn.size(); ++row) {
+        for (int d = 0; d < days; ++d) updateCell(row, d);
+    }
+}
+
+void OccupancyDashboard::updateCell(int row, int day) {
+    const QDate date = firstDay.addDays(day);
+    int booked = 0, seats = 0, rac = 0, waiting = 0;
+    for (int ti: trainsOn[row]) {
+        const Train &t = db.trains[ti];
+        if (const TrainRun *run = db.runs.find(t.trainId, date)) {
+            booked += run->seats.peak();
+            seats += run->seats.seats();
+        } else {
+            seats += t.totalSeats; // no bookings yet
+        }
+        for (int c = 0; c < kClassCount; ++c) {
+            rac += db.waitlist.depth(t.trainId, date, c, BookingStatus::RAC);
+            waiting += db.waitlist.depth(t.trainId, date, c, BookingStatus::Waitlisted);
+        }
+    }
+    const double load = seats > 0 ? double(booked) / seats : 0.0;
+    QTableWidgetItem *item = grid->item(row, day);
+    if (!item) {
+        item = new QTableWidgetItem();
+        item->setTextAlignment(Qt::AlignCenter);
+        grid->setItem(row, day, item);
+    }
+    QString text = QString::number(qRound(load * 100)) + '%';
+    if (rac + waiting > 0) text += QString("\n+%1").arg(rac + waiting);
+    item->setText(text);
+    // green when empty through yellow to red when full
+    item->setBackground(QColor::fromHsvF((1.0 - qMin(load, 1.0)) / 3.0, 0.15 + 0.6 * qMin(load, 1.0), 1.0));
+    item->setToolTip(QString("%1 on %2\n%3 of %4 seats taken\nRAC %5, WL %6")
+                         .arg(grid->verticalHeaderItem(row) ? grid->verticalHeaderItem(row)->text() : QString())
+                         .arg(date.toString(Qt::ISODate)).arg(booked).arg(seats).arg(rac).arg(waiting));
+}
+
+void OccupancyDashboard::updateSummary() {
+    QStringList fullest;
+    for (const LiveTotals::TrainLoad &t: db.totals.fullest(5))
+        fullest << QString("%1 %2%").arg(t.trainId).arg(qRound(t.load * 100));
+    summary->setText(QString("Tickets %1 (revenue %2)  Today: %3 sold, %4 taken\nFullest: %5")
+                         .arg(db.totals.tickets()).arg(db.totals.revenue(), 0, 'f', 2)
+                         .arg(db.totals.soldToday()).arg(db.totals.takingsToday(), 0, 'f', 2)
+                         .arg(fullest.isEmpty() ? QString("-") : fullest.join(", ")));
+}
+
+// -----------------------------
+// FILE: browser.h
+// -----------------------------
+
+#ifndef BROWSER_H
+#define BROWSER_H
+
+#include <QAbstractTableModel>
+#include <QComboBox>
+#include <QHash>
+#include <QLineEdit>
+#include <QTableView>
+#include <QTimer>
+#include <QWidget>
+
+class BookingDatabase;
+struct Passenger;
+
+// Tickets straight out of BookingDatabase, a page at a time. Rows are
+// resolved on demand through the database's own indexes: a PNR through
+// pnrIndex, one train's tickets through the manifest index, everything
+// else by position in passengers or the waitlist, so the model keeps no
+// copy of any ticket and, unless sorted, no per-row state at all. Sorting
+// orders one train's tickets (it needs their row numbers); without a
+// train filter rows stay in storage order.
+class TicketModel : public QAbstractTableModel {
+public:
+    enum Source { Confirmed, Waiting };
+    enum Column { Pnr, Name, Age, Gender, TrainId, Date, From, To, Class, Quota, Status, Place, Fare, kColumnCount };
+    static constexpr int kPage = 200; // rows added per fetchMore
+
+    explicit TicketModel(BookingDatabase &db, QObject *parent = nullptr);
+
+    void setQuery(Source source, const QString &trainId, const QString &pnr); // empty = any
+    void refresh(); // after the database changed: rows may have moved
+    bool sortable() const { return pnr.isEmpty() && !trainId.isEmpty(); } // sort() orders rows
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
+    void sort(int column, Qt::SortOrder order = Qt::AscendingOrder) override;
+
+private:
+    int total() const; // rows matching the query
+    const Passenger *ticket(int row) const;
+    QVariant cell(const Passenger &p, int column) const;
+    void reorder();
+
+    BookingDatabase &db;
+    Source source = Confirmed;
+    QString trainId;
+    QString pnr;
+    int fetched = 0;              // rows the view has asked for
+    int sortColumn = -1;
+    Qt::SortOrder sortOrder = Qt::AscendingOrder;
+    QVector<int> order;           // one train's rows (sorted, or its waiting tickets)
+    bool useOrder = false;
+    QHash<QString, int> trainIndex; // trainId -> index into db.trains
+};
+
+// Filters plus a lazily filled table over TicketModel.
+class TicketBrowser : public QWidget {
+public:
+    explicit TicketBrowser(BookingDatabase &db, QWidget *parent = nullptr);
+    void changed(); // coalesced: the model refreshes at most every 250 ms
+
+private:
+    void apply();
+
+    TicketModel *model;
+    QTableView *view;
+    QComboBox *sourceBox;
+    QLineEdit *trainEdit;
+    QLineEdit *pnrEdit;
+    QTimer refreshTimer;
+};
+
+#endif // BROWSER_H
+
+// -----------------------------
+// FILE: browser.cpp
+// -----------------------------
+
+#include "browser.h"
+#include "models.h"
+#include <QHBoxLayout>
+#include <QHeaderView>
+#include <QPair>
+#include <QVBoxLayout>
+#include <algorithm>
+#include "trace.h"
+
+TicketModel::TicketModel(BookingDatabase &db, QObject *parent) : QAbstractTableModel(parent), db(db) {
+    setQuery(Confirmed, QString(), QString());
+}
+
+void TicketModel::setQuery(Source s, const QString &train, const QString &ticket) {
+    beginResetModel();
+    source = s;
+    trainId = train;
+    pnr = ticket;
+    fetched = 0;
+    trainIndex.clear();
+    for (int i = 0; i < db.trains.size(); ++i) trainIndex.insert(db.trains[i].trainId, i);
+    reorder();
+    fetched = qMin(kPage, total());
+    endResetModel();
+}
+
+void TicketModel::reorder() {
+    // waiting tickets have no per-train index: collect that train's once
+    useOrder = pnr.isEmpty() && !trainId.isEmpty() && (source == Waiting || sortColumn >= 0);
+    order.clear();
+    if (!useOrder) return;
+    if (source == Confirmed) {
+        order = db.manifests.rows(trainId);
+    } else {
+        const QVector<Passenger> &all = db.waitlist.entries();
+        for (int i = 0; i < all.size(); ++i) {
+            if (all[i].trainId == trainId) order.append(i);
+        }
+    }
+    if (sortColumn < 0) return;
+    // cell() looks up stations, seat labels and waitlist places: take each
+    // row's key once, sort the (key, row) pairs, then keep only the rows
+    const QVector<Passenger> &rows = source == Confirmed ? db.passengers : db.waitlist.entries();
+    QVector<QPair<QVariant, int>> keyed;
+    keyed.reserve(order.size());
+    for (int r: order) keyed.append(qMakePair(cell(rows[r], sortColumn), r));
+    const QPartialOrdering before = sortOrder == Qt::AscendingOrder ? QPartialOrdering::Less : QPartialOrdering::Greater;
+    std::stable_sort(keyed.begin(), keyed.end(), [&](const QPair<QVariant, int> &a, const QPair<QVariant, int> &b) {
+        return QVariant::compare(a.first, b.first) == before;
+    });
+    for (int i = 0; i < keyed.size(); ++i) order[i] = keyed[i].second;
+}
+
+void TicketModel::refresh() {
+    RC_TRACE("TicketModel::refresh");
+    trainIndex.clear();
+    for (int i = 0; i < db.trains.size(); ++i) trainIndex.insert(db.trains[i].trainId, i);
+    reorder();
+    // keep what the view has scrolled through; rows past the new end go
+    const int now = qMin(fetched, total());
+    if (now < fetched) {
+        beginRemoveRows(QModelIndex(), now, fetched - 1);
+        fetched = now;
+        endRemoveRows();
+    }
+    if (fetched < kPage && total() > fetched) {
+        const int more = qMin(kPage, total());
+        beginInsertRows(QModelIndex(), fetched, more - 1);
+        fetched = more;
+        endInsertRows();
+    }
+    if (fetched > 0) emit dataChanged(index(0, 0), index(fetched - 1, kColumnCount - 1));
+}
+
+int TicketModel::total() const {
+    if (!pnr.isEmpty()) {
+        const bool found = source == Confirmed ? db.findPassenger(pnr) != nullptr : db.waitlist.find(pnr) != nullptr;
+        return found ? 1 : 0;
+    }
+    if (useOrder) return order.size();
+    if (source == Waiting) return db.waitlist.size();
+    if (!trainId.isEmpty()) return db.manifests.rows(trainId).size();
+    return db.passengers.size();
+}
+
+const Passenger *TicketModel::ticket(int row) const {
+    if (row < 0 || row >= total()) return nullptr;
+    if (!pnr.isEmpty()) return source == Confirmed ? db.findPassenger(pnr) : db.waitlist.find(pnr);
+    const QVector<Passenger> &rows = source == Confirmed ? db.passengers : db.waitlist.entries();
+    if (useOrder) {
+        // order is rebuilt on refresh(); until then a removal may have
+        // shrunk rows or moved another train's ticket into a remembered slot
+        const int r = order[row];
+        return r < rows.size() && rows[r].trainId == trainId ? &rows[r] : nullptr;
+    }
+    if (source == Confirmed && !trainId.isEmpty()) return &rows[db.manifests.rows(trainId)[row]];
+    return &rows[row];
+}
+
+int TicketModel::rowCount(const QModelIndex &parent) const {
+    return parent.isValid() ? 0 : fetched;
+}
+
+int TicketModel::columnCount(const QModelIndex &parent) const {
+    return parent.isValid() ? 0 : kColumnCount;
+}
+
+bool TicketModel::canFetchMore(const QModelIndex &parent) const {
+    return !parent.isValid() && fetched < total();
+}
 
-    QJsonObject toJson() const;
-    static Train fromJson(const QJsonObject &obj);
-};
+void TicketModel::fetchMore(const QModelIndex &parent) {
+    if (parent.isValid()) return;
+    const int more = qMin(total(), fetched + kPage);
+    if (more <= fetched) return;
+    beginInsertRows(QModelIndex(), fetched, more - 1);
+    fetched = more;
+    endInsertRows();
+}
 
-// Passenger
-struct Passenger {
-    QString name;
-    int age;
-    QString gender;
-    QString pnr;
-    QString trainId;
-    int seatNo;
-    double fare;
+void TicketModel::sort(int column, Qt::SortOrder order) {
+    beginResetModel();
+    sortColumn = column;
+    sortOrder = order;
+    reorder();
+    fetched = qMin(qMax(fetched, kPage), total());
+    endResetModel();
+}
 
-    QJsonObject toJson() const;
-    static Passenger fromJson(const QJsonObject &obj);
-};
+QVariant TicketModel::cell(const Passenger &p, int column) const {
+    const int ti = trainIndex.value(p.trainId, -1);
+    auto station = [&](int stop) {
+        if (ti < 0) return QString::number(stop);
+        const int n = db.timetable.stopCount(ti);
+        if (stop < 0 || stop >= n) stop = n - 1;
+        return db.timetable.stationName(db.timetable.stops(ti)[stop].station);
+    };
+    switch (column) {
+    case Pnr: return p.pnr;
+    case Name: return p.name;
+    case Age: return p.age;
+    case Gender: return p.gender;
+    case TrainId: return p.trainId;
+    case Date: return p.journeyDate;
+    case From: return station(p.fromStop);
+    case To: return station(p.toStop);
+    case Class: return classCode(p.seatClass);
+    case Quota: return quotaCode(p.quota);
+    case Status: return statusCode(p.status);
+    case Place:
+        if (p.status != BookingStatus::Confirmed) return db.waitlistPosition(p.pnr);
+        return ti >= 0 ? db.trains[ti].seatLabel(p.seatNo) : QString::number(p.seatNo);
+    case Fare: return p.status == BookingStatus::Confirmed ? QVariant(p.fare) : QVariant();
+    }
+    return QVariant();
+}
 
-// BookingDatabase holds trains and bookings using data structures
-class BookingDatabase {
-public:
-    BookingDatabase();
+QVariant TicketModel::data(const QModelIndex &index, int role) const {
+    if (!index.isValid() || (role != Qt::DisplayRole && role != Qt::TextAlignmentRole)) return QVariant();
+    const Passenger *p = ticket(index.row());
+    if (!p) return QVariant();
+    if (role == Qt::TextAlignmentRole) {
+        const bool number = index.column() == Age || index.column() == Fare;
+        return number ? QVariant(int(Qt::AlignRight | Qt::AlignVCenter)) : QVariant();
+    }
+    if (index.column() == Fare && p->status == BookingStatus::Confirmed) return QString::number(p->fare, 'f', 2);
+    if (index.column() == Place && p->status != BookingStatus::Confirmed)
+        return QString("%1 %2").arg(statusCode(p->status)).arg(db.waitlistPosition(p->pnr));
+    return cell(*p, index.column());
+}
 
-    // train operations
-    void addTrain(const Train &t);
-    QVector<Train> searchTrains(const QString &src, const QString &dst) const;
-    Train* findTrain(const QString &trainId);
+QVariant TicketModel::headerData(int section, Qt::Orientation orientation, int role) const {
+    if (role != Qt::DisplayRole || orientation != Qt::Horizontal) return QAbstractTableModel::headerData(section, orientation, role);
+    static const char *const names[kColumnCount] = {
+        "PNR", "Name", "Age", "Gender", "Train", "Date", "From", "To", "Class", "Quota", "Status", "Seat / No.", "Fare",
+    };
+    return section >= 0 && section < kColumnCount ? QString(names[section]) : QVariant();
+}
 
-    // booking operations
-    bool bookTicket(const QString &trainId, const Passenger &p);
-    bool cancelTicket(const QString &pnr);
-    Passenger* findPassenger(const QString &pnr);
+TicketBrowser::TicketBrowser(BookingDatabase &db, QWidget *parent) : QWidget(parent) {
+    QVBoxLayout *lay = new QVBoxLayout(this);
+    QHBoxLayout *filters = new QHBoxLayout();
+    sourceBox = new QComboBox();
+    sourceBox->addItem("Confirmed", TicketModel::Confirmed);
+    sourceBox->addItem("RAC / Waitlist", TicketModel::Waiting);
+    trainEdit = new QLineEdit(); trainEdit->setPlaceholderText("Train ID (sorting needs one)");
+    pnrEdit = new QLineEdit(); pnrEdit->setPlaceholderText("PNR");
+    filters->addWidget(sourceBox);
+    filters->addWidget(trainEdit);
+    filters->addWidget(pnrEdit);
+    lay->addLayout(filters);
 
-    // persistence
-    bool loadFromFiles();
-    bool saveToFiles() const;
+    model = new TicketModel(db, this);
+    view = new QTableView();
+    view->setModel(model);
+    view->horizontalHeader()->setSortIndicator(-1, Qt::AscendingOrder); // storage order until asked
+    // header sorting is enabled by apply() once a train is picked
+    view->verticalHeader()->setDefaultSectionSize(view->fontMetrics().height() + 6); // uniform rows: no per-row sizing
+    view->setSelectionBehavior(QAbstractItemView::SelectRows);
+    lay->addWidget(view, 1);
 
-    QVector<Train> trains;
-    QVector<Passenger> passengers; // simple vector for booked passengers
-    QQueue<Passenger> waitingList; // queue for waiting passengers
+    connect(sourceBox, qOverload<int>(&QComboBox::currentIndexChanged), this, [this]() { apply(); });
+    connect(trainEdit, &QLineEdit::editingFinished, this, [this]() { apply(); });
+    connect(pnrEdit, &QLineEdit::editingFinished, this, [this]() { apply(); });
+    refreshTimer.setSingleShot(true);
+    refreshTimer.setInterval(250);
+    connect(&refreshTimer, &QTimer::timeout, model, [this]() { model->refresh(); });
+}
 
-private:
-    QString trainsFile = "trains.json";
-    QString bookingsFile = "bookings.json";
-};
+void TicketBrowser::apply() {
+    model->setQuery(TicketModel::Source(sourceBox->currentData().toInt()), trainEdit->text().trimmed(),
+                    pnrEdit->text().trimmed());
+    // without a train the rows stay in storage order, so the header must
+    // not show an order; enabling sorting re-applies the current indicator
+    const bool sortable = model->sortable();
+    if (sortable == view->isSortingEnabled()) return;
+    view->setSortingEnabled(sortable);
+    if (!sortable) view->horizontalHeader()->setSortIndicator(-1, Qt::AscendingOrder);
+}
 
-#endif // MODELS_H
+void TicketBrowser::changed() {
+    if (!refreshTimer.isActive()) refreshTimer.start();
+}
 
 // -----------------------------
-// FILE: models.cpp
+// FILE: bench.cpp
 // -----------------------------
 
+// RailConnectBench (-DRAILCONNECT_BENCH=ON): times hot paths on synthetic
+// data with a fixed seed and prints the mean per repetition. Arguments pick
+// cases by name prefix, e.g. "planner/"; none runs every case.
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSet>
+#include <QStringList>
+#include <QTextStream>
+#include <algorithm>
+#include <cmath>
+#include <random>
 #include "models.h"
-#include <QJsonDocument>
-#include <QDateTime>
-#include <QUuid>
+#include "timetable.h"
+#include "planner.h"
+#include "fares.h"
+#include "inventory.h"
+#include "allocator.h"
+#include "importer.h"
 
-QJsonObject Train::toJson() const {
-    QJsonObject obj;
-    obj["trainId"] = trainId;
-    obj["name"] = name;
-    obj["source"] = source;
-    obj["destination"] = destination;
-    obj["totalSeats"] = totalSeats;
-    obj["bookedSeats"] = bookedSeats;
-    obj["baseFare"] = baseFare;
-    return obj;
-}
+static QTextStream out(stdout);
+static QStringList selected;
 
-Train Train::fromJson(const QJsonObject &obj) {
-    Train t;
-    t.trainId = obj["trainId"].toString();
-    t.name = obj["name"].toString();
-    t.source = obj["source"].toString();
-    t.destination = obj["destination"].toString();
-    t.totalSeats = obj["totalSeats"].toInt();
-    t.bookedSeats = obj["bookedSeats"].toInt();
-    t.baseFare = obj["baseFare"].toDouble();
-    return t;
+// a selected case, or a group prefix such as "planner/" holding one
+static bool wanted(const QString &name) {
+    return selected.isEmpty() || std::any_of(selected.cbegin(), selected.cend(), [&](const QString &s) {
+        return name.startsWith(s) || s.startsWith(name);
+    });
 }
 
-QJsonObject Passenger::toJson() const {
-    QJsonObject obj;
-    obj["name"] = name;
-    obj["age"] = age;
-    obj["gender"] = gender;
-    obj["pnr"] = pnr;
-    obj["trainId"] = trainId;
-    obj["seatNo"] = seatNo;
-    obj["fare"] = fare;
-    return obj;
+// f(i) for i in [0, reps) if the case is selected; with items, each
+// repetition handles that many and the rate is printed too
+template <typename F>
+static void measure(const QString &name, int reps, F &&f, int items = 0) {
+    if (!wanted(name)) return;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < reps; ++i) f(i);
+    const double us = timer.nsecsElapsed() / 1000.0 / reps;
+    out << name.leftJustified(48) << QString::number(reps).rightJustified(7) << " x"
+        << QString::number(us, 'f', 2).rightJustified(12) << " us";
+    if (items > 0 && us > 0) out << QString::number(items / us, 'f', 2).rightJustified(10) << " M/s";
+    out << Qt::endl;
 }
 
-Passenger Passenger::fromJson(const QJsonObject &obj) {
-    Passenger p;
-    p.name = obj["name"].toString();
-    p.age = obj["age"].toInt();
-    p.gender = obj["gender"].toString();
-    p.pnr = obj["pnr"].toString();
-    p.trainId = obj["trainId"].toString();
-    p.seatNo = obj["seatNo"].toInt();
-    p.fare = obj["fare"].toDouble();
-    return p;
+// trains of stopCount timed calls at distinct stations of an S0..S<n-1> network
+static QVector<Train> syntheticTrains(int count, int stations, int stopCount, quint32 seed) {
+    std::mt19937 rng(seed);
+    QVector<Train> res;
+    res.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        Train t{QString("B%1-%2").arg(seed).arg(i), QString("Bench %1").arg(i), QString(), QString(), 0, 0, 150.0};
+        QSet<int> visited;
+        int clock = int(rng() % 1440);
+        int km = 0;
+        while (t.stops.size() < stopCount) {
+            const int s = int(rng() % stations);
+            if (visited.contains(s)) continue;
+            visited.insert(s);
+            const int arrival = t.stops.isEmpty() ? -1 : clock;
+            clock += 2 + int(rng() % 5); // dwell
+            t.stops.append({QString("S%1").arg(s), arrival, clock, km});
+            clock += 20 + int(rng() % 40);
+            km += 15 + int(rng() % 60);
+        }
+        t.stops.last().departure = -1;
+        t.source = t.stops.first().station;
+        t.destination = t.stops.last().station;
+        t.coaches = {CoachGroup::standard(SeatClass::Sleeper, 12), CoachGroup::standard(SeatClass::ThirdAC, 4)};
+        t.totalSeats = 0;
+        for (int n: t.classSeats()) t.totalSeats += n;
+        res.append(t);
+    }
+    return res;
 }
 
-BookingDatabase::BookingDatabase() {
-    // attempt load on construction
-    loadFromFiles();
+static void plannerCases() {
+    if (!wanted("planner/")) return;
+    const QVector<Train> trains = syntheticTrains(2000, 400, 10, 1);
+    const QVector<Train> added = syntheticTrains(100, 400, 10, 2);
+    Timetable tt;
+    tt.rebuild(trains);
+    JourneyPlanner planner;
+    measure("planner/build, 2000 trains", 20, [&](int) { planner.build(tt); });
+
+    // one addTrain: the connection array rebuilt and re-sorted, or the new hops merged in
+    Timetable grown = tt;
+    measure("planner/add a train, rebuild", added.size(), [&](int i) {
+        grown.appendTrain(added[i]);
+        planner.build(grown);
+    });
+    grown = tt;
+    planner.build(grown);
+    measure("planner/add a train, merge", added.size(), [&](int i) {
+        grown.appendTrain(added[i]);
+        planner.appendTrain(grown);
+    });
+
+    planner.build(tt);
+    std::mt19937 rng(3);
+    measure("planner/plan, up to 2 transfers", 2000, [&](int) {
+        planner.plan(int(rng() % tt.stationCount()), int(rng() % tt.stationCount()), int(rng() % 1440), 2);
+    });
 }
 
-void BookingDatabase::addTrain(const Train &t) {
-    trains.append(t);
+static void fareCases() {
+    if (!wanted("fares/")) return;
+    const QVector<Train> trains = syntheticTrains(500, 400, 10, 4);
+    FareEngine fares;
+    fares.build(trains);
+    std::mt19937 rng(5);
+    QVector<FareQuery> queries(4096);
+    for (FareQuery &q: queries) {
+        q.train = int(rng() % trains.size());
+        q.fromStop = int(rng() % 9);
+        q.toStop = q.fromStop + 1 + int(rng() % (9 - q.fromStop));
+        q.load = int(rng() % trains[q.train].totalSeats);
+        q.surge = 1.0 + (rng() % 30) / 100.0;
+        q.seatClass = rng() % 4 ? SeatClass::Sleeper : SeatClass::ThirdAC;
+        q.age = 5 + int(rng() % 80);
+    }
+    QVector<double> fare(queries.size());
+    measure("fares/4096 quotes, tables only", 500, [&](int) {
+        fares.quote(queries.constData(), queries.size(), fare.data());
+    }, queries.size());
+
+    QString error;
+    if (!fares.setScript("surge = load >= 80 ? 1.15 : 1\n"
+                         "fare = class == AC3 && age >= 60 ? fare * 0.9 : fare\n"
+                         "fare = max(round(fare * surge), 50)", &error)) {
+        out << "fares/script does not compile: " << error << Qt::endl;
+        return;
+    }
+    measure("fares/4096 quotes, tables and script", 500, [&](int) {
+        fares.quote(queries.constData(), queries.size(), fare.data());
+    }, queries.size());
+
+    // the same script hand-written in C++: what the interpreter costs on top
+    fares.quote(queries.constData(), queries.size(), fare.data());
+    const QVector<double> scripted = fare;
+    fares.setScript(QString());
+    auto native = [&](int) {
+        fares.quote(queries.constData(), queries.size(), fare.data());
+        for (int i = 0; i < queries.size(); ++i) {
+            const FareQuery &q = queries[i];
+            const int seats = trains[q.train].totalSeats;
+            const int load = seats > 0 ? qBound(0, q.load * 100 / seats, 100) : 0;
+            const double surge = load >= 80 ? 1.15 : 1;
+            double f = fare[i];
+            if (q.seatClass == SeatClass::ThirdAC && q.age >= 60) f *= 0.9;
+            fare[i] = qMax(std::round(f * surge), 50.0);
+        }
+    };
+    measure("fares/4096 quotes, tables and C++", 500, native, queries.size());
+    native(0);
+    if (fare != scripted) out << "fares/C++ and script quotes differ" << Qt::endl;
 }
 
-QVector<Train> BookingDatabase::searchTrains(const QString &src, const QString &dst) const {
-    QVector<Train> res;
-    for (const Train &t: trains) {
-        if (t.source.compare(src, Qt::CaseInsensitive) == 0 &&
-            t.destination.compare(dst, Qt::CaseInsensitive) == 0) {
-            res.append(t);
+static void seatCases() {
+    if (!wanted("seats/")) return;
+    const QVector<Train> trains = syntheticTrains(1, 20, 10, 6);
+    const Train &t = trains.first();
+    const int stops = t.stops.size();
+    SeatAllocator seating;
+    seating.build(trains);
+    // one whole-route request per seat, classes and preferences mixed
+    std::mt19937 rng(7);
+    QVector<SeatRequest> requests;
+    const QVector<int> classSeats = t.classSeats();
+    for (int c = 0; c < classSeats.size(); ++c) {
+        for (int i = 0; i < classSeats[c]; ++i) {
+            SeatRequest r{0, stops - 1, SeatClass(c)};
+            if (rng() % 3 == 0) r.berthPref = int(Berth::Lower) + int(rng() % 3);
+            r.senior = rng() % 6 == 0;
+            requests.append(r);
         }
     }
-    return res;
+    std::shuffle(requests.begin(), requests.end(), rng);
+
+    SeatInventory seats;
+    const QString count = QString::number(requests.size());
+    measure("seats/fill " + count + " seats, first free seat", 200, [&](int) {
+        seats.reset(classSeats, stops);
+        for (const SeatRequest &r: std::as_const(requests)) seats.allocate(r.fromStop, r.toStop, int(r.seatClass));
+    });
+    measure("seats/fill " + count + " seats, coach allocator", 200, [&](int) {
+        seats.reset(classSeats, stops);
+        int seat;
+        for (const SeatRequest &r: std::as_const(requests)) seating.allocate(0, seats, &r, 1, &seat);
+    });
 }
 
-Train* BookingDatabase::findTrain(const QString &trainId) {
-    for (int i = 0; i < trains.size(); ++i) {
-        if (trains[i].trainId == trainId) return &trains[i];
-    }
-    return nullptr;
+static QString hhmm(int minutes) {
+    return QString("%1:%2").arg(minutes / 60, 2, 10, QChar('0')).arg(minutes % 60, 2, 10, QChar('0'));
 }
 
-bool BookingDatabase::bookTicket(const QString &trainId, const Passenger &p) {
-    Train *t = findTrain(trainId);
-    if (!t) return false;
-    if (t->bookedSeats < t->totalSeats) {
-        // seat available
-        Passenger np = p;
-        int seat = ++(t->bookedSeats);
-        np.seatNo = seat;
-        // dynamic fare: simple: baseFare + 1% per booked seat
-        np.fare = t->baseFare * (1.0 + 0.01 * t->bookedSeats);
-        // generate PNR
-        np.pnr = QUuid::createUuid().toString(QUuid::WithoutBraces).left(8).toUpper();
-        passengers.append(np);
-        saveToFiles();
-        return true;
+static void importCases() {
+    if (!wanted("import/")) return;
+    // 20000 trains of 10 stops as one CSV of 200000 rows in the temp directory
+    const QVector<Train> trains = syntheticTrains(20000, 2000, 10, 8);
+    const QString path = QDir(QDir::tempPath()).filePath("railconnect-bench.csv");
+    QFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        out << "import/cannot write " << path << Qt::endl;
+        return;
+    }
+    QByteArray csv = "train_id,name,station,arrival,departure,km\n";
+    for (const Train &t: trains) {
+        for (const Stop &s: t.stops) {
+            csv += (QStringList{t.trainId, t.name, s.station,
+                                s.arrival < 0 ? QString() : hhmm(s.arrival),
+                                s.departure < 0 ? QString() : hhmm(s.departure),
+                                QString::number(s.km)}.join(',') + '\n').toUtf8();
+        }
+    }
+    const bool written = f.write(csv) == csv.size();
+    f.close();
+    if (written) {
+        measure("import/csv, 20000 trains", 5, [&](int) { TimetableImport::readCsv(path); });
     } else {
-        // put to waiting list
-        waitingList.enqueue(p);
-        saveToFiles();
-        return true;
+        out << "import/cannot write " << path << Qt::endl;
     }
+    QFile::remove(path);
 }
 
-bool BookingDatabase::cancelTicket(const QString &pnr) {
-    for (int i = 0; i < passengers.size(); ++i) {
-        if (passengers[i].pnr == pnr) {
-            QString trainId = passengers[i].trainId;
-            // free seat
-            Train *t = findTrain(trainId);
-            if (t) t->bookedSeats = qMax(0, t->bookedSeats - 1);
-            passengers.removeAt(i);
-            // allocate seat to first waiting passenger if any
-            if (!waitingList.isEmpty()) {
-                Passenger w = waitingList.dequeue();
-                // book for same train if matches trainId, otherwise find another
-                if (w.trainId.isEmpty()) w.trainId = trainId;
-                bookTicket(w.trainId, w);
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    selected = app.arguments().mid(1);
+    plannerCases();
+    fareCases();
+    seatCases();
+    importCases();
+    return 0;
+}
+
+// -----------------------------
+// FILE: jsonexport.h
+// -----------------------------
+
+#ifndef JSONEXPORT_H
+#define JSONEXPORT_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+#include <QVector>
+#include <QFuture>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include "trace.h"
+
+// Streaming JSON export: records are serialized in chunks on the global
+// thread pool and written to the device in order, so no QJsonArray /
+// QJsonDocument is ever built for the whole collection.
+namespace JsonExport {
+
+void appendString(QByteArray &out, const QString &s);
+void appendNumber(QByteArray &out, int v);
+void appendNumber(QByteArray &out, qint64 v);
+void appendNumber(QByteArray &out, double v);
+
+// records per chunk; a chunk is the unit of parallel work and of writing
+constexpr int kChunkSize = 4096;
+// rough serialized size of one record, used to preallocate chunk buffers
+constexpr int kRecordSizeHint = 160;
+
+// Writes items as a JSON array to dev. T must provide appendJson(QByteArray&).
+// At most 2 * maxThreadCount chunks are in flight, each in its own reused
+// buffer, so peak memory does not grow with the number of records.
+template <typename T>
+bool writeArray(QIODevice &dev, const QVector<T> &items, int chunkSize = kChunkSize)
+{
+    const int n = items.size();
+    if (dev.write("[") < 0) return false;
+    if (n == 0) return dev.write("]") >= 0;
+
+    const int chunks = (n + chunkSize - 1) / chunkSize;
+    const int lanes = qMin(chunks, qMax(2, QThreadPool::globalInstance()->maxThreadCount() * 2));
+    QVector<QByteArray> buffers(lanes);
+    QVector<QFuture<void>> pending(lanes);
+    for (QByteArray &b: buffers) b.reserve(chunkSize * kRecordSizeHint);
+
+    auto launch = [&](int c) {
+        QByteArray *buf = &buffers[c % lanes];
+        pending[c % lanes] = QtConcurrent::run([&items, buf, c, chunkSize, n]() {
+            RC_TRACE("serialize chunk");
+            buf->resize(0); // keeps capacity
+            const int end = qMin(n, (c + 1) * chunkSize);
+            for (int i = c * chunkSize; i < end; ++i) {
+                if (i != c * chunkSize) buf->append(',');
+                items.at(i).appendJson(*buf);
             }
-            saveToFiles();
-            return true;
+        });
+    };
+
+    for (int c = 0; c < lanes; ++c) launch(c);
+    bool ok = true;
+    for (int c = 0; c < chunks; ++c) {
+        {
+            RC_TRACE("wait for chunk");
+            pending[c % lanes].waitForFinished();
         }
+        if (ok && c > 0) ok = dev.write(",") >= 0;
+        if (ok) ok = dev.write(buffers[c % lanes]) >= 0;
+        if (ok && c + lanes < chunks) launch(c + lanes);
     }
-    return false;
+    // after a failed write, workers may still be filling buffers owned by this frame
+    for (QFuture<void> &f: pending) f.waitForFinished();
+    return ok && dev.write("]") >= 0;
 }
 
-Passenger* BookingDatabase::findPassenger(const QString &pnr) {
-    for (int i = 0; i < passengers.size(); ++i) {
-        if (passengers[i].pnr == pnr) return &passengers[i];
-    }
-    return nullptr;
-}
+} // namespace JsonExport
 
-bool BookingDatabase::loadFromFiles() {
-    // trains
-    QFile f(trainsFile);
-    if (f.open(QIODevice::ReadOnly)) {
-        QByteArray data = f.readAll();
-        QJsonDocument d = QJsonDocument::fromJson(data);
-        if (d.isArray()) {
-            QJsonArray arr = d.array();
-            trains.clear();
-            for (const QJsonValue &v: arr) {
-                trains.append(Train::fromJson(v.toObject()));
+#endif // JSONEXPORT_H
+
+// -----------------------------
+// FILE: jsonexport.cpp
+// -----------------------------
+
+#include "jsonexport.h"
+#include <QLocale>
+#include <cmath>
+
+namespace JsonExport {
+
+void appendString(QByteArray &out, const QString &s) {
+    static const char hex[] = "0123456789abcdef";
+    const QByteArray utf8 = s.toUtf8();
+    out += '"';
+    for (char ch: utf8) {
+        const unsigned char c = static_cast<unsigned char>(ch);
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+            } else {
+                out += ch;
             }
         }
-        f.close();
-    } else {
-        // create sample trains if file missing
-        trains.clear();
-        Train t1{"123A","Express One","Mumbai","Pune",100,0,200.0};
-        Train t2{"456B","Coastal Mail","Chennai","Bangalore",80,0,350.0};
-        Train t3{"789C","InterCity","Delhi","Agra",120,0,150.0};
-        trains.append(t1); trains.append(t2); trains.append(t3);
-        saveToFiles();
     }
+    out += '"';
+}
 
-    // bookings
-    QFile bf(bookingsFile);
-    if (bf.open(QIODevice::ReadOnly)) {
-        QByteArray data = bf.readAll();
-        QJsonDocument d = QJsonDocument::fromJson(data);
-        if (d.isObject()) {
-            QJsonObject obj = d.object();
-            passengers.clear();
-            waitingList.clear();
-            QJsonArray parr = obj["passengers"].toArray();
-            for (const QJsonValue &v: parr) passengers.append(Passenger::fromJson(v.toObject()));
-            QJsonArray warr = obj["waiting"].toArray();
-            for (const QJsonValue &v: warr) waitingList.enqueue(Passenger::fromJson(v.toObject()));
-        }
-        bf.close();
-    }
-    return true;
+void appendNumber(QByteArray &out, int v) {
+    out += QByteArray::number(v);
 }
 
-bool BookingDatabase::saveToFiles() const {
-    // trains
-    QJsonArray tarr;
-    for (const Train &t: trains) tarr.append(t.toJson());
-    QJsonDocument td(tarr);
-    QFile tf(trainsFile);
-    if (tf.open(QIODevice::WriteOnly)) {
-        tf.write(td.toJson());
-        tf.close();
-    }
+void appendNumber(QByteArray &out, qint64 v) {
+    out += QByteArray::number(v);
+}
 
-    // bookings
-    QJsonObject obj;
-    QJsonArray parr;
-    for (const Passenger &p: passengers) parr.append(p.toJson());
-    obj["passengers"] = parr;
-    QJsonArray warr;
-    for (int i = 0; i < waitingList.size(); ++i) {
-        warr.append(waitingList.at(i).toJson());
-    }
-    obj["waiting"] = warr;
-    QJsonDocument bd(obj);
-    QFile bf(bookingsFile);
-    if (bf.open(QIODevice::WriteOnly)) {
-        bf.write(bd.toJson());
-        bf.close();
-    }
-    return true;
+void appendNumber(QByteArray &out, double v) {
+    // JSON has no NaN/Inf; QJsonValue writes those as null too
+    if (!std::isfinite(v)) { out += "null"; return; }
+    out += QByteArray::number(v, 'g', QLocale::FloatingPointShortest);
 }
 
+} // namespace JsonExport
+
 // -----------------------------
 // FILE: mainwindow.h
 // -----------------------------
@@ -316,7 +6653,14 @@ bool BookingDatabase::saveToFiles() const {
 #include <QPushButton>
 #include <QTableWidget>
 #include <QTextEdit>
+#include <QDateEdit>
+#include <QComboBox>
+#include <QFileSystemWatcher>
+#include <QTimer>
 #include "models.h"
+#include "metricsserver.h"
+#include "dashboard.h"
+#include "browser.h"
 
 class MainWindow : public QMainWindow {
     Q_OBJECT
@@ -327,8 +6671,17 @@ public:
 private slots:
     void onSearch();
     void onBook();
+    void onHold();
     void onCancel();
+    void onStatus();
+    void onCancelTrain();
     void onShowAll();
+    void onDumpMetrics();
+    void onRevenueReport();
+    void onSaveTrace();
+    void onTrainsFileChanged();
+    void onImportTimetable();
+    void onPrepareCharts();
 
 private:
     BookingDatabase db;
@@ -336,22 +6689,44 @@ private:
     // widgets
     QLineEdit *srcEdit;
     QLineEdit *dstEdit;
+    QLineEdit *afterEdit;
+    QLineEdit *beforeEdit;
+    QDateEdit *dateEdit;
     QPushButton *searchBtn;
+    QPushButton *importBtn;
     QTableWidget *trainsTable;
 
     QLineEdit *nameEdit;
     QLineEdit *ageEdit;
     QLineEdit *genderEdit;
     QLineEdit *bookTrainIdEdit;
+    QLineEdit *boardEdit;
+    QLineEdit *alightEdit;
+    QComboBox *quotaBox;
+    QComboBox *classBox;
+    QComboBox *prefBox;
     QPushButton *bookBtn;
+    QPushButton *holdBtn;
 
     QLineEdit *cancelPnrEdit;
     QPushButton *cancelBtn;
+    QPushButton *statusBtn;
+    QLineEdit *cancelTrainEdit;
+    QPushButton *cancelTrainBtn;
+    QPushButton *chartBtn;
 
     QTextEdit *logView;
+    MetricsServer *metricsServer = nullptr; // only when RAILCONNECT_METRICS_PORT is set
+    OccupancyDashboard *dashboard;
+    TicketBrowser *browser;
+    QFileSystemWatcher *trainWatcher;
+    QTimer *reloadTimer;    // coalesces the bursts of change signals one save produces
+    bool reloading = false; // a parse is running on the pool
 
     void setupUi();
     void log(const QString &s);
+    bool readPassenger(Passenger &p);
+    void addTrainRow(const TrainMatch &m, const QString &from, const QString &to);
 };
 
 #endif // MAINWINDOW_H
@@ -366,9 +6741,50 @@ private:
 #include <QLabel>
 #include <QHeaderView>
 #include <QMessageBox>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QDockWidget>
+#include <QUuid>
+#include "importer.h"
+#include "chart.h"
+#include "analytics.h"
+#include "metrics.h"
+#include "trace.h"
 
 MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     setupUi();
+    // holds expire on the engine's timer wheel; tick it once a second, and
+    // pick up edits to the fare rules on the same beat
+    QTimer *holdTimer = new QTimer(this);
+    connect(holdTimer, &QTimer::timeout, this, [this]() {
+        db.expireHolds();
+        QString error;
+        if (db.reloadFareRules(&error)) log("Fare rules reloaded");
+        else if (!error.isEmpty()) log(QString("Fare rules not reloaded: %1").arg(error));
+    });
+    holdTimer->start(1000);
+
+    // edits to trains.json are applied while running; parsing happens on the
+    // thread pool so bookings are not held up by a large file
+    trainWatcher = new QFileSystemWatcher(QStringList{db.trainsPath()}, this);
+    reloadTimer = new QTimer(this);
+    reloadTimer->setSingleShot(true);
+    reloadTimer->setInterval(300);
+    connect(trainWatcher, &QFileSystemWatcher::fileChanged, reloadTimer, qOverload<>(&QTimer::start));
+    connect(reloadTimer, &QTimer::timeout, this, &MainWindow::onTrainsFileChanged);
+
+    // opt-in scrape endpoint for monitoring, localhost only
+    const int port = qEnvironmentVariableIntValue("RAILCONNECT_METRICS_PORT");
+    if (port > 0) {
+        metricsServer = new MetricsServer([this]() { return db.metricsText(); }, this);
+        if (metricsServer->listen(quint16(port))) log(QString("Serving metrics on http://127.0.0.1:%1/metrics").arg(port));
+        else log(QString("Metrics endpoint not started: %1").arg(metricsServer->errorString()));
+    }
 }
 
 MainWindow::~MainWindow() {}
@@ -385,23 +6801,34 @@ void MainWindow::setupUi() {
     QHBoxLayout *searchLay = new QHBoxLayout();
     srcEdit = new QLineEdit(); srcEdit->setPlaceholderText("Source");
     dstEdit = new QLineEdit(); dstEdit->setPlaceholderText("Destination");
+    afterEdit = new QLineEdit(); afterEdit->setPlaceholderText("Departs after (hh:mm)");
+    beforeEdit = new QLineEdit(); beforeEdit->setPlaceholderText("Departs before (hh:mm)");
+    dateEdit = new QDateEdit(QDate::currentDate()); dateEdit->setCalendarPopup(true);
+    dateEdit->setDateRange(QDate::currentDate(), QDate::currentDate().addDays(db.bookingWindow() - 1));
+    connect(dateEdit, &QDateEdit::dateChanged, this, &MainWindow::onShowAll);
     searchBtn = new QPushButton("Search Trains");
     QPushButton *showAllBtn = new QPushButton("Show All Trains");
+    importBtn = new QPushButton("Import Timetable...");
     searchLay->addWidget(new QLabel("Search:"));
+    searchLay->addWidget(dateEdit);
     searchLay->addWidget(srcEdit);
     searchLay->addWidget(dstEdit);
+    searchLay->addWidget(afterEdit);
+    searchLay->addWidget(beforeEdit);
     searchLay->addWidget(searchBtn);
     searchLay->addWidget(showAllBtn);
+    searchLay->addWidget(importBtn);
     mainLay->addLayout(searchLay);
 
     trainsTable = new QTableWidget();
-    trainsTable->setColumnCount(6);
-    trainsTable->setHorizontalHeaderLabels({"Train ID","Name","Source","Destination","Seats (Booked/Total)","Base Fare"});
+    trainsTable->setColumnCount(8);
+    trainsTable->setHorizontalHeaderLabels({"Train ID","Name","From","To","Departs","Arrives","Seats (Booked/Total)","Fare"});
     trainsTable->horizontalHeader()->setStretchLastSection(true);
     mainLay->addWidget(trainsTable, 3);
 
     connect(searchBtn, &QPushButton::clicked, this, &MainWindow::onSearch);
     connect(showAllBtn, &QPushButton::clicked, this, &MainWindow::onShowAll);
+    connect(importBtn, &QPushButton::clicked, this, &MainWindow::onImportTimetable);
 
     // Booking form
     QGroupBox *bookBox = new QGroupBox("Book Ticket");
@@ -410,28 +6837,93 @@ void MainWindow::setupUi() {
     ageEdit = new QLineEdit(); ageEdit->setPlaceholderText("Age");
     genderEdit = new QLineEdit(); genderEdit->setPlaceholderText("Gender");
     bookTrainIdEdit = new QLineEdit(); bookTrainIdEdit->setPlaceholderText("Train ID to book");
+    boardEdit = new QLineEdit(); boardEdit->setPlaceholderText("Boarding station (default: origin)");
+    alightEdit = new QLineEdit(); alightEdit->setPlaceholderText("Alighting station (default: destination)");
+    quotaBox = new QComboBox();
+    quotaBox->addItem("General", int(Quota::General));
+    quotaBox->addItem("Tatkal", int(Quota::Tatkal));
+    quotaBox->addItem("Ladies", int(Quota::Ladies));
+    quotaBox->addItem("Senior Citizen", int(Quota::Senior));
+    classBox = new QComboBox();
+    classBox->addItem("Sleeper (SL)", int(SeatClass::Sleeper));
+    classBox->addItem("AC 3 Tier (3A)", int(SeatClass::ThirdAC));
+    classBox->addItem("AC 2 Tier (2A)", int(SeatClass::SecondAC));
+    classBox->addItem("Chair Car (CC)", int(SeatClass::ChairCar));
+    prefBox = new QComboBox();
+    prefBox->addItem("No preference", -1);
+    prefBox->addItem("Lower", int(Berth::Lower));
+    prefBox->addItem("Middle", int(Berth::Middle));
+    prefBox->addItem("Upper", int(Berth::Upper));
+    prefBox->addItem("Side lower", int(Berth::SideLower));
+    prefBox->addItem("Side upper", int(Berth::SideUpper));
+    prefBox->addItem("Window", int(Berth::Window));
+    prefBox->addItem("Aisle", int(Berth::Aisle));
     bookBtn = new QPushButton("Book");
     bgrid->addWidget(new QLabel("Name:"),0,0); bgrid->addWidget(nameEdit,0,1);
     bgrid->addWidget(new QLabel("Age:"),1,0); bgrid->addWidget(ageEdit,1,1);
     bgrid->addWidget(new QLabel("Gender:"),2,0); bgrid->addWidget(genderEdit,2,1);
     bgrid->addWidget(new QLabel("Train ID:"),3,0); bgrid->addWidget(bookTrainIdEdit,3,1);
-    bgrid->addWidget(bookBtn,4,0,1,2);
+    bgrid->addWidget(new QLabel("From:"),4,0); bgrid->addWidget(boardEdit,4,1);
+    bgrid->addWidget(new QLabel("To:"),5,0); bgrid->addWidget(alightEdit,5,1);
+    bgrid->addWidget(new QLabel("Quota:"),6,0); bgrid->addWidget(quotaBox,6,1);
+    bgrid->addWidget(new QLabel("Class:"),7,0); bgrid->addWidget(classBox,7,1);
+    bgrid->addWidget(new QLabel("Berth:"),8,0); bgrid->addWidget(prefBox,8,1);
+    holdBtn = new QPushButton("Hold && Pay");
+    bgrid->addWidget(bookBtn,9,0); bgrid->addWidget(holdBtn,9,1);
+    connect(holdBtn, &QPushButton::clicked, this, &MainWindow::onHold);
     mainLay->addWidget(bookBox);
     connect(bookBtn, &QPushButton::clicked, this, &MainWindow::onBook);
 
     // Cancellation form
-    QGroupBox *cancelBox = new QGroupBox("Cancel Ticket");
+    QGroupBox *cancelBox = new QGroupBox("Cancel Ticket / PNR Status");
     QHBoxLayout *cLay = new QHBoxLayout(cancelBox);
-    cancelPnrEdit = new QLineEdit(); cancelPnrEdit->setPlaceholderText("PNR to cancel");
+    cancelPnrEdit = new QLineEdit(); cancelPnrEdit->setPlaceholderText("PNR");
     cancelBtn = new QPushButton("Cancel");
-    cLay->addWidget(cancelPnrEdit); cLay->addWidget(cancelBtn);
+    statusBtn = new QPushButton("Status");
+    cancelTrainEdit = new QLineEdit(); cancelTrainEdit->setPlaceholderText("Train ID (whole run on selected date)");
+    cancelTrainBtn = new QPushButton("Cancel Train Run");
+    chartBtn = new QPushButton("Prepare Charts");
+    cLay->addWidget(cancelPnrEdit); cLay->addWidget(statusBtn); cLay->addWidget(cancelBtn);
+    cLay->addWidget(cancelTrainEdit); cLay->addWidget(cancelTrainBtn); cLay->addWidget(chartBtn);
     mainLay->addWidget(cancelBox);
+    connect(cancelTrainBtn, &QPushButton::clicked, this, &MainWindow::onCancelTrain);
+    connect(chartBtn, &QPushButton::clicked, this, &MainWindow::onPrepareCharts);
     connect(cancelBtn, &QPushButton::clicked, this, &MainWindow::onCancel);
+    connect(statusBtn, &QPushButton::clicked, this, &MainWindow::onStatus);
 
     // log view
     logView = new QTextEdit(); logView->setReadOnly(true);
-    mainLay->addWidget(new QLabel("System Log:"));
+    QHBoxLayout *logLay = new QHBoxLayout();
+    QPushButton *metricsBtn = new QPushButton("Dump Metrics");
+    QPushButton *traceBtn = new QPushButton("Save Trace");
+    QPushButton *revenueBtn = new QPushButton("Revenue Report");
+    logLay->addWidget(new QLabel("System Log:"));
+    logLay->addStretch();
+    logLay->addWidget(metricsBtn);
+    logLay->addWidget(traceBtn);
+    logLay->addWidget(revenueBtn);
+    mainLay->addLayout(logLay);
     mainLay->addWidget(logView,1);
+    connect(metricsBtn, &QPushButton::clicked, this, &MainWindow::onDumpMetrics);
+    connect(traceBtn, &QPushButton::clicked, this, &MainWindow::onSaveTrace);
+    connect(revenueBtn, &QPushButton::clicked, this, &MainWindow::onRevenueReport);
+
+    // occupancy beside the main form, fed by the engine's change notifications
+    dashboard = new OccupancyDashboard(db);
+    QDockWidget *dock = new QDockWidget("Occupancy", this);
+    dock->setWidget(dashboard);
+    addDockWidget(Qt::RightDockWidgetArea, dock);
+    // every ticket, paged in as the table scrolls
+    browser = new TicketBrowser(db);
+    QDockWidget *ticketDock = new QDockWidget("Tickets", this);
+    ticketDock->setWidget(browser);
+    addDockWidget(Qt::RightDockWidgetArea, ticketDock);
+    tabifyDockWidget(dock, ticketDock);
+    dock->raise();
+    db.setChangeListener([this](const QString &trainId, const QDate &date) {
+        dashboard->runChanged(trainId, date);
+        browser->changed();
+    });
 
     // show initial trains
     onShowAll();
@@ -442,86 +6934,306 @@ void MainWindow::log(const QString &s) {
     logView->append(ts + " — " + s);
 }
 
+void MainWindow::addTrainRow(const TrainMatch &m, const QString &from, const QString &to) {
+    const Train &t = m.train;
+    int r = trainsTable->rowCount();
+    trainsTable->insertRow(r);
+    trainsTable->setItem(r,0,new QTableWidgetItem(t.trainId));
+    trainsTable->setItem(r,1,new QTableWidgetItem(t.name));
+    trainsTable->setItem(r,2,new QTableWidgetItem(from));
+    trainsTable->setItem(r,3,new QTableWidgetItem(to));
+    trainsTable->setItem(r,4,new QTableWidgetItem(Timetable::formatTime(m.departure)));
+    trainsTable->setItem(r,5,new QTableWidgetItem(Timetable::formatTime(m.arrival)));
+    // one class: booked/total as before; several: booked/total and fare per class
+    QStringList seats, fares;
+    const QVector<int> capacity = t.classSeats();
+    for (const ClassOffer &o: m.classes) {
+        const int total = capacity[int(o.seatClass)];
+        seats << QString("%1 %2/%3").arg(classCode(o.seatClass)).arg(total - o.available).arg(total);
+        fares << QString("%1 %2").arg(classCode(o.seatClass)).arg(o.fare, 0, 'f', 2);
+    }
+    if (m.classes.size() <= 1) {
+        seats = QStringList{QString("%1/%2").arg(t.bookedSeats).arg(t.totalSeats)};
+        fares = QStringList{QString::number(m.fare, 'f', 2)};
+    }
+    trainsTable->setItem(r,6,new QTableWidgetItem(seats.join("  ")));
+    trainsTable->setItem(r,7,new QTableWidgetItem(fares.join("  ")));
+}
+
+void MainWindow::onDumpMetrics() {
+#ifdef RAILCONNECT_METRICS
+    log("Metrics snapshot:\n" + Metrics::snapshot().toText());
+#else
+    log("Metrics are compiled out (configure with RAILCONNECT_METRICS=ON).");
+#endif
+}
+
+void MainWindow::onSaveTrace() {
+#ifdef RAILCONNECT_TRACING
+    // open in chrome://tracing or ui.perfetto.dev
+    const QString path = "railconnect-trace.json";
+    QSaveFile f(path);
+    if (f.open(QIODevice::WriteOnly) && Trace::writeJson(f) && f.commit()) log("Trace saved to " + path);
+    else log("Could not write " + path);
+#else
+    log("Tracing is compiled out (configure with RAILCONNECT_TRACING=ON).");
+#endif
+}
+
+void MainWindow::onRevenueReport() {
+    RC_TRACE("MainWindow::onRevenueReport");
+    // current and archived tickets; the columns are also saved for use elsewhere
+    const Analytics::Columns cols = Analytics::Columns::fromBookings(db);
+    const QString path = "bookings.rcol";
+    QSaveFile f(path);
+    if (f.open(QIODevice::WriteOnly) && Analytics::write(f, cols) && f.commit()) log(QString("%1 ticket(s) exported to %2").arg(cols.size()).arg(path));
+    else log("Could not write " + path);
+
+    QStringList lines;
+    for (const Analytics::Group &g: Analytics::groupBy(cols, Analytics::ByClass))
+        lines << QString("  %1: %2 ticket(s), %3").arg(classCode(SeatClass(g.seatClass))).arg(g.tickets).arg(g.revenue, 0, 'f', 2);
+    lines << "Top routes:";
+    const QVector<Analytics::Group> routes = Analytics::groupBy(cols, Analytics::ByRoute);
+    for (int i = 0; i < qMin(10, int(routes.size())); ++i)
+        lines << QString("  %1: %2 ticket(s), %3").arg(cols.routes.values[routes[i].route]).arg(routes[i].tickets).arg(routes[i].revenue, 0, 'f', 2);
+    lines << "By day:";
+    QVector<Analytics::Group> days = Analytics::groupBy(cols, Analytics::ByDay);
+    std::sort(days.begin(), days.end(), [](const Analytics::Group &a, const Analytics::Group &b) { return a.day < b.day; });
+    for (const Analytics::Group &g: days)
+        lines << QString("  %1: %2 ticket(s), %3").arg(g.day.toString(Qt::ISODate)).arg(g.tickets).arg(g.revenue, 0, 'f', 2);
+    log("Revenue by class:\n" + lines.join('\n'));
+}
+
+void MainWindow::onTrainsFileChanged() {
+    // editors that save by renaming a new file into place drop the watch
+    if (!trainWatcher->files().contains(db.trainsPath())) trainWatcher->addPath(db.trainsPath());
+    if (reloading) { reloadTimer->start(); return; }
+    reloading = true;
+    auto *parse = new QFutureWatcher<TrainFile>(this);
+    connect(parse, &QFutureWatcherBase::finished, this, [this, parse]() {
+        reloading = false;
+        parse->deleteLater();
+        const TrainDiff d = db.applyTrainFile(parse->result());
+        if (d.isEmpty()) return; // our own save, no change, or a half-written file
+        log(QString("Trains reloaded: %1 added, %2 updated, %3 removed").arg(d.added).arg(d.updated).arg(d.removed));
+        if (d.reseated + d.requeued + d.cancelled + d.holdsReleased > 0)
+            log(QString("Bookings on changed trains: %1 re-seated, %2 moved to RAC/waitlist, %3 cancelled, %4 hold(s) released")
+                    .arg(d.reseated).arg(d.requeued).arg(d.cancelled).arg(d.holdsReleased));
+        onShowAll();
+    });
+    parse->setFuture(QtConcurrent::run(&BookingDatabase::readTrainFile, db.trainsPath()));
+}
+
+void MainWindow::onImportTimetable() {
+    RC_TRACE("MainWindow::onImportTimetable");
+    const QString path = QFileDialog::getOpenFileName(this, "Import Timetable", QString(),
+                                                      "Timetables (*.csv *.txt);;All files (*)");
+    if (path.isEmpty()) return;
+    // any file of a GTFS feed stands for its directory
+    const QFileInfo info(path);
+    const QStringList gtfs{"stops.txt", "trips.txt", "stop_times.txt"};
+    const bool isGtfs = gtfs.contains(info.fileName());
+    const QString source = isGtfs ? info.absolutePath() : path;
+    importBtn->setEnabled(false);
+    log(QString("Importing %1...").arg(source));
+    auto timer = std::make_shared<QElapsedTimer>();
+    timer->start();
+    auto parse = new QFutureWatcher<TimetableImport::Result>(this);
+    connect(parse, &QFutureWatcherBase::finished, this, [this, parse, timer]() {
+        importBtn->setEnabled(true);
+        parse->deleteLater();
+        const TimetableImport::Result res = parse->result();
+        if (!res.error.isEmpty()) {
+            log(QString("Import failed: %1").arg(res.error));
+            return;
+        }
+        const qint64 parsed = timer->elapsed();
+        const int added = db.addTrains(res.trains);
+        log(QString("Imported %1 of %2 train(s) from %3 stop row(s) in %4 ms (%5 ms parsing); %6 row(s) skipped")
+            .arg(added).arg(res.trains.size()).arg(res.rows).arg(timer->elapsed()).arg(parsed).arg(res.skipped));
+        onShowAll();
+    });
+    if (isGtfs) parse->setFuture(QtConcurrent::run([source]() { return TimetableImport::readGtfs(source); }));
+    else parse->setFuture(QtConcurrent::run([source]() { return TimetableImport::readCsv(source); }));
+}
+
 void MainWindow::onShowAll() {
+    RC_TRACE("MainWindow::onShowAll");
     trainsTable->setRowCount(0);
-    for (const Train &t: db.trains) {
-        int r = trainsTable->rowCount();
-        trainsTable->insertRow(r);
-        trainsTable->setItem(r,0,new QTableWidgetItem(t.trainId));
-        trainsTable->setItem(r,1,new QTableWidgetItem(t.name));
-        trainsTable->setItem(r,2,new QTableWidgetItem(t.source));
-        trainsTable->setItem(r,3,new QTableWidgetItem(t.destination));
-        trainsTable->setItem(r,4,new QTableWidgetItem(QString("%1/%2").arg(t.bookedSeats).arg(t.totalSeats)));
-        trainsTable->setItem(r,5,new QTableWidgetItem(QString::number(t.baseFare)));
-    }
+    for (const TrainMatch &m: db.allTrains(dateEdit->date())) addTrainRow(m, m.train.source, m.train.destination);
 }
 
 void MainWindow::onSearch() {
+    RC_TRACE("MainWindow::onSearch");
     QString s = srcEdit->text().trimmed();
     QString d = dstEdit->text().trimmed();
     if (s.isEmpty() || d.isEmpty()) {
         QMessageBox::warning(this, "Input needed", "Please enter both source and destination.");
         return;
     }
-    QVector<Train> res = db.searchTrains(s,d);
+    int after = Timetable::parseTime(afterEdit->text());
+    int before = Timetable::parseTime(beforeEdit->text());
+    if ((after < 0 && !afterEdit->text().trimmed().isEmpty()) ||
+        (before < 0 && !beforeEdit->text().trimmed().isEmpty())) {
+        QMessageBox::warning(this, "Invalid time", "Times must be given as hh:mm.");
+        return;
+    }
+    QVector<TrainMatch> res = db.searchTrains(s,d,dateEdit->date(),after,before);
     trainsTable->setRowCount(0);
-    for (const Train &t: res) {
-        int r = trainsTable->rowCount();
-        trainsTable->insertRow(r);
-        trainsTable->setItem(r,0,new QTableWidgetItem(t.trainId));
-        trainsTable->setItem(r,1,new QTableWidgetItem(t.name));
-        trainsTable->setItem(r,2,new QTableWidgetItem(t.source));
-        trainsTable->setItem(r,3,new QTableWidgetItem(t.destination));
-        trainsTable->setItem(r,4,new QTableWidgetItem(QString("%1/%2").arg(t.bookedSeats).arg(t.totalSeats)));
-        trainsTable->setItem(r,5,new QTableWidgetItem(QString::number(t.baseFare)));
+    for (const TrainMatch &m: res) {
+        addTrainRow(m, db.timetable.stationName(db.timetable.stationId(s)),
+                    db.timetable.stationName(db.timetable.stationId(d)));
     }
     log(QString("Searched trains: %1 -> %2 (found %3)").arg(s).arg(d).arg(res.size()));
+    if (res.isEmpty()) {
+        // no direct train: suggest connections
+        for (const Journey &j: db.planJourneys(s, d, qMax(0, after))) {
+            QStringList legs;
+            for (const JourneyLeg &l: j.legs) {
+                const StopTime *route = db.timetable.stops(l.train);
+                legs << QString("%1 %2 %3 -> %4 %5").arg(db.trains[l.train].trainId)
+                        .arg(db.timetable.stationName(route[l.fromStop].station)).arg(Timetable::formatTime(l.departure))
+                        .arg(db.timetable.stationName(route[l.toStop].station)).arg(Timetable::formatTime(l.arrival));
+            }
+            log(QString("Journey with %1 change(s): %2").arg(j.transfers()).arg(legs.join(" | ")));
+        }
+    }
 }
 
-void MainWindow::onBook() {
+bool MainWindow::readPassenger(Passenger &p) {
     QString name = nameEdit->text().trimmed();
     int age = ageEdit->text().toInt();
     QString gender = genderEdit->text().trimmed();
     QString trainId = bookTrainIdEdit->text().trimmed();
     if (name.isEmpty() || age<=0 || gender.isEmpty() || trainId.isEmpty()) {
         QMessageBox::warning(this, "Missing info", "Please fill all passenger and train ID fields.");
+        return false;
+    }
+    p.name = name; p.age = age; p.gender = gender; p.trainId = trainId;
+    p.journeyDate = dateEdit->date();
+    p.quota = Quota(quotaBox->currentData().toInt());
+    p.seatClass = SeatClass(classBox->currentData().toInt());
+    p.berthPref = prefBox->currentData().toInt();
+    QString board = boardEdit->text().trimmed();
+    QString alight = alightEdit->text().trimmed();
+    if (!board.isEmpty()) p.fromStop = db.stopIndex(trainId, board);
+    if (!alight.isEmpty()) p.toStop = db.stopIndex(trainId, alight);
+    if (p.fromStop < 0 || (!alight.isEmpty() && p.toStop < 0)) {
+        QMessageBox::warning(this, "Invalid stations", "The train does not call at the given station.");
+        return false;
+    }
+    return true;
+}
+
+void MainWindow::onHold() {
+    RC_TRACE("MainWindow::onHold");
+    Passenger p;
+    if (!readPassenger(p)) return;
+    quint64 hold = db.holdSeats(p.trainId, {p});
+    if (!hold) {
+        QMessageBox::warning(this, "Unavailable", "No seat could be held on this train for that journey.");
         return;
     }
+    log(QString("Seat held for %1 on %2 (hold %3)").arg(p.name).arg(p.trainId).arg(hold));
+    onShowAll();
+    // the hold keeps the seat while the payment step runs
+    if (QMessageBox::question(this, "Payment", "Seat held for 10 minutes. Confirm payment?") == QMessageBox::Yes) {
+        // one key per checkout: confirming it again cannot book twice
+        QStringList pnrs = db.confirmHold(hold, QUuid::createUuid().toString(QUuid::WithoutBraces));
+        if (pnrs.isEmpty()) {
+            QMessageBox::warning(this, "Expired", "The hold expired before payment was confirmed.");
+        } else {
+            QMessageBox::information(this, "Booked", QString("Ticket booked. PNR: %1").arg(pnrs.join(", ")));
+            log(QString("Booked: %1 on %2 (PNR %3)").arg(p.name).arg(p.trainId).arg(pnrs.join(", ")));
+        }
+    } else {
+        db.releaseHold(hold);
+        log(QString("Hold %1 released").arg(hold));
+    }
+    onShowAll();
+}
+
+void MainWindow::onBook() {
+    RC_TRACE("MainWindow::onBook");
     Passenger p;
-    p.name = name; p.age = age; p.gender = gender; p.trainId = trainId;
-    bool ok = db.bookTicket(trainId, p);
-    if (ok) {
-        Passenger *np = nullptr;
-        // find last passenger with same name (crudely)
-        for (int i = db.passengers.size()-1; i>=0; --i) {
-            if (db.passengers[i].name == p.name && db.passengers[i].trainId == p.trainId) { np = &db.passengers[i]; break; }
-        }
-        if (np) {
-            QMessageBox::information(this, "Booked", QString("Ticket booked. PNR: %1\nSeat: %2\nFare: %3").arg(np->pnr).arg(np->seatNo).arg(np->fare));
-            log(QString("Booked: %1 on %2 (PNR %3)").arg(np->name).arg(np->trainId).arg(np->pnr));
+    if (!readPassenger(p)) return;
+    QString trainId = p.trainId;
+    Passenger np;
+    if (db.bookTicket(trainId, p, &np) == BookResult::Booked) {
+        if (np.status == BookingStatus::Confirmed) {
+            QMessageBox::information(this, "Booked", QString("Ticket booked. PNR: %1\nSeat: %2\nFare: %3")
+                                     .arg(np.pnr).arg(db.findTrain(np.trainId)->seatLabel(np.seatNo)).arg(np.fare));
+            log(QString("Booked: %1 on %2 (PNR %3)").arg(np.name).arg(np.trainId).arg(np.pnr));
         } else {
-            QMessageBox::information(this, "Waiting List", "Train full: passenger added to waiting list.");
-            log(QString("Added to waiting list: %1 for %2").arg(p.name).arg(p.trainId));
+            QString st = QString("%1 %2").arg(statusCode(np.status)).arg(db.waitlistPosition(np.pnr));
+            QMessageBox::information(this, "Waiting List", QString("Train full: ticket is %1.\nPNR: %2").arg(st).arg(np.pnr));
+            log(QString("Added to waiting list: %1 for %2 (PNR %3, %4)").arg(p.name).arg(p.trainId).arg(np.pnr).arg(st));
         }
         onShowAll();
     } else {
-        QMessageBox::warning(this, "Failed", "Booking failed (train not found).");
+        QMessageBox::warning(this, "Failed", "Booking failed (train not found, class not on this train, or date outside the booking window).");
     }
 }
 
-void MainWindow::onCancel() {
+void MainWindow::onStatus() {
+    RC_TRACE("MainWindow::onStatus");
     QString pnr = cancelPnrEdit->text().trimmed();
-    if (pnr.isEmpty()) { QMessageBox::warning(this, "Missing", "Enter PNR to cancel."); return; }
-    bool ok = db.cancelTicket(pnr);
-    if (ok) {
-        QMessageBox::information(this, "Cancelled", "Ticket cancelled successfully.");
-        log(QString("Cancelled PNR: %1").arg(pnr));
+    if (pnr.isEmpty()) { QMessageBox::warning(this, "Missing", "Enter PNR to check."); return; }
+    if (const Passenger *p = db.findPassenger(pnr)) {
+        const Train *t = db.findTrain(p->trainId);
+        QMessageBox::information(this, "PNR Status", QString("%1: confirmed on %2, %3 seat %4")
+                                 .arg(pnr).arg(p->trainId).arg(classCode(p->seatClass))
+                                 .arg(t ? t->seatLabel(p->seatNo) : QString::number(p->seatNo)));
+    } else if (const Passenger *w = db.waitlist.find(pnr)) {
+        QMessageBox::information(this, "PNR Status", QString("%1: %2 %3 (%4 quota) on %5")
+                                 .arg(pnr).arg(statusCode(w->status)).arg(db.waitlistPosition(pnr))
+                                 .arg(quotaCode(w->quota)).arg(w->trainId));
+    } else {
+        QMessageBox::warning(this, "Not found", "PNR not found.");
+    }
+}
+
+void MainWindow::onCancel() {
+    RC_TRACE("MainWindow::onCancel");
+    // one PNR, or several separated by spaces/commas
+    QStringList pnrs = cancelPnrEdit->text().split(QRegularExpression("[\\s,;]+"), Qt::SkipEmptyParts);
+    if (pnrs.isEmpty()) { QMessageBox::warning(this, "Missing", "Enter PNR to cancel."); return; }
+    int n = db.cancelMany(pnrs);
+    if (n > 0) {
+        QMessageBox::information(this, "Cancelled", QString("%1 of %2 ticket(s) cancelled successfully.").arg(n).arg(pnrs.size()));
+        log(QString("Cancelled PNR: %1").arg(pnrs.join(", ")));
         onShowAll();
     } else {
         QMessageBox::warning(this, "Not found", "PNR not found.");
     }
 }
 
+void MainWindow::onCancelTrain() {
+    RC_TRACE("MainWindow::onCancelTrain");
+    QString trainId = cancelTrainEdit->text().trimmed();
+    if (trainId.isEmpty() || !db.findTrain(trainId)) { QMessageBox::warning(this, "Not found", "Enter a valid train ID."); return; }
+    QDate date = dateEdit->date();
+    if (QMessageBox::question(this, "Cancel train run",
+            QString("Cancel every booking on %1 for %2?").arg(trainId).arg(date.toString(Qt::ISODate))) != QMessageBox::Yes)
+        return;
+    int n = db.cancelTrain(trainId, date);
+    log(QString("Cancelled run %1 on %2: %3 ticket(s) dropped").arg(trainId).arg(date.toString(Qt::ISODate)).arg(n));
+    onShowAll();
+}
+
+void MainWindow::onPrepareCharts() {
+    RC_TRACE("MainWindow::onPrepareCharts");
+    // every train with passengers on the selected date, as CSV and as printable text
+    const QDate date = dateEdit->date();
+    const QString dir = "charts";
+    QStringList failed;
+    const int csv = Chart::writeAll(db, date, dir, Chart::Csv, &failed);
+    const int text = Chart::writeAll(db, date, dir, Chart::Text, &failed);
+    failed.removeDuplicates();
+    log(QString("Charts for %1: %2 train(s) written to %3/").arg(date.toString(Qt::ISODate)).arg(qMax(csv, text)).arg(dir));
+    if (!failed.isEmpty()) log(QString("Charts not written for: %1").arg(failed.join(", ")));
+}
+
 // -----------------------------
 // FILE: main.cpp
 // -----------------------------